@@ -14,6 +14,7 @@
 
 #include <limits.h>
 #include <stdint.h>
+#include <sys/types.h>
 #include <sysfs/libsysfs.h>
 #include <sysfs/dlist.h>
 
@@ -40,66 +41,412 @@ enum sensor_type {
 	SENSOR_VOLT,
 	SENSOR_UNKOWN
 };
-const char* sensor_prefix[SENSOR_UNKOWN];
+extern const char* sensor_prefix[SENSOR_UNKOWN];
 
 struct iio_event_data {
 	int id;
 	int64_t timestamp;
 };
 
-/* name has to be the first element in all
- * structs to allow sorting.
+/* Names and paths in all structs point into the string pool, see
+ * iio_intern(). Equal names are the same pointer.
  */
 struct iio_device {
-	char name[SYSFS_NAME_LEN];
-	char path[SYSFS_PATH_MAX];
+	const char *name;
+	const char *path;
 	unsigned number;
 /*	char module[SYSFS_NAME_LEN]; */
 	struct iio_ring_buffer *buffer;
-	struct dlist *channellist;
+	struct iio_channel *channels;	/* sorted by name, see iio_get_device_channels() */
+	unsigned num_channels;
+	float *raw;		/* per channel values, indexed by iio_channel.index */
+	float *scale;
+	float *offset;
+	struct iio_attribute *attrs;	/* sorted by name, see iio_get_device_channels() */
+	unsigned num_attrs;
+};
+
+/* One attribute file of a device, the value is read on first use */
+struct iio_attribute {
+	const char *name;
+	float value;
+	int cached;
 };
 
 struct iio_channel {
-	char name[SYSFS_NAME_LEN];
+	const char *name;
 	struct iio_device *dev;
-	float raw;
-	float scale;
-	float offset;
+	unsigned index;		/* position in dev->channels and the value arrays */
 	enum sensor_type type;
+	int raw_fd;		/* see iio_channel_open_raw(), -1 if closed */
 };
 
 struct iio_ring_buffer {
 	unsigned number;
-	char path[SYSFS_PATH_MAX];
-	char event[SYSFS_PATH_MAX];
-	char access[SYSFS_PATH_MAX];
+	const char *path;
+	const char *event;
+	const char *access;
 	struct iio_device *device;
 };
 
 struct iio_scan_element {
-	char name[SYSFS_NAME_LEN];
+	const char *name;
 	unsigned index;
 	unsigned bits;
+	unsigned storagebits;
+	unsigned shift;
+	int is_signed;
+	int big_endian;
 	int enabled;
 	struct iio_channel *channel;
 };
 
-static inline void iio_name_from_attribute(char *name, const char *attr_name) {
-	snprintf(name, strlen(attr_name) - strlen(IIO_MOD_RAW), "%s", attr_name);
+/* Position of one enabled scan element inside a scan,
+ * see iio_scan_layout_new().
+ */
+struct iio_scan_slot {
+	unsigned offset;	/* byte offset from the start of the scan */
+	unsigned bytes;		/* storage width: 1, 2 or 4 bytes */
+	unsigned shift;
+	unsigned bits;
+	uint32_t mask;
+	int is_signed;
+	float scale;		/* taken from the channel, if known */
+	float value_offset;
+	const struct iio_scan_element *elem;
+};
+
+struct iio_scan_layout {
+	unsigned scan_size;	/* bytes per scan including padding */
+	int ts_offset;		/* byte offset of the timestamp or -1 */
+	unsigned num_slots;
+	struct iio_scan_slot slots[];
+};
+
+enum iio_filter_type {
+	IIO_FILTER_PICK,
+	IIO_FILTER_MEAN,
+	IIO_FILTER_CIC,
+	IIO_FILTER_FIR,
+	IIO_FILTER_UNKNOWN
+};
+extern const char *iio_filter_name[IIO_FILTER_UNKNOWN];
+
+struct iio_filter_slot {
+	enum iio_filter_type type;
+	unsigned num_taps;
+	float *taps;
+	float *history;		/* num_taps - 1 older inputs, then the block */
+};
+
+/* Decimation of scans by an integer factor, see iio_filter_new() */
+struct iio_filter {
+	unsigned factor;
+	unsigned phase;		/* scans since the last kept one */
+	int primed;		/* history holds real inputs */
+	size_t max_scans;
+	unsigned num_slots;
+	struct iio_filter_slot slots[];
+};
+
+/* Scans per packed block, see iio_pack_block() */
+#define IIO_PACK_SCANS 256
+
+struct iio_pack_header {
+	uint32_t size;		/* bytes of packed data that follow */
+	uint32_t nscans;
+};
+
+enum iio_capture_encoding {
+	IIO_CAPTURE_RAW,	/* scans as read from the ring */
+	IIO_CAPTURE_PACKED,	/* blocks of iio_pack_block() */
+};
+
+/* A capture file opened for reading, see iio_capture_open() */
+struct iio_capture {
+	int fd;
+	enum iio_capture_encoding encoding;
+	char *block;		/* packed data being read */
+	char device[SYSFS_NAME_LEN];
+	char trigger[SYSFS_NAME_LEN];
+	struct iio_scan_layout *layout;
+	struct iio_scan_element *elements;
+};
+
+enum iio_output_format {
+	IIO_OUTPUT_TABLE,
+	IIO_OUTPUT_CSV,
+	IIO_OUTPUT_XML,
+};
+
+/* Buffered text output of scans, see iio_output_new() */
+struct iio_output {
+	int fd;
+	enum iio_output_format format;
+	const struct iio_scan_layout *layout;
+	unsigned precision;	/* decimals per value */
+	char **prefix;		/* preformatted text in front of each value */
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+#define IIO_CACHE_LINE 64
+
+/*
+ * Queue of data blocks between one producer and one consumer thread,
+ * see iio_queue_new(). head and tail are only written by one side each
+ * and live on separate cache lines.
+ */
+struct iio_queue {
+	unsigned depth;		/* number of blocks, a power of two */
+	size_t block_size;
+	char *blocks;
+	size_t *lengths;	/* bytes used in each block */
+	unsigned long full;	/* times the producer found no free block */
+	unsigned max_fill;	/* most blocks queued at once */
+	char pad0[IIO_CACHE_LINE];
+	unsigned head;		/* next block to fill, producer side */
+	char pad1[IIO_CACHE_LINE];
+	unsigned tail;		/* next block to consume, consumer side */
+	char pad2[IIO_CACHE_LINE];
+};
+
+/* Limits of a request to a ring data server, see iio_serve.c */
+#define IIO_SERVE_REQUEST_MAX 1024
+#define IIO_SERVE_MAX_ELEMENTS 64
+#define IIO_SERVE_MAX_BLOCK 65536
+
+struct iio_serve_request {
+	const char *device;		/* interned */
+	unsigned block;			/* scans per frame */
+	unsigned num_elements;		/* 0 for all */
+	const char *elements[IIO_SERVE_MAX_ELEMENTS];
+};
+
+/* Start of every frame a server sends, followed by nscans raw scans */
+struct iio_serve_frame {
+	uint32_t nscans;
+	uint32_t dropped;	/* scans not sent since the last frame */
+};
+
+struct iio_shm_header;
+
+/* Capture attributes of a device, see iio_setup_open() */
+struct iio_setup_element {
+	struct iio_scan_element *elem;
+	int fd;				/* of <element>_en */
+	int old;			/* before iio_setup_apply() */
+};
+
+struct iio_setup {
+	int trigger_fd;			/* -1 without a trigger */
+	int length_fd;
+	int enable_fd;
+	int truncate;			/* plain files, not sysfs */
+	char trigger[SYSFS_NAME_LEN];	/* state of the device */
+	unsigned length;
+	int enabled;
+	unsigned num_elements;
+	struct iio_setup_element elements[];
+};
+
+/* What iio_setup_apply() changes */
+struct iio_setup_config {
+	const char *trigger;		/* NULL keeps the trigger */
+	const char *const *elements;	/* interned names of scan elements or
+					 * their channels to enable, all
+					 * others but the timestamp are
+					 * disabled */
+	unsigned num_elements;		/* 0 keeps the scan elements */
+	unsigned length;		/* 0 keeps the ring length */
+	int enable;			/* state of the ring afterwards */
+};
+
+/* Requests in flight on an io_uring, see lib/iio_uring.c */
+struct iio_uring;
+struct iovec;
+
+/* Writer side of a shared memory ring of scans, see iio_shm_create() */
+struct iio_shm {
+	char name[SYSFS_NAME_LEN];
+	struct iio_shm_header *hdr;
+	size_t size;
+};
+
+/* Reader side of a shared memory ring, see iio_shm_open() */
+struct iio_shm_reader {
+	struct iio_shm_header *hdr;
+	size_t size;
+	int can_wait;		/* segment is writable, sleep on the futex */
+	uint64_t next;		/* next scan to read */
+	unsigned long lost;	/* scans overwritten before they were read */
+	char device[SYSFS_NAME_LEN];
+	struct iio_scan_layout *layout;
+	struct iio_scan_element *elements;
+};
+
+/* The string pool is process-wide and grows until exit: only names found
+ * in sysfs or given on the command line are interned, anything else is
+ * looked up with iio_intern_find().
+ */
+const char *iio_intern(const char *s);
+const char *iio_intern_len(const char *s, size_t len);
+const char *iio_intern_find(const char *s, size_t len);
+const char *iio_intern_printf(const char *fmt, ...)
+	__attribute__((format(printf, 1, 2)));
+
+static inline const char *iio_name_from_attribute(const char *attr_name) {
+	return iio_intern_len(attr_name, strlen(attr_name) - strlen(IIO_MOD_RAW) - 1);
+}
+
+#define iio_device_for_each_channel(dev, chan) \
+	for ((chan) = (dev)->channels; \
+	     (chan) < (dev)->channels + (dev)->num_channels; (chan)++)
+
+static inline float iio_channel_raw(const struct iio_channel *chan) {
+	return chan->dev->raw[chan->index];
 }
 
+static inline float iio_channel_scale(const struct iio_channel *chan) {
+	return chan->dev->scale[chan->index];
+}
+
+static inline float iio_channel_offset(const struct iio_channel *chan) {
+	return chan->dev->offset[chan->index];
+}
+
+static inline float iio_channel_value(const struct iio_channel *chan) {
+	const struct iio_device *dev = chan->dev;
+	return (dev->raw[chan->index] + dev->offset[chan->index]) *
+		dev->scale[chan->index];
+}
+
+static inline unsigned next_power_of_two(unsigned x)
+{
+	x = x - 1;
+	x = x | (x >> 1);
+	x = x | (x >> 2);
+	x = x | (x >> 4);
+	x = x | (x >> 8);
+	x = x | (x >>16);
+	return x + 1;
+}
+
+int iio_set_root(const char *root);
 void iio_close_device(struct iio_device *iio_dev);
 struct iio_device *iio_open_device_from_sysfs(struct sysfs_device *sysfs_dev);
 struct iio_device *iio_open_device_by_name(const char *name);
 struct iio_device *iio_open_device_path(const char *path);
 
 float iio_get_channel_modifier(struct iio_device *dev, const char *chan_name, const char *mod_name, float def_value);
-struct dlist *iio_get_device_channels(struct iio_device *dev);
+struct iio_channel *iio_get_device_channels(struct iio_device *dev);
+struct iio_channel *iio_find_channel(struct iio_device *dev, const char *name);
+void iio_device_convert(const struct iio_device *dev, float *values);
+int iio_channel_open_raw(struct iio_channel *chan);
+void iio_channel_close_raw(struct iio_channel *chan);
+int iio_channel_read_raw(struct iio_channel *chan);
+int iio_device_read_raw(struct iio_device *dev);
 
 struct iio_ring_buffer *iio_get_ring_buffer(struct iio_device *iio_dev);
 int iio_get_ring_buffer_bps(struct iio_ring_buffer *buf);
 int iio_get_ring_buffer_length(struct iio_ring_buffer *buf);
 int iio_is_ring_buffer_enabled(struct iio_ring_buffer *buf);
+float iio_get_sampling_frequency(struct iio_device *iio_dev);
+struct dlist *iio_get_ring_buffer_scan_elements(struct iio_ring_buffer *buffer);
+
+struct iio_scan_layout *iio_scan_layout_new(struct dlist *scan_elements);
+struct iio_scan_layout *iio_scan_layout_select(const struct iio_scan_layout *layout,
+		const char *const *names, unsigned num_names, unsigned *map);
+void iio_scan_layout_free(struct iio_scan_layout *layout);
+size_t iio_scan_decode(const struct iio_scan_layout *layout, const char *data,
+		size_t len, int32_t *samples, size_t stride, int64_t *timestamps);
+void iio_scan_encode(const struct iio_scan_layout *layout, const int32_t *samples,
+		size_t stride, const int64_t *timestamps, size_t nscans, char *data);
+void iio_scan_convert(const struct iio_scan_layout *layout,
+		const int32_t *samples, float *values, size_t stride, size_t nscans);
+const char *iio_scan_convert_name(void);
+int iio_scan_convert_use(const char *name);
+
+enum iio_filter_type iio_filter_type_from_name(const char *name);
+struct iio_filter *iio_filter_new(const struct iio_scan_layout *layout,
+		unsigned factor, const enum iio_filter_type *types, size_t max_scans);
+void iio_filter_free(struct iio_filter *filter);
+size_t iio_filter_run(struct iio_filter *filter, float *values, size_t stride,
+		int64_t *timestamps, size_t nscans);
+
+size_t iio_pack_bound(const struct iio_scan_layout *layout, size_t nscans);
+size_t iio_pack_block(const struct iio_scan_layout *layout,
+		const int32_t *samples, size_t stride, const int64_t *timestamps,
+		size_t nscans, char *out);
+ssize_t iio_unpack_block(const struct iio_scan_layout *layout, const char *in,
+		const struct iio_pack_header *hdr, int32_t *samples, size_t stride,
+		int64_t *timestamps);
+
+size_t iio_capture_header_size(const struct iio_scan_layout *layout);
+void iio_capture_format_header(char *buf, const char *device,
+		const char *trigger, const struct iio_scan_layout *layout,
+		enum iio_capture_encoding encoding);
+int iio_capture_write_header(int fd, const char *device, const char *trigger,
+		const struct iio_scan_layout *layout,
+		enum iio_capture_encoding encoding);
+int iio_capture_write_block(int fd, const char *data, size_t len);
+int iio_capture_write_packed(int fd, const struct iio_scan_layout *layout,
+		const int32_t *samples, size_t stride, const int64_t *timestamps,
+		size_t nscans, char *buf);
+struct iio_capture *iio_capture_open_fd(int fd, const char *path);
+struct iio_capture *iio_capture_open(const char *path);
+ssize_t iio_capture_read_packed(struct iio_capture *cap, int32_t *samples,
+		size_t stride, int64_t *timestamps);
+void iio_capture_close(struct iio_capture *cap);
+
+struct iio_output *iio_output_new(int fd, enum iio_output_format format,
+		const struct iio_scan_layout *layout, const char *device);
+int iio_output_scans(struct iio_output *out, const float *values,
+		size_t stride, const int64_t *timestamps, size_t nscans);
+int iio_output_flush(struct iio_output *out);
+int iio_output_close(struct iio_output *out);
+
+struct iio_shm *iio_shm_create(const char *name, const char *device,
+		const struct iio_scan_layout *layout, unsigned capacity);
+void iio_shm_publish(struct iio_shm *shm, const int32_t *samples, size_t stride,
+		const int64_t *timestamps, size_t nscans);
+void iio_shm_close(struct iio_shm *shm);
+struct iio_shm_reader *iio_shm_open(const char *name);
+size_t iio_shm_read(struct iio_shm_reader *reader, int32_t *samples,
+		size_t stride, int64_t *timestamps);
+int iio_shm_wait(struct iio_shm_reader *reader, unsigned timeout_ms);
+void iio_shm_reader_close(struct iio_shm_reader *reader);
+
+int iio_serve_parse_request(const char *line, struct iio_serve_request *req);
+struct iio_capture *iio_serve_connect(const char *path,
+		const struct iio_serve_request *req);
+ssize_t iio_serve_read_frame(struct iio_capture *cap, char *data,
+		size_t max_scans, unsigned long *dropped);
+
+struct iio_queue *iio_queue_new(unsigned depth, size_t block_size);
+void iio_queue_free(struct iio_queue *q);
+char *iio_queue_reserve(struct iio_queue *q);
+int iio_queue_has_space(struct iio_queue *q);
+void iio_queue_commit(struct iio_queue *q, size_t len);
+const char *iio_queue_peek(struct iio_queue *q, size_t *len);
+void iio_queue_release(struct iio_queue *q);
+
+struct iio_setup *iio_setup_open(struct iio_ring_buffer *buffer,
+		struct dlist *scan_elements);
+int iio_setup_apply(struct iio_setup *setup, const struct iio_setup_config *config);
+void iio_setup_close(struct iio_setup *setup);
+
+struct iio_uring *iio_uring_new(unsigned entries);
+void iio_uring_free(struct iio_uring *ring);
+int iio_uring_register_buffers(struct iio_uring *ring, const struct iovec *iov,
+		unsigned n);
+int iio_uring_read(struct iio_uring *ring, int fd, void *buf, unsigned len,
+		int buf_index, uint64_t tag);
+int iio_uring_write(struct iio_uring *ring, int fd, const void *buf,
+		unsigned len, int buf_index, uint64_t tag);
+int iio_uring_submit(struct iio_uring *ring, unsigned wait);
+int iio_uring_complete(struct iio_uring *ring, uint64_t *tag, int *res);
 
 int iio_get_trigger(struct iio_device *iio_dev, char *trigger_name);
 int iio_set_trigger(struct iio_device *dev, const char *trigger_name);
@@ -0,0 +1,308 @@
+/*
+ * Industrial I/O utilities - iio_bench.c
+ *
+ * Copyright (c) 2010 Manuel Stahl <manuel.stahl@iis.fraunhofer.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include <getopt.h>
+
+#include "iio.h"
+
+/*
+ * Microbenchmarks of the library calls the tools make on startup, run
+ * against a tree built by "iio_sim -t". Every benchmark is timed in
+ * batches that double until one takes long enough, then it is run
+ * again in a child process traced with ptrace to count its system
+ * calls. Results go to stdout as CSV.
+ */
+#define DEFAULT_MIN_TIME 0.2	/* seconds per timed batch */
+#define TRACED_OPS 100
+
+struct bench {
+	const char *name;
+	void (*op)(void);
+};
+
+static const char *dev_name = "sim0";
+static struct iio_device *dev;		/* opened once, channels loaded */
+static struct iio_channel *chan;
+static volatile float sink;		/* keeps results alive */
+
+static void bench_open_by_name(void)
+{
+	iio_close_device(iio_open_device_by_name(dev_name));
+}
+
+static void bench_open_path(void)
+{
+	iio_close_device(iio_open_device_path(dev->path));
+}
+
+/* a fresh device each time, as the channels are only read once */
+static struct iio_device *fresh_device(void)
+{
+	struct iio_device *d = calloc(1, sizeof(struct iio_device));
+
+	if (d) {
+		d->name = dev->name;
+		d->path = dev->path;
+		d->number = dev->number;
+	}
+	return d;
+}
+
+static void bench_channels(void)
+{
+	struct iio_device *d = fresh_device();
+
+	iio_get_device_channels(d);
+	iio_close_device(d);
+}
+
+static void bench_modifier_indexed(void)
+{
+	sink = iio_get_channel_modifier(dev, chan->name, IIO_MOD_SCALE, 1.0f);
+}
+
+static void bench_modifier_file(void)
+{
+	struct iio_device *d = fresh_device();
+
+	/* without the attribute index every lookup reads the file */
+	sink = iio_get_channel_modifier(d, chan->name, IIO_MOD_SCALE, 1.0f);
+	iio_close_device(d);
+}
+
+static void bench_scan_elements(void)
+{
+	struct dlist *elements = iio_get_ring_buffer_scan_elements(dev->buffer);
+
+	if (elements)
+		dlist_destroy(elements);
+}
+
+static void bench_ring_buffer(void)
+{
+	struct iio_device *d = fresh_device();
+
+	iio_get_ring_buffer(d);
+	iio_close_device(d);
+}
+
+static void bench_read_frequency(void)
+{
+	sink = iio_get_sampling_frequency(dev);
+}
+
+static void bench_read_length(void)
+{
+	sink = iio_get_ring_buffer_length(dev->buffer);
+}
+
+static void bench_channel_read_raw(void)
+{
+	iio_channel_read_raw(chan);
+	sink = iio_channel_raw(chan);
+}
+
+static void bench_device_read_raw(void)
+{
+	iio_device_read_raw(dev);
+}
+
+static const struct bench benches[] = {
+	{ "open_device_by_name", bench_open_by_name },
+	{ "open_device_path", bench_open_path },
+	{ "get_device_channels", bench_channels },
+	{ "get_channel_modifier_indexed", bench_modifier_indexed },
+	{ "get_channel_modifier_file", bench_modifier_file },
+	{ "get_ring_buffer", bench_ring_buffer },
+	{ "get_ring_buffer_scan_elements", bench_scan_elements },
+	{ "get_sampling_frequency", bench_read_frequency },
+	{ "get_ring_buffer_length", bench_read_length },
+	{ "channel_read_raw", bench_channel_read_raw },
+	{ "device_read_raw", bench_device_read_raw },
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Returns ns per operation, ops receives the size of the timed batch */
+static double time_op(const struct bench *b, double min_time, unsigned long *ops)
+{
+	unsigned long n, i;
+	double start, elapsed;
+
+	b->op();	/* warm up caches and the string pool */
+	for (n = 1; ; n *= 2) {
+		start = now();
+		for (i = 0; i < n; i++)
+			b->op();
+		elapsed = now() - start;
+		if (elapsed >= min_time || n >= (1UL << 40))
+			break;
+	}
+	*ops = n;
+	return elapsed * 1e9 / n;
+}
+
+/* Run the operation n times in a traced child and count its system
+ * calls. Returns calls per operation or -1 if tracing is not possible.
+ */
+static double count_syscalls(const struct bench *b, unsigned n)
+{
+	unsigned long stops = 0;
+	unsigned i;
+	int status;
+	pid_t pid;
+
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0)
+		return -1;
+	if (pid == 0) {
+		if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) < 0)
+			_exit(1);
+		raise(SIGSTOP);
+		for (i = 0; i < n; i++)
+			b->op();
+		_exit(0);
+	}
+
+	if (waitpid(pid, &status, 0) < 0 || !WIFSTOPPED(status) ||
+			ptrace(PTRACE_SETOPTIONS, pid, NULL,
+				PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL) < 0) {
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		return -1;
+	}
+	while (ptrace(PTRACE_SYSCALL, pid, NULL, NULL) == 0 &&
+			waitpid(pid, &status, 0) == pid && WIFSTOPPED(status))
+		if (WSTOPSIG(status) == (SIGTRAP | 0x80))
+			stops++;
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		return -1;
+
+	/* entry and exit stop per call, exit_group() only enters */
+	return ((stops + 1) / 2 - 1) / (double)n;
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option long_options[] = {
+		{ "version", 0, 0, 'V' },
+		{ "root", 1, 0, 'R' },
+		{ "device", 1, 0, 'D' },
+		{ "time", 1, 0, 't' },
+		{ 0, 0, 0, 0 }
+	};
+
+	double min_time = DEFAULT_MIN_TIME;
+	const char *only = NULL;
+	int c, err = 0;
+	unsigned i;
+
+	while ((c = getopt_long(argc, argv, "D:R:t:V", long_options, NULL)) != EOF) {
+		switch(c) {
+		case 'V':
+			printf("iio_bench (" PACKAGE ") " VERSION "\n");
+			exit(0);
+
+		case 'R':
+			if (iio_set_root(optarg) < 0) {
+				fprintf(stderr, "Cannot use root %s\n", optarg);
+				err++;
+			}
+			break;
+
+		case 'D':
+			dev_name = optarg;
+			break;
+
+		case 't':
+			min_time = atof(optarg);
+			if (min_time <= 0) {
+				fprintf(stderr, "Invalid time %s\n", optarg);
+				err++;
+			}
+			break;
+
+		case '?':
+		default:
+			err++;
+			break;
+		}
+	}
+	if (err || argc > optind + 1) {
+		fprintf(stderr, "Usage: iio_bench [options] [benchmark]\n"
+			"Time the library calls, against a tree built by iio_sim -t\n"
+			"  -R, --root <dir>\n"
+			"      Find sysfs in <dir>/sys\n"
+			"  -D, --device <name>\n"
+			"      Device to work on, default sim0\n"
+			"  -t, --time <seconds>\n"
+			"      Shortest timed batch, default %.1f\n"
+			"  -V, --version\n"
+			"      Show version of program\n"
+			"Writes name,ns_per_op,syscalls_per_op,ops lines to stdout,\n"
+			"syscalls_per_op is -1 where ptrace is not allowed.\n"
+			, DEFAULT_MIN_TIME);
+		exit(1);
+	}
+	if (argc > optind)
+		only = argv[optind];
+
+	dev = iio_open_device_by_name(dev_name);
+	if (!dev) {
+		fprintf(stderr, "No industrial I/O device named %s!\n", dev_name);
+		return 1;
+	}
+	chan = iio_get_device_channels(dev);
+	if (!chan || !iio_get_ring_buffer(dev)) {
+		fprintf(stderr, "%s needs channels and a ring buffer\n", dev_name);
+		iio_close_device(dev);
+		return 1;
+	}
+
+	printf("name,ns_per_op,syscalls_per_op,ops\n");
+	for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+		const struct bench *b = &benches[i];
+		unsigned long ops;
+		double ns;
+
+		if (only && strcmp(only, b->name))
+			continue;
+		ns = time_op(b, min_time, &ops);
+		printf("%s,%.1f,%.2f,%lu\n", b->name, ns,
+				count_syscalls(b, TRACED_OPS), ops);
+	}
+
+	iio_close_device(dev);
+	return 0;
+}
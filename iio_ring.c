@@ -12,6 +12,7 @@
 #include "config.h"
 #endif
 
+#define _GNU_SOURCE
 #include <fcntl.h>
 #include <string.h>
 #include <dirent.h>
@@ -19,203 +20,1667 @@
 #include <errno.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <math.h>
 #include <signal.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/dir.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 
-#define _GNU_SOURCE
 #include <getopt.h>
 
 #include "iio.h"
+#include "iio_ring.h"
 
 #define DEFAULT_RING_LENGTH 64
+#define MIN_RING_LENGTH 16
+#define MAX_RING_LENGTH 65536
+#define MAX_BLOCK_LENGTH 4096	/* scans per read and per queue block */
+#define DEFAULT_QUEUE_DEPTH 16
+#define MAX_QUEUE_DEPTH (1 << 16)
+#define MAX_DECIMATION 10000
+#define MAX_FILTER_SPECS 32
+#define DEFAULT_SHM_SCANS 65536
+#define MAX_SHM_SCANS (1 << 24)
+#define SHM_WAIT_MS 100		/* how often an idle reader checks signals */
+#define DEFAULT_BATCH 256	/* scans per frame asked from a server */
+#define MAX_STATS_INTERVAL 86400
+#define REALTIME_STACK (256 * 1024)	/* stack faulted in for --realtime */
+#define STATS_LINE_MAX 1024
 
 #define fail_return(msg...) { fprintf(stderr, msg); return -1; }
 
-static enum verbosity {
-	VERBLEVEL_DEFAULT,
-} verblevel = VERBLEVEL_DEFAULT;
+enum verbosity verblevel = VERBLEVEL_DEFAULT;
+enum output_type out_type = OUTPUT_TABLE;
 
-static enum output_type {
-	OUTPUT_TABLE, OUTPUT_CVS, OUTPUT_XML,
-} out_type = OUTPUT_TABLE;
+static int out_fd = STDOUT_FILENO;
+static int merge_output;
+unsigned queue_depth = DEFAULT_QUEUE_DEPTH;
+static unsigned ring_length = DEFAULT_RING_LENGTH;
+static unsigned auto_wakeups;		/* target events per second, 0 is off */
+static unsigned stats_interval;		/* seconds between stats lines */
+static int stats_timer_tag;		/* epoll tag of the stats timer */
+static unsigned decimation = 1;		/* keep one of that many scans */
+static unsigned shm_scans = DEFAULT_SHM_SCANS;
+static int realtime_priority;		/* SCHED_FIFO priority, 0 is off */
+static int realtime_cpu = -1;		/* pin the reader here */
+static int use_uring;			/* --uring, see uring_loop() */
+static const char *serve_path;		/* --serve */
+/* --trigger and the --elements to enable, see capture_setup() */
+static const char *setup_elements[IIO_SERVE_MAX_ELEMENTS];
+static struct iio_setup_config setup_config = { .elements = setup_elements };
 
-static volatile enum { PROG_QUIT, PROG_RUN } run = PROG_RUN;
+/* --filter options in the order given, later ones win */
+static struct filter_spec {
+	const char *element;	/* interned, NULL for all elements */
+	enum iio_filter_type type;
+} filter_specs[MAX_FILTER_SPECS];
+static unsigned num_filter_specs;
 
-FILE *fp_ev;
+/* One stream of scans from all devices, ordered by timestamp */
+static struct {
+	struct ring_capture *caps;
+	unsigned num_caps;
+	struct iio_scan_layout *layout;
+	struct iio_scan_element *elements;
+	struct iio_output *out;
+	float *values;
+	int64_t *timestamps;
+	unsigned fill;
+	unsigned block;
+	unsigned *head;			/* next pending scan of each device */
+} merge;
 
-int write_sysfs_int(char *filename, char *basedir, int val)
+/*
+ * Text output runs in a writer thread. The main thread only moves data
+ * from the rings into the queues of the captures, so a slow output does
+ * not hold up draining the rings until a queue is full. Either side
+ * sleeps on an eventfd when it has nothing to do and sets its waiting
+ * flag before, the other side only rings the doorbell if it is set.
+ */
+static struct {
+	pthread_t thread;
+	int running;
+	struct ring_capture *caps;
+	unsigned num_caps;
+	int data_fd;			/* doorbell of the writer */
+	int space_fd;			/* doorbell of the reader */
+	int writer_waiting;
+	int reader_waiting;
+	int failed;
+} writer;
+
+/* Decimation of the scans of one layout, with the filters chosen for
+ * its elements by name or by channel name; fir by default.
+ */
+static struct iio_filter *filter_new(const struct iio_scan_layout *layout,
+		size_t max_scans)
 {
-	FILE  *sysfsfp;
-	char temp[SYSFS_PATH_MAX];
-	sprintf(temp, "%s/%s", basedir, filename);
-	sysfsfp = fopen(temp, "w");
-	if (!sysfsfp)
-		fail_return("%s: %s\n", temp, strerror(errno));
+	enum iio_filter_type *types;
+	struct iio_filter *filter;
+	unsigned i, j;
+
+	types = calloc(layout->num_slots + 1, sizeof(*types));
+	if (!types) {
+		fprintf(stderr, "Could not allocate filter\n");
+		return NULL;
+	}
+	for (i = 0; i < layout->num_slots; i++) {
+		const struct iio_scan_element *elem = layout->slots[i].elem;
 
-	fprintf(sysfsfp, "%d", val);
-	fclose(sysfsfp);
+		types[i] = IIO_FILTER_FIR;
+		for (j = 0; j < num_filter_specs; j++) {
+			const char *name = filter_specs[j].element;
+			if (!name || name == elem->name ||
+					(elem->channel && name == elem->channel->name))
+				types[i] = filter_specs[j].type;
+		}
+	}
+	filter = iio_filter_new(layout, decimation, types, max_scans);
+	free(types);
+	return filter;
+}
+
+static enum iio_output_format text_format(void)
+{
+	switch (out_type) {
+	case OUTPUT_CVS:
+		return IIO_OUTPUT_CSV;
+	case OUTPUT_XML:
+		return IIO_OUTPUT_XML;
+	default:
+		return IIO_OUTPUT_TABLE;
+	}
+}
+
+/* Output of scans that were already decoded, by --replay and --attach:
+ * CSV or XML, or a raw or packed capture.
+ */
+struct scan_writer {
+	const struct iio_scan_layout *layout;
+	struct iio_output *out;
+	struct iio_filter *filter;
+	char *encoded;
+	int32_t *samples;
+	float *values;
+	int64_t *timestamps;
+	unsigned block;			/* scans per call of scan_writer_write() */
+};
+
+static void scan_writer_free(struct scan_writer *w)
+{
+	iio_output_close(w->out);
+	iio_filter_free(w->filter);
+	free(w->encoded);
+	free(w->timestamps);
+	free(w->values);
+	free(w->samples);
+}
+
+static int scan_writer_init(struct scan_writer *w,
+		const struct iio_scan_layout *layout, unsigned block,
+		const char *device, const char *trigger)
+{
+	memset(w, 0, sizeof(*w));
+	w->layout = layout;
+	w->block = block;
+	w->samples = malloc(layout->num_slots * block * sizeof(int32_t));
+	w->values = malloc(layout->num_slots * block * sizeof(float));
+	w->timestamps = malloc(block * sizeof(int64_t));
+	if (out_type == OUTPUT_BINARY)
+		w->encoded = malloc(layout->scan_size * block);
+	else if (out_type == OUTPUT_PACKED)
+		w->encoded = malloc(iio_pack_bound(layout, IIO_PACK_SCANS));
+	else
+		w->out = iio_output_new(out_fd, out_type == OUTPUT_XML ?
+				IIO_OUTPUT_XML : IIO_OUTPUT_CSV, layout, device);
+	if (decimation > 1)
+		w->filter = filter_new(layout, block);
+	if (!w->samples || !w->values || !w->timestamps ||
+			(!w->out && !w->encoded) || (decimation > 1 && !w->filter)) {
+		scan_writer_free(w);
+		fail_return("Could not allocate space for buffer data store\n");
+	}
+	if (w->encoded && iio_capture_write_header(out_fd, device, trigger,
+			layout, out_type == OUTPUT_PACKED ? IIO_CAPTURE_PACKED :
+			IIO_CAPTURE_RAW) < 0) {
+		scan_writer_free(w);
+		fail_return("Failed to write the capture header: %s\n",
+				strerror(errno));
+	}
 	return 0;
 }
 
-int write_verify_sysfs_int(char *filename, char *basedir, int val)
+/* Write nscans scans from w->samples and w->timestamps */
+static int scan_writer_write(struct scan_writer *w, size_t nscans)
 {
-	int ref;
-	FILE  *sysfsfp;
-	char temp[SYSFS_PATH_MAX];
-	sprintf(temp, "%s/%s", basedir, filename);
-	sysfsfp = fopen(temp, "rw");
-	if (!sysfsfp)
-		fail_return("%s: %s\n", temp, strerror(errno));
+	const struct iio_scan_layout *layout = w->layout;
+	int err;
 
-	fprintf(sysfsfp, "%d", val);
-	if (fscanf(sysfsfp, "%d", &ref) != 1)
-		fail_return("verification of %s failed\n", temp);
-	fclose(sysfsfp);
-	return val == ref;
+	switch (out_type) {
+	case OUTPUT_BINARY:
+		iio_scan_encode(layout, w->samples, w->block, w->timestamps,
+				nscans, w->encoded);
+		err = iio_capture_write_block(out_fd, w->encoded,
+				nscans * layout->scan_size);
+		break;
+	case OUTPUT_PACKED:
+		err = iio_capture_write_packed(out_fd, layout, w->samples,
+				w->block, w->timestamps, nscans, w->encoded);
+		break;
+	default:
+		iio_scan_convert(layout, w->samples, w->values, w->block, nscans);
+		if (w->filter)
+			nscans = iio_filter_run(w->filter, w->values, w->block,
+					layout->ts_offset >= 0 ? w->timestamps : NULL,
+					nscans);
+		err = iio_output_scans(w->out, w->values, w->block, w->timestamps,
+				nscans);
+		break;
+	}
+	if (err < 0)
+		fail_return("Failed to write output: %s\n", strerror(errno));
+	return 0;
 }
 
-int next_power_of_two(int x)
+/* Push out buffered text, for when no more scans come for a while */
+static int scan_writer_flush(struct scan_writer *w)
 {
-	x = x - 1;
-	x = x | (x >> 1);
-	x = x | (x >> 2);
-	x = x | (x >> 4);
-	x = x | (x >> 8);
-	x = x | (x >>16);
-	return x + 1;
+	if (w->out && iio_output_flush(w->out) < 0)
+		fail_return("Failed to write output: %s\n", strerror(errno));
+	return 0;
 }
 
-void quit(/* int sig */) {
-    run = PROG_QUIT;
-    fclose(fp_ev);
+static int scan_writer_close(struct scan_writer *w)
+{
+	int ret = iio_output_close(w->out);
+
+	w->out = NULL;
+	scan_writer_free(w);
+	return ret;
 }
 
-/*
-static void print_sample_set(char *data, struct dlist *scan_el_list)
+/* Write the scans of a capture again */
+static int replay_capture(const char *file)
 {
-	struct iio_channel *channel;
-	struct iio_scan_element *scan_el;
-	char *addr = data;
+	const unsigned block_scans = IIO_PACK_SCANS;
+	struct iio_capture *cap;
+	struct iio_scan_layout *layout;
+	struct scan_writer w;
+	size_t fill = 0;
+	char *data;
+	int ret = 0;
 
-	dlist_for_each_data(scan_el_list, scan_el, struct iio_channel) {
-		if (scan_el->enabled) {
-			int32_t sample = *((int32_t*)addr);
-			sample <<= 32 - scan_el->bits;
-			sample >>= 32 - scan_el->bits;
-			addr += next_power_of_two(scan_el->bits);
+	cap = iio_capture_open(file);
+	if (!cap)
+		return -1;
+	layout = cap->layout;
 
-			printf("%+5.3f ", (float)sample * channel->scale + channel->offset);
-	//		printf("%02x %02x  ", (sample >> 8) & 0xff, sample & 0xff);
+	data = malloc(layout->scan_size * block_scans);
+	if (!data) {
+		fprintf(stderr, "Could not allocate space for buffer data store\n");
+		iio_capture_close(cap);
+		return -1;
+	}
+	if (scan_writer_init(&w, layout, block_scans, cap->device,
+			cap->trigger) < 0) {
+		free(data);
+		iio_capture_close(cap);
+		return -1;
+	}
+
+	while (1) {
+		size_t nscans, used = 0;
+
+		if (cap->encoding == IIO_CAPTURE_PACKED) {
+			ssize_t n = iio_capture_read_packed(cap, w.samples, block_scans,
+					w.timestamps);
+			if (n < 0) {
+				fprintf(stderr, "%s: %s\n", file, errno == EINVAL ?
+						"corrupt packed block" : strerror(errno));
+				ret = -1;
+				break;
+			}
+			if (n == 0)
+				break;
+			nscans = n;
+		} else {
+			ssize_t len = read(cap->fd, data + fill,
+					layout->scan_size * block_scans - fill);
+			if (len < 0 && errno == EINTR)
+				continue;
+			if (len < 0) {
+				fprintf(stderr, "%s: %s\n", file, strerror(errno));
+				ret = -1;
+				break;
+			}
+			if (len == 0)
+				break;
+			fill += len;
+			nscans = iio_scan_decode(layout, data, fill, w.samples,
+					block_scans, w.timestamps);
+			used = nscans * layout->scan_size;
+		}
+
+		if (scan_writer_write(&w, nscans) < 0) {
+			ret = -1;
+			break;
 		}
+
+		/* keep a trailing partial scan for the next read */
+		memmove(data, data + used, fill - used);
+		fill -= used;
 	}
-	// TODO print timestamp
-//	printf(" %lld\n",
-//	       *(__s64 *)(&data[(i+1)*size_from_scanmode(NumVals, scan_ts)
-//				- sizeof(__s64)]));
-	printf("\n");
+	if (fill)
+		fprintf(stderr, "%s: ignoring %zu trailing bytes\n", file, fill);
+
+	if (scan_writer_close(&w) < 0)
+		ret = -1;
+	free(data);
+	iio_capture_close(cap);
+	return ret;
 }
-*/
 
-static int read_ring(struct iio_device *iio_dev, unsigned ring_length)
+/* Write the scans another iio_ring publishes with --shm, from now until
+ * it stops or SIGINT or SIGTERM arrive. Scans it overwrote before we got
+ * to them are reported on stderr.
+ */
+static int attach_shm(const char *name)
 {
-	const char *ring_access = iio_dev->buffer->access;
-	const char *ring_event = iio_dev->buffer->event;
+	struct iio_shm_reader *reader;
+	struct scan_writer w;
+	unsigned long reported = 0;
+	sigset_t pending;
+	int ret = 0;
+
+	reader = iio_shm_open(name);
+	if (!reader)
+		fail_return("%s: %s\n", name, errno == EINVAL ?
+				"not a scan ring" : strerror(errno));
+	if (verblevel > VERBLEVEL_DEFAULT)
+		fprintf(stderr, "Attached to %s of %s\n", name, reader->device);
+	if (scan_writer_init(&w, reader->layout, IIO_PACK_SCANS, reader->device,
+			"") < 0) {
+		iio_shm_reader_close(reader);
+		return -1;
+	}
+
+	while (1) {
+		size_t nscans = iio_shm_read(reader, w.samples, w.block,
+				w.timestamps);
+		int ready;
+
+		if (reader->lost != reported && verblevel > VERBLEVEL_DEFAULT) {
+			fprintf(stderr, "%s: lost %lu scans\n", name,
+					reader->lost - reported);
+			reported = reader->lost;
+		}
+		if (nscans) {
+			if (scan_writer_write(&w, nscans) < 0) {
+				ret = -1;
+				break;
+			}
+			continue;
+		}
+
+		/* termination signals are blocked, see main() */
+		sigpending(&pending);
+		if (sigismember(&pending, SIGINT) || sigismember(&pending, SIGTERM))
+			break;
+		if (scan_writer_flush(&w) < 0) {
+			ret = -1;
+			break;
+		}
+		ready = iio_shm_wait(reader, SHM_WAIT_MS);
+		if (ready < 0)
+			break;
+	}
+	if (reader->lost)
+		fprintf(stderr, "%s: %lu scans lost\n", name, reader->lost);
 
-	int fp_ring, samples = 24, bps = 2;
+	if (scan_writer_close(&w) < 0)
+		ret = -1;
+	iio_shm_reader_close(reader);
+	return ret;
+}
+
+/* Write the scans a server of --serve sends for req, until it closes the
+ * connection or SIGINT or SIGTERM arrive.
+ */
+static int connect_server(const char *path, const struct iio_serve_request *req)
+{
+	struct iio_capture *cap;
+	struct scan_writer w;
+	struct pollfd pfd;
+	unsigned long dropped, total = 0;
+	sigset_t pending;
 	char *data;
+	int ret = 0;
 
-	/* Setup ring buffer parameters */
-	if (write_sysfs_int("length", iio_dev->buffer->path, ring_length) < 0)
-		fail_return("Failed to set the ring buffer length\n");
+	cap = iio_serve_connect(path, req);
+	if (!cap)
+		return -1;
+	data = malloc(cap->layout->scan_size * req->block);
+	if (!data) {
+		fprintf(stderr, "Could not allocate space for buffer data store\n");
+		iio_capture_close(cap);
+		return -1;
+	}
+	if (scan_writer_init(&w, cap->layout, req->block, cap->device,
+			cap->trigger) < 0) {
+		free(data);
+		iio_capture_close(cap);
+		return -1;
+	}
 
-	/* Enable the ring buffer */
-	if (write_verify_sysfs_int("ring_enable", iio_dev->buffer->path, 1) < 0)
-		fail_return("Failed to enable the ring buffer\n");
+	pfd.fd = cap->fd;
+	pfd.events = POLLIN;
+	while (1) {
+		ssize_t nscans;
+		int n = poll(&pfd, 1, SHM_WAIT_MS);
 
-	data = malloc(bps*samples*ring_length);
-	if (!data)
-		fail_return("Could not allocate space for buffer data store\n");
+		/* termination signals are blocked, see main() */
+		sigpending(&pending);
+		if (sigismember(&pending, SIGINT) || sigismember(&pending, SIGTERM))
+			break;
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			if (n < 0 || scan_writer_flush(&w) < 0) {
+				ret = -1;
+				break;
+			}
+			continue;
+		}
+
+		nscans = iio_serve_read_frame(cap, data, req->block, &dropped);
+		if (nscans < 0) {
+			fprintf(stderr, "%s: %s\n", path, errno == EINVAL ?
+					"corrupt frame" : strerror(errno));
+			ret = -1;
+			break;
+		}
+		if (nscans == 0)
+			break;
+		if (dropped && verblevel > VERBLEVEL_DEFAULT)
+			fprintf(stderr, "%s: server dropped %lu scans\n", path, dropped);
+		total += dropped;
+
+		nscans = iio_scan_decode(cap->layout, data,
+				nscans * cap->layout->scan_size, w.samples, w.block,
+				w.timestamps);
+		if (scan_writer_write(&w, nscans) < 0) {
+			ret = -1;
+			break;
+		}
+	}
+	if (total)
+		fprintf(stderr, "%s: %lu scans dropped\n", path, total);
+
+	if (scan_writer_close(&w) < 0)
+		ret = -1;
+	free(data);
+	iio_capture_close(cap);
+	return ret;
+}
+
+static unsigned long elapsed_us(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000 +
+		(now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+static void record_latency(unsigned long *buckets, unsigned long *max,
+		unsigned long us)
+{
+	unsigned bucket = 0;
+
+	while (bucket < LATENCY_BUCKETS - 1 && us >= (1UL << bucket))
+		bucket++;
+	buckets[bucket]++;
+	if (us > *max)
+		*max = us;
+}
+
+/* Microseconds since an event timestamp, or -1 if it has none. Drivers
+ * take the timestamps from the real time clock.
+ */
+static long wakeup_latency(int64_t timestamp)
+{
+	struct timespec now;
+	int64_t ns;
+
+	if (timestamp <= 0)
+		return -1;
+	clock_gettime(CLOCK_REALTIME, &now);
+	ns = now.tv_sec * 1000000000LL + now.tv_nsec - timestamp;
+	return ns < 0 ? 0 : ns / 1000;
+}
+
+static void print_histogram(FILE *f, const unsigned long *buckets)
+{
+	unsigned i;
+
+	for (i = 0; i < LATENCY_BUCKETS; i++) {
+		if (!buckets[i])
+			continue;
+		if (i == LATENCY_BUCKETS - 1)
+			fprintf(f, "    >= %8lu us: %lu\n", 1UL << (i - 1), buckets[i]);
+		else
+			fprintf(f, "    <  %8lu us: %lu\n", 1UL << i, buckets[i]);
+	}
+}
+
+/* Report for people, on exit and on SIGUSR1 */
+void print_stats(FILE *f, const struct ring_capture *cap)
+{
+	const struct capture_stats *st = &cap->stats;
+
+	fprintf(f, "Statistics of %s\n"
+			"  events: %lu at 50%%, %lu at 75%%, %lu at 100%%, %lu unknown\n"
+			"  reads: %lu, %lu short, %lu EAGAIN\n"
+			"  data: %llu bytes, %llu scans\n",
+			cap->dev->name, st->events_50, st->events_75, st->events_100,
+			st->events_unknown, st->reads, st->short_reads, st->eagain,
+			st->bytes, st->scans);
+	if (cap->queue)
+		fprintf(f, "  queue: full %lu times, at most %u of %u blocks used\n",
+				cap->queue->full, cap->queue->max_fill, cap->queue->depth);
+	fprintf(f, "  ring length: %u scans\n", cap->length);
+	fprintf(f, "  latency: at most %lu us\n", st->latency_max);
+	print_histogram(f, st->latency);
+	fprintf(f, "  wakeup to read: at most %lu us\n", st->wakeup_max);
+	print_histogram(f, st->wakeup);
+	if (st->wakeup_unknown)
+		fprintf(f, "    %lu events without timestamp\n", st->wakeup_unknown);
+	if (st->events_unknown)
+		fprintf(f, "  last unknown event code: 0x%x\n", st->unknown_code);
+}
+
+static size_t format_histogram(char *buf, size_t size,
+		const unsigned long *buckets)
+{
+	size_t len = 0;
+	unsigned i;
+
+	for (i = 0; i < LATENCY_BUCKETS && len < size; i++)
+		len += snprintf(buf + len, size - len, i ? ",%lu" : "%lu", buckets[i]);
+	return len;
+}
+
+/* Report for monitoring, one line of key=value pairs. latency_us and
+ * wakeup_us list the histogram buckets, see struct capture_stats. The
+ * line is formatted on the stack and written at once, so it neither
+ * allocates nor holds a stdio lock in the loop of --realtime.
+ */
+void print_stats_line(FILE *f, const struct ring_capture *cap)
+{
+	const struct capture_stats *st = &cap->stats;
+	char line[STATS_LINE_MAX];
+	struct timespec now;
+	size_t len;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	len = snprintf(line, sizeof(line), "stats time=%ld.%03ld device=%s "
+			"events_50=%lu events_75=%lu events_100=%lu events_unknown=%lu "
+			"reads=%lu short_reads=%lu eagain=%lu bytes=%llu scans=%llu "
+			"queue_full=%lu length=%u latency_max_us=%lu latency_us=",
+			(long)now.tv_sec, now.tv_nsec / 1000000, cap->dev->name,
+			st->events_50, st->events_75, st->events_100, st->events_unknown,
+			st->reads, st->short_reads, st->eagain, st->bytes, st->scans,
+			cap->queue ? cap->queue->full : 0, cap->length, st->latency_max);
+	if (len < sizeof(line))
+		len += format_histogram(line + len, sizeof(line) - len, st->latency);
+	if (len < sizeof(line))
+		len += snprintf(line + len, sizeof(line) - len,
+				" wakeup_max_us=%lu wakeup_us=", st->wakeup_max);
+	if (len < sizeof(line))
+		len += format_histogram(line + len, sizeof(line) - len, st->wakeup);
+	if (len >= sizeof(line))
+		len = sizeof(line) - 1;
+	line[len++] = '\n';
+	if (write(fileno(f), line, len) < 0)
+		return;
+}
+
+static void capture_teardown(struct ring_capture *cap)
+{
+	if (cap->event_fd >= 0)
+		close(cap->event_fd);
+	if (cap->ring_fd >= 0)
+		close(cap->ring_fd);
+	if (cap->pipe_fd[0] >= 0) {
+		close(cap->pipe_fd[0]);
+		close(cap->pipe_fd[1]);
+	}
+
+	/* Stop the ring buffer */
+	if (cap->enabled) {
+		const struct iio_setup_config off = { .enable = 0 };
+		iio_setup_apply(cap->setup, &off);
+	}
+	iio_setup_close(cap->setup);
+
+	iio_output_close(cap->out);
+	iio_shm_close(cap->shm);
+	iio_filter_free(cap->filter);
+	if (cap->out_fd >= 0 && cap->out_fd != out_fd)
+		close(cap->out_fd);
+	free(cap->pending_ts);
+	free(cap->pending);
+	free(cap->timestamps);
+	free(cap->values);
+	free(cap->samples);
+	free(cap->data);
+	iio_queue_free(cap->queue);
+	iio_scan_layout_free(cap->layout);
+	if (cap->scan_elements)
+		dlist_destroy(cap->scan_elements);
+}
+
+/* Ring length at startup. With auto-tuning it is picked from the
+ * sampling frequency, so that the 50% event comes auto_wakeups times
+ * a second.
+ */
+static unsigned initial_length(struct ring_capture *cap)
+{
+	float freq;
+	unsigned length;
+
+	if (!auto_wakeups)
+		return ring_length;
+	freq = iio_get_sampling_frequency(cap->dev);
+	if (isnan(freq) || freq <= 0)
+		return ring_length;
+	if (2 * freq / auto_wakeups >= MAX_RING_LENGTH)
+		return MAX_RING_LENGTH;
+	length = next_power_of_two(2 * freq / auto_wakeups);
+	return length < MIN_RING_LENGTH ? MIN_RING_LENGTH : length;
+}
+
+static int capture_setup(struct ring_capture *cap)
+{
+	const char *ring_access = cap->dev->buffer->access;
+	const char *ring_event = cap->dev->buffer->event;
+	struct iio_setup_config config;
+	struct iio_scan_layout *layout;
+	unsigned block;
+
+	cap->ring_fd = cap->event_fd = -1;
+	cap->pipe_fd[0] = cap->pipe_fd[1] = -1;
+
+	cap->scan_elements = iio_get_ring_buffer_scan_elements(cap->dev->buffer);
+	if (!cap->scan_elements)
+		fail_return("Failed to read the scan elements\n");
+	cap->setup = iio_setup_open(cap->dev->buffer, cap->scan_elements);
+	if (!cap->setup)
+		fail_return("Failed to open the ring buffer attributes\n");
+
+	/* Trigger, scan elements, length and enable in one step, the
+	 * device is left as it was if any of them fails */
+	cap->length = initial_length(cap);
+	/* tune_ring() may grow the ring up to MAX_RING_LENGTH, the blocks
+	 * are sized for that up front so a grown ring takes as few reads */
+	block = auto_wakeups ? MAX_RING_LENGTH : cap->length;
+	cap->block = block < MAX_BLOCK_LENGTH ? block : MAX_BLOCK_LENGTH;
+	cap->min_length = MIN_RING_LENGTH;
+	clock_gettime(CLOCK_MONOTONIC, &cap->tune_start);
+	config = setup_config;
+	config.length = cap->length;
+	config.enable = 1;
+	if (iio_setup_apply(cap->setup, &config) < 0)
+		fail_return("Failed to set up the ring buffer of %s\n", cap->dev->name);
+	cap->enabled = 1;
+	if (cap->setup->trigger_fd >= 0)
+		strcpy(cap->trigger, cap->setup->trigger);
+
+	/* Build the scan decoder from the enabled scan elements */
+	layout = cap->layout = iio_scan_layout_new(cap->scan_elements);
+	if (!layout)
+		fail_return("Failed to set up the scan layout\n");
+
+	if (out_type == OUTPUT_BINARY && use_uring) {
+		/* blocks in flight between ring and output, see uring_loop() */
+		cap->queue = iio_queue_new(queue_depth, layout->scan_size * cap->block);
+		if (!cap->queue)
+			fail_return("Could not allocate space for buffer data store\n");
+	} else if (out_type == OUTPUT_BINARY) {
+		/* page aligned, so copying reads are as cheap as the driver allows */
+		if (posix_memalign((void **)&cap->data, sysconf(_SC_PAGESIZE),
+				layout->scan_size * cap->block))
+			fail_return("Could not allocate space for buffer data store\n");
+
+		/* Raw scans go from the ring to the output through a pipe
+		 * without a copy in user space, see move_raw().
+		 */
+		if (pipe2(cap->pipe_fd, O_CLOEXEC) < 0)
+			cap->pipe_fd[0] = cap->pipe_fd[1] = -1;
+		else
+			fcntl(cap->pipe_fd[1], F_SETPIPE_SZ,
+					layout->scan_size * cap->block);
+	} else if (out_type == OUTPUT_SERVE) {
+		/* decoded in the main thread, see serve_read() */
+		cap->data = malloc(layout->scan_size * cap->block);
+		cap->samples = malloc(layout->num_slots * cap->block * sizeof(int32_t));
+		cap->timestamps = malloc(cap->block * sizeof(int64_t));
+		if (!cap->data || !cap->samples || !cap->timestamps)
+			fail_return("Could not allocate space for buffer data store\n");
+	} else {
+		cap->queue = iio_queue_new(queue_depth, layout->scan_size * cap->block);
+		cap->samples = malloc(layout->num_slots * cap->block * sizeof(int32_t));
+		cap->values = malloc(layout->num_slots * cap->block * sizeof(float));
+		cap->timestamps = malloc(cap->block * sizeof(int64_t));
+		if (!cap->queue || !cap->samples || !cap->values || !cap->timestamps)
+			fail_return("Could not allocate space for buffer data store\n");
+		if (decimation > 1) {
+			cap->filter = filter_new(layout, cap->block);
+			if (!cap->filter)
+				fail_return("Failed to set up the decimation\n");
+		}
+		if (out_type == OUTPUT_PACKED) {
+			cap->data = malloc(iio_pack_bound(layout, IIO_PACK_SCANS));
+			if (!cap->data)
+				fail_return("Could not allocate space for buffer data store\n");
+		}
+	}
+
+	if (merge_output) {
+		/* see merge_setup() */
+		cap->pending = malloc(layout->num_slots * 2 * cap->block * sizeof(float));
+		cap->pending_ts = malloc(2 * cap->block * sizeof(int64_t));
+		if (!cap->pending || !cap->pending_ts)
+			fail_return("Could not allocate space for buffer data store\n");
+		cap->last_ts = INT64_MIN;
+	} else if (out_type == OUTPUT_SHM) {
+		cap->shm = iio_shm_create(cap->shm_name, cap->dev->name, layout,
+				shm_scans);
+		if (!cap->shm)
+			fail_return("Failed to create %s: %s\n", cap->shm_name,
+					strerror(errno));
+	} else if (out_type == OUTPUT_BINARY || out_type == OUTPUT_PACKED) {
+		if (iio_capture_write_header(cap->out_fd, cap->dev->name, cap->trigger,
+				layout, out_type == OUTPUT_PACKED ? IIO_CAPTURE_PACKED :
+				IIO_CAPTURE_RAW) < 0)
+			fail_return("Failed to write the capture header: %s\n",
+					strerror(errno));
+	} else if (out_type != OUTPUT_SERVE) {
+		cap->out = iio_output_new(cap->out_fd, text_format(), layout,
+				cap->dev->name);
+		if (!cap->out)
+			fail_return("Could not allocate output buffer\n");
+	}
+
+	/* Both devices are only read when epoll reports them readable */
+	cap->ring_fd = open(ring_access, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (cap->ring_fd < 0)
+		fail_return("Failed to open %s: %s\n", ring_access, strerror(errno));
+
+	cap->event_fd = open(ring_event, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (cap->event_fd < 0)
+		fail_return("Failed to open %s: %s\n", ring_event, strerror(errno));
+
+	return 0;
+}
+
+/*
+ * Merged output: every device contributes its own columns, named
+ * "<device>:<element>", and each row only fills the columns of the
+ * device the scan came from. Scans are held back until every device
+ * has delivered data up to their timestamp.
+ */
+static void merge_free(void)
+{
+	iio_output_close(merge.out);
+	free(merge.head);
+	free(merge.timestamps);
+	free(merge.values);
+	free(merge.elements);
+	iio_scan_layout_free(merge.layout);
+	memset(&merge, 0, sizeof(merge));
+}
+
+static int merge_setup(struct ring_capture *caps, unsigned num_caps)
+{
+	unsigned i, j, columns = 0;
+
+	for (i = 0; i < num_caps; i++) {
+		if (caps[i].layout->ts_offset < 0)
+			fail_return("Merging needs the timestamp of %s\n",
+					caps[i].dev->name);
+		caps[i].first_column = columns;
+		columns += caps[i].layout->num_slots;
+	}
+
+	merge.caps = caps;
+	merge.num_caps = num_caps;
+	merge.block = DEFAULT_RING_LENGTH;
+	merge.layout = calloc(1, sizeof(struct iio_scan_layout) +
+			columns * sizeof(struct iio_scan_slot));
+	merge.elements = calloc(columns + 1, sizeof(struct iio_scan_element));
+	merge.values = malloc(columns * merge.block * sizeof(float));
+	merge.timestamps = malloc(merge.block * sizeof(int64_t));
+	merge.head = malloc(num_caps * sizeof(unsigned));
+	if (!merge.layout || !merge.elements || !merge.values || !merge.timestamps ||
+			!merge.head)
+		fail_return("Could not allocate space for merged output\n");
+
+	/* the merged layout only names the columns, it never decodes */
+	merge.layout->num_slots = columns;
+	merge.layout->ts_offset = 0;
+	for (i = 0; i < num_caps; i++) {
+		const struct iio_scan_layout *layout = caps[i].layout;
+		for (j = 0; j < layout->num_slots; j++) {
+			unsigned col = caps[i].first_column + j;
+			merge.layout->slots[col] = layout->slots[j];
+			merge.elements[col] = *layout->slots[j].elem;
+			merge.elements[col].name = iio_intern_printf("%s:%s",
+					caps[i].dev->name, layout->slots[j].elem->name);
+			if (!merge.elements[col].name)
+				fail_return("Could not allocate space for merged output\n");
+			merge.layout->slots[col].elem = &merge.elements[col];
+		}
+	}
+
+	merge.out = iio_output_new(out_fd, text_format(), merge.layout, "merged");
+	if (!merge.out)
+		fail_return("Could not allocate output buffer\n");
+	return 0;
+}
+
+static int merge_write_block(void)
+{
+	if (merge.fill == 0)
+		return 0;
+	if (iio_output_scans(merge.out, merge.values, merge.block,
+			merge.timestamps, merge.fill) < 0 ||
+			(out_type == OUTPUT_TABLE && iio_output_flush(merge.out) < 0))
+		fail_return("Failed to write output: %s\n", strerror(errno));
+	merge.fill = 0;
+	return 0;
+}
+
+/* Write out pending scans in timestamp order. Without force only scans
+ * that no device can precede any more are written.
+ */
+static int merge_flush(int force)
+{
+	const unsigned columns = merge.layout->num_slots;
+	unsigned *head = merge.head;
+	int64_t limit = INT64_MAX;
+	unsigned i, j;
+
+	memset(head, 0, merge.num_caps * sizeof(unsigned));
+	for (i = 0; i < merge.num_caps; i++)
+		if (!force && !merge.caps[i].ended && merge.caps[i].last_ts < limit)
+			limit = merge.caps[i].last_ts;
+
+	while (1) {
+		struct ring_capture *next = NULL;
+		unsigned n = 0, slots;
 
-	/* Attempt to open non blocking the access dev */
-	fp_ring = open(ring_access, O_RDONLY | O_SYNC | O_NONBLOCK);
-	if (fp_ring == -1) { /* If it isn't there make the node */
-		fprintf(stderr, "Failed to open %s\n", ring_access);
-		goto err_ret;
+		for (i = 0; i < merge.num_caps; i++) {
+			struct ring_capture *cap = &merge.caps[i];
+			if (head[i] < cap->pending_len && cap->pending_ts[head[i]] <= limit &&
+					(!next || cap->pending_ts[head[i]] <
+					 next->pending_ts[head[n]])) {
+				next = cap;
+				n = i;
+			}
+		}
+		if (!next)
+			break;
+
+		slots = next->layout->num_slots;
+		for (j = 0; j < columns; j++)
+			merge.values[j * merge.block + merge.fill] = NAN;
+		for (j = 0; j < slots; j++)
+			merge.values[(next->first_column + j) * merge.block + merge.fill] =
+				next->pending[head[n] * slots + j];
+		merge.timestamps[merge.fill] = next->pending_ts[head[n]];
+		head[n]++;
+
+		if (++merge.fill == merge.block && merge_write_block() < 0)
+			return -1;
 	}
 
-	/* Attempt to open the event access dev (blocking this time) */
-	fp_ev = fopen(ring_event, "rb");
-	if (fp_ev == NULL) {
-		fprintf(stderr, "Failed to open %s\n", ring_event);
-		goto err_ret;
+	/* drop what has been written */
+	for (i = 0; i < merge.num_caps; i++) {
+		struct ring_capture *cap = &merge.caps[i];
+		unsigned slots = cap->layout->num_slots;
+		memmove(cap->pending, cap->pending + head[i] * slots,
+				(cap->pending_len - head[i]) * slots * sizeof(float));
+		memmove(cap->pending_ts, cap->pending_ts + head[i],
+				(cap->pending_len - head[i]) * sizeof(int64_t));
+		cap->pending_len -= head[i];
 	}
+	return merge_write_block();
+}
+
+static int merge_add(struct ring_capture *cap, size_t nscans)
+{
+	const unsigned slots = cap->layout->num_slots;
+	size_t s;
+	unsigned j;
+
+	/* room for two blocks of scans, make space if a device lags */
+	if (cap->pending_len + nscans > 2 * cap->block && merge_flush(1) < 0)
+		return -1;
+
+	for (s = 0; s < nscans; s++) {
+		float *row = cap->pending + (cap->pending_len + s) * slots;
+		for (j = 0; j < slots; j++)
+			row[j] = cap->values[j * cap->block + s];
+		cap->pending_ts[cap->pending_len + s] = cap->timestamps[s];
+	}
+	cap->pending_len += nscans;
+	if (nscans)
+		cap->last_ts = cap->timestamps[nscans - 1];
+
+	return merge_flush(0);
+}
+
+/* Pass one block of raw scans on to the text output */
+static int capture_block(struct ring_capture *cap, const char *data, size_t len)
+{
+	size_t nscans;
+
+	nscans = iio_scan_decode(cap->layout, data, len, cap->samples,
+			cap->block, cap->timestamps);
+	if (out_type == OUTPUT_SHM) {
+		iio_shm_publish(cap->shm, cap->samples, cap->block, cap->timestamps,
+				nscans);
+		return 0;
+	}
+	if (out_type == OUTPUT_PACKED) {
+		if (iio_capture_write_packed(cap->out_fd, cap->layout, cap->samples,
+				cap->block, cap->timestamps, nscans, cap->data) < 0)
+			fail_return("Failed to write output: %s\n", strerror(errno));
+		return 0;
+	}
+	iio_scan_convert(cap->layout, cap->samples, cap->values, cap->block, nscans);
+	if (cap->filter)
+		nscans = iio_filter_run(cap->filter, cap->values, cap->block,
+				cap->layout->ts_offset >= 0 ? cap->timestamps : NULL, nscans);
+	if (merge_output)
+		return merge_add(cap, nscans);
+
+	if (iio_output_scans(cap->out, cap->values, cap->block, cap->timestamps,
+			nscans) < 0 ||
+			(out_type == OUTPUT_TABLE && iio_output_flush(cap->out) < 0))
+		fail_return("Failed to write output: %s\n", strerror(errno));
+	return 0;
+}
 
-	/* Wait for SIGINT */
-	while (run == PROG_RUN) {
-		int toread, i;
-		struct iio_event_data dat;
-		int read_size = fread(&dat, 1, sizeof(struct iio_event_data), fp_ev);
-		switch (dat.id) {
+/* Give up on splice(), whatever is still in the pipe is copied out */
+static int stop_splice(struct ring_capture *cap)
+{
+	const size_t size = cap->block * cap->layout->scan_size;
+	ssize_t len;
+
+	if (verblevel > VERBLEVEL_DEFAULT)
+		fprintf(stderr, "%s: splice not supported, copying data\n",
+				cap->dev->name);
+
+	fcntl(cap->pipe_fd[0], F_SETFL, O_NONBLOCK);
+	while ((len = read(cap->pipe_fd[0], cap->data, size)) > 0)
+		if (iio_capture_write_block(cap->out_fd, cap->data, len) < 0)
+			return -1;
+	close(cap->pipe_fd[0]);
+	close(cap->pipe_fd[1]);
+	cap->pipe_fd[0] = cap->pipe_fd[1] = -1;
+	return 0;
+}
+
+/* Move up to len bytes of raw scans from the ring to the output, by
+ * splice() through a pipe if the devices support it, else by a copy
+ * through the data buffer. Same return values as read().
+ */
+static ssize_t move_raw(struct ring_capture *cap, size_t len)
+{
+	ssize_t in, out, left;
+
+	while (cap->pipe_fd[0] >= 0) {
+		in = splice(cap->ring_fd, NULL, cap->pipe_fd[1], NULL, len,
+				SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (in < 0 && (errno == EINVAL || errno == ENOSYS)) {
+			if (stop_splice(cap) < 0)
+				return -1;
+			break;
+		}
+		if (in <= 0)
+			return in;
+
+		for (left = in; left > 0; left -= out) {
+			out = splice(cap->pipe_fd[0], NULL, cap->out_fd, NULL, left,
+					SPLICE_F_MOVE);
+			if (out < 0 && errno == EINTR) {
+				out = 0;
+				continue;
+			}
+			if (out < 0 && errno == EINVAL) {
+				if (stop_splice(cap) < 0)
+					return -1;
+				return in;
+			}
+			if (out <= 0)
+				return -1;
+		}
+		return in;
+	}
+
+	in = read(cap->ring_fd, cap->data, len);
+	if (in > 0 && iio_capture_write_block(cap->out_fd, cap->data, in) < 0)
+		return -1;
+	return in;
+}
+
+static void ring_doorbell(int fd, int *waiting)
+{
+	uint64_t one = 1;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST) &&
+			write(fd, &one, sizeof(one)) < 0)
+		perror("doorbell");
+}
+
+/* Sleep on fd unless ready() turns true after announcing the wait */
+static void wait_doorbell(int fd, int *waiting, int (*ready)(void *), void *arg)
+{
+	uint64_t count;
+
+	__atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+	if (!ready(arg) && read(fd, &count, sizeof(count)) < 0 && errno != EINTR)
+		perror("doorbell");
+	__atomic_store_n(waiting, 0, __ATOMIC_SEQ_CST);
+}
+
+static int queue_has_space(void *arg)
+{
+	return iio_queue_has_space(arg);
+}
+
+static int queues_have_data(void *arg)
+{
+	size_t len;
+	unsigned i;
+
+	(void)arg;
+	for (i = 0; i < writer.num_caps; i++)
+		if (iio_queue_peek(writer.caps[i].queue, &len))
+			return 1;
+	return 0;
+}
+
+/* Get a free queue block, waiting for the writer if there is none */
+char *queue_block(struct ring_capture *cap)
+{
+	char *block = iio_queue_reserve(cap->queue);
+
+	if (!block) {
+		while (!iio_queue_has_space(cap->queue))
+			wait_doorbell(writer.space_fd, &writer.reader_waiting,
+					queue_has_space, cap->queue);
+		block = iio_queue_reserve(cap->queue);
+	}
+	return block;
+}
+
+/* Hand len bytes in the reserved block over to the writer */
+void queue_commit(struct ring_capture *cap, size_t len)
+{
+	iio_queue_commit(cap->queue, len);
+	ring_doorbell(writer.data_fd, &writer.writer_waiting);
+}
+
+/* Read up to len bytes of scans from the ring into the queue */
+static ssize_t queue_read(struct ring_capture *cap, size_t len)
+{
+	ssize_t ret = read(cap->ring_fd, queue_block(cap), len);
+
+	if (ret > 0)
+		queue_commit(cap, ret);
+	return ret;
+}
+
+/* Tell the writer that no more data will come for cap */
+void queue_end(struct ring_capture *cap)
+{
+	if (!writer.running || cap->end_sent)
+		return;
+	cap->end_sent = 1;
+	queue_block(cap);
+	iio_queue_commit(cap->queue, 0);
+	ring_doorbell(writer.data_fd, &writer.writer_waiting);
+}
+
+/* Decode and write out the queued blocks until every capture has seen
+ * its end marker. After an error the remaining blocks are dropped, so
+ * the reader never waits for space forever.
+ */
+static void *writer_thread(void *arg)
+{
+	unsigned i, ended = 0;
+
+	(void)arg;
+	while (ended < writer.num_caps) {
+		int busy = 0;
+
+		for (i = 0; i < writer.num_caps; i++) {
+			struct ring_capture *cap = &writer.caps[i];
+			const char *block;
+			size_t len;
+
+			while ((block = iio_queue_peek(cap->queue, &len))) {
+				if (len == 0) {
+					cap->ended = 1;
+					ended++;
+				} else if (!writer.failed && capture_block(cap, block, len) < 0) {
+					/* let the main loop shut down */
+					writer.failed = 1;
+					kill(getpid(), SIGTERM);
+				}
+				iio_queue_release(cap->queue);
+				ring_doorbell(writer.space_fd, &writer.reader_waiting);
+				busy = 1;
+			}
+		}
+		if (!busy && ended < writer.num_caps)
+			wait_doorbell(writer.data_fd, &writer.writer_waiting,
+					queues_have_data, NULL);
+	}
+	return NULL;
+}
+
+static int writer_start(struct ring_capture *caps, unsigned num_caps)
+{
+	writer.caps = caps;
+	writer.num_caps = num_caps;
+	writer.data_fd = eventfd(0, EFD_CLOEXEC);
+	writer.space_fd = eventfd(0, EFD_CLOEXEC);
+	if (writer.data_fd < 0 || writer.space_fd < 0)
+		fail_return("Failed to create eventfd: %s\n", strerror(errno));
+	errno = pthread_create(&writer.thread, NULL, writer_thread, NULL);
+	if (errno)
+		fail_return("Failed to start the writer thread: %s\n", strerror(errno));
+	writer.running = 1;
+	return 0;
+}
+
+/* Send the end marker to all captures and wait for the writer */
+static int writer_stop(void)
+{
+	unsigned i;
+
+	if (writer.running) {
+		for (i = 0; i < writer.num_caps; i++)
+			queue_end(&writer.caps[i]);
+		pthread_join(writer.thread, NULL);
+		writer.running = 0;
+	}
+	if (writer.data_fd >= 0)
+		close(writer.data_fd);
+	if (writer.space_fd >= 0)
+		close(writer.space_fd);
+	writer.data_fd = writer.space_fd = -1;
+	return writer.failed ? -1 : 0;
+}
+
+/* Read toread scans, then keep going as long as the ring delivers
+ * everything asked for. Returns -1 on errors.
+ */
+static int drain_ring(struct ring_capture *cap, unsigned toread)
+{
+	const size_t block = cap->block * cap->layout->scan_size;
+	size_t want = toread * cap->layout->scan_size;
+
+	while (want > 0) {
+		size_t chunk = want < block ? want : block;
+		ssize_t len;
+
+		if (out_type == OUTPUT_BINARY)
+			len = move_raw(cap, chunk);
+		else if (out_type == OUTPUT_SERVE)
+			len = serve_read(cap, chunk);
+		else
+			len = queue_read(cap, chunk);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				cap->stats.eagain++;
+				return 0;
+			}
+			fail_return("Failed to move data from %s: %s\n",
+					cap->dev->buffer->access, strerror(errno));
+		}
+		if (len == 0)
+			return 0;
+		cap->stats.reads++;
+		cap->stats.bytes += len;
+		cap->stats.scans += len / cap->layout->scan_size;
+		if ((size_t)len < chunk) {
+			cap->stats.short_reads++;
+			return 0;
+		}
+		want -= len;
+		if (want == 0)
+			want = block;
+	}
+	return 0;
+}
+
+/* Resize the ring, what it holds is read first */
+static int resize_ring(struct ring_capture *cap, unsigned length)
+{
+	const struct iio_setup_config config = { .length = length, .enable = 1 };
+
+	if (drain_ring(cap, cap->length) < 0)
+		return -1;
+	if (iio_setup_apply(cap->setup, &config) < 0)
+		fail_return("Failed to resize the ring buffer of %s\n", cap->dev->name);
+
+	if (verblevel > VERBLEVEL_DEFAULT)
+		fprintf(stderr, "%s: ring length %u -> %u\n", cap->dev->name,
+				cap->length, length);
+	cap->length = length;
+	return 0;
+}
+
+/*
+ * Auto-tuning: at most once a second the event rate is compared with the
+ * target. A ring that ran full doubles and never shrinks back to that
+ * length, one that wakes us more than twice as often as wanted doubles,
+ * and one that wakes us less than half as often halves.
+ */
+static int tune_ring(struct ring_capture *cap)
+{
+	const struct capture_stats *st = &cap->stats;
+	unsigned long us = elapsed_us(&cap->tune_start);
+	unsigned long events = st->events_50 + st->events_75 + st->events_100;
+	unsigned long full = st->events_100 - cap->tune_full;
+	unsigned length = cap->length;
+	double rate;
+
+	if (us < 1000000)
+		return 0;
+	rate = (events - cap->tune_events) * 1e6 / us;
+
+	if (full) {
+		cap->min_length = 2 * length;
+		length *= 2;
+	} else if (rate > 2.0 * auto_wakeups) {
+		length *= 2;
+	} else if (rate < auto_wakeups / 2.0) {
+		length /= 2;
+	}
+	if (length < cap->min_length)
+		length = cap->min_length;
+	if (length > MAX_RING_LENGTH)
+		length = MAX_RING_LENGTH;
+
+	clock_gettime(CLOCK_MONOTONIC, &cap->tune_start);
+	cap->tune_events = events;
+	cap->tune_full = st->events_100;
+	if (length == cap->length)
+		return 0;
+	return resize_ring(cap, length);
+}
+
+/* Count n ring events. toread grows to the scans they announce, oldest
+ * is set to the timestamp of the first one, -1 if it has none.
+ */
+void count_events(struct ring_capture *cap,
+		const struct iio_event_data *events, unsigned n, unsigned *toread,
+		int64_t *oldest)
+{
+	unsigned i;
+
+	for (i = 0; i < n; i++) {
+		if (!*oldest)
+			*oldest = events[i].timestamp ? events[i].timestamp : -1;
+		switch (events[i].id) {
 		case IIO_EVENT_CODE_RING_100_FULL:
-			toread = ring_length;
+			cap->stats.events_100++;
+			*toread = cap->length;
 			break;
 		case IIO_EVENT_CODE_RING_75_FULL:
-			toread = ring_length*3/4;
+			cap->stats.events_75++;
+			if (*toread < cap->length*3/4)
+				*toread = cap->length*3/4;
 			break;
 		case IIO_EVENT_CODE_RING_50_FULL:
-			toread = ring_length/2;
+			cap->stats.events_50++;
+			if (*toread < cap->length/2)
+				*toread = cap->length/2;
 			break;
 		default:
-			fprintf(stderr, "Unexpected event code 0x%0x\n", dat.id);
-			continue;
+			/* reported by print_stats(), no stdio in the loop */
+			cap->stats.events_unknown++;
+			cap->stats.unknown_code = events[i].id;
+			break;
 		}
+	}
+}
+
+/* Latencies of a drain that began at start, for events from oldest */
+void record_drain(struct ring_capture *cap, const struct timespec *start,
+		int64_t oldest)
+{
+	long us = wakeup_latency(oldest);
+
+	record_latency(cap->stats.latency, &cap->stats.latency_max,
+			elapsed_us(start));
+	if (us >= 0)
+		record_latency(cap->stats.wakeup, &cap->stats.wakeup_max, us);
+	else
+		cap->stats.wakeup_unknown++;
+}
+
+/* Consume all pending ring events and move the data they announce.
+ * Returns 1 if the event line was closed, -1 on errors.
+ */
+static int handle_events(struct ring_capture *cap)
+{
+	struct iio_event_data events[16];
+	struct timespec start;
+	unsigned toread = 0;
+	int64_t oldest = 0;		/* timestamp of the first event */
+	ssize_t len;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while ((len = read(cap->event_fd, events, sizeof(events))) > 0)
+		count_events(cap, events, len / sizeof(struct iio_event_data),
+				&toread, &oldest);
+	if (len < 0 && errno != EAGAIN && errno != EINTR)
+		fail_return("Failed to read %s: %s\n", cap->dev->buffer->event,
+				strerror(errno));
+
+	if (toread) {
+		if (drain_ring(cap, toread) < 0)
+			return -1;
+		record_drain(cap, &start, oldest);
+	}
+	if (auto_wakeups && len != 0 && tune_ring(cap) < 0)
+		return -1;
+	return len == 0;
+}
+
+/* Write to every page, so it is backed by memory before it is locked */
+static void prefault(void *buf, size_t len)
+{
+	const size_t page = sysconf(_SC_PAGESIZE);
+	volatile char *p = buf;
+	size_t i;
+
+	if (!buf)
+		return;
+	for (i = 0; i < len; i += page)
+		p[i] = 0;
+	if (len)
+		p[len - 1] = 0;
+}
+
+static void __attribute__((noinline)) prefault_stack(void)
+{
+	char stack[REALTIME_STACK];
+
+	prefault(stack, sizeof(stack));
+	__asm__ volatile("" : : "r"(stack) : "memory");
+}
+
+/*
+ * --realtime: the main thread, which drains the rings, is pinned to one
+ * CPU, runs with SCHED_FIFO and does not take page faults. Everything
+ * the loop touches is allocated by now; the buffers of the main thread
+ * and its stack are faulted in and all memory of the process is locked,
+ * as are later allocations of the client setup of --serve. The writer
+ * thread was started before and keeps the normal policy.
+ */
+static int realtime_setup(struct ring_capture *caps, unsigned num_caps)
+{
+	struct sched_param param = { .sched_priority = realtime_priority };
+	unsigned i;
+
+	if (realtime_cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(realtime_cpu, &set);
+		errno = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (errno)
+			fail_return("Failed to pin the reader to CPU %d: %s\n",
+					realtime_cpu, strerror(errno));
+	}
+
+	for (i = 0; i < num_caps; i++) {
+		struct ring_capture *cap = &caps[i];
+		const struct iio_scan_layout *layout = cap->layout;
+
+		prefault(cap->data, out_type == OUTPUT_PACKED ?
+				iio_pack_bound(layout, IIO_PACK_SCANS) :
+				layout->scan_size * cap->block);
+		prefault(cap->samples, layout->num_slots * cap->block * sizeof(int32_t));
+		prefault(cap->timestamps, cap->block * sizeof(int64_t));
+		if (cap->queue)
+			prefault(cap->queue->blocks,
+					cap->queue->depth * cap->queue->block_size);
+	}
+	prefault_stack();
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+		fail_return("Failed to lock memory: %s\n", strerror(errno));
+	errno = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+	if (errno)
+		fail_return("Failed to select SCHED_FIFO priority %d: %s\n",
+				realtime_priority, strerror(errno));
+
+	if (verblevel > VERBLEVEL_DEFAULT)
+		fprintf(stderr, "Real-time: SCHED_FIFO priority %d, CPU %d, memory locked\n",
+				realtime_priority, realtime_cpu);
+	return 0;
+}
+
+static int read_rings(struct ring_capture *caps, unsigned num_caps)
+{
+	struct epoll_event ev;
+	struct signalfd_siginfo si;
+	sigset_t mask;
+	int epoll_fd = -1, sig_fd = -1, timer_fd = -1, ret = -1, started = 0;
+	unsigned i, j, open_lines = num_caps;
+	uint64_t expired;
 
-		read_size = read(fp_ring, data, toread * samples * bps);
-		if (read_size == -EAGAIN) {
-			fprintf(stderr, "nothing available\n");
+	writer.data_fd = writer.space_fd = -1;
+	for (i = 0; i < num_caps; i++)
+		caps[i].ring_fd = caps[i].event_fd = -1;
+	if (use_uring && uring_open() < 0) {
+		if (verblevel > VERBLEVEL_DEFAULT)
+			fprintf(stderr, "io_uring not available (%s), using read()\n",
+					strerror(errno));
+		use_uring = 0;
+	}
+	for (i = 0; i < num_caps; i++)
+		if (capture_setup(&caps[i]) < 0)
+			goto err_teardown;
+	if (merge_output && merge_setup(caps, num_caps) < 0)
+		goto err_teardown;
+	if (out_type != OUTPUT_BINARY && out_type != OUTPUT_SERVE &&
+			writer_start(caps, num_caps) < 0)
+		goto err_teardown;
+	if (use_uring)
+		uring_register(caps, num_caps);
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGUSR1);
+	sig_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (sig_fd < 0 || epoll_fd < 0)
+		goto err_epoll;
+
+	/* one reactor for all devices, the signalfd is tagged with NULL */
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sig_fd, &ev) < 0)
+		goto err_epoll;
+	if (out_type == OUTPUT_SERVE && serve_start(caps, num_caps, epoll_fd,
+			serve_path) < 0)
+		goto err_close;
+	if (stats_interval) {
+		struct itimerspec its = {
+			.it_interval = { stats_interval, 0 },
+			.it_value = { stats_interval, 0 },
+		};
+		timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (timer_fd < 0 || timerfd_settime(timer_fd, 0, &its, NULL) < 0)
+			goto err_epoll;
+		ev.data.ptr = &stats_timer_tag;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev) < 0)
+			goto err_epoll;
+	}
+	for (i = 0; !use_uring && i < num_caps; i++) {
+		ev.data.ptr = &caps[i];
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, caps[i].event_fd, &ev) < 0)
+			goto err_epoll;
+	}
+
+	if (realtime_priority && realtime_setup(caps, num_caps) < 0)
+		goto err_close;
+
+	/* Until SIGINT or all event lines are closed */
+	started = 1;
+	if (use_uring) {
+		ret = uring_loop(caps, num_caps, sig_fd, timer_fd);
+		goto err_close;
+	}
+	while (open_lines > 0) {
+		struct epoll_event events[MAX_DEVICES + MAX_CLIENTS + 3];
+		int n = epoll_wait(epoll_fd, events, MAX_DEVICES + MAX_CLIENTS + 3, -1);
+		if (n < 0 && errno == EINTR)
 			continue;
-		}
+		if (n < 0)
+			goto err_epoll;
 
-//		for (i = 0; i < read_size / (samples*bps); i++)
-//			print_sample_set(data + i*samples*bps, 12, 14);
+		for (i = 0; i < (unsigned)n; i++) {
+			struct ring_capture *cap = events[i].data.ptr;
+			int closed;
 
+			if (!cap) {
+				if (read(sig_fd, &si, sizeof(si)) != sizeof(si))
+					continue;
+				if (si.ssi_signo != SIGUSR1) {
+					open_lines = 0;
+					continue;
+				}
+				for (j = 0; j < num_caps; j++)
+					print_stats(stderr, &caps[j]);
+				continue;
+			}
+			if (serve_event(events[i].data.ptr, events[i].events))
+				continue;
+			if (events[i].data.ptr == &stats_timer_tag) {
+				if (read(timer_fd, &expired, sizeof(expired)) > 0)
+					for (j = 0; j < num_caps; j++)
+						print_stats_line(stderr, &caps[j]);
+				continue;
+			}
+			if (cap->closed)
+				continue;
+
+			closed = handle_events(cap);
+			if (closed < 0)
+				goto err_close;
+			if (closed || (events[i].events & EPOLLHUP)) {
+				/* nobody left to signal new data, fetch the rest */
+				epoll_ctl(epoll_fd, EPOLL_CTL_DEL, cap->event_fd, NULL);
+				cap->closed = 1;
+				open_lines--;
+				if (drain_ring(cap, cap->length) < 0)
+					goto err_close;
+				queue_end(cap);
+			}
+		}
 	}
+	ret = 0;
+	goto err_close;
 
-err_ret:
-	/* Stop the ring buffer */
-	if (write_sysfs_int("ring_enable", iio_dev->buffer->path, 0) < 0)
-		fail_return("Failed to open the ring buffer control file\n");
+err_epoll:
+	fprintf(stderr, "Event loop failed: %s\n", strerror(errno));
+err_close:
+	serve_stop();
+	/* cancels the reads still in flight */
+	uring_close();
+	if (timer_fd >= 0)
+		close(timer_fd);
+	if (epoll_fd >= 0)
+		close(epoll_fd);
+	if (sig_fd >= 0)
+		close(sig_fd);
+err_teardown:
+	uring_close();
+	if (writer_stop() < 0)
+		ret = -1;
+	if (merge.out && merge_flush(1) < 0)
+		ret = -1;
+	merge_free();
+	for (i = 0; i < num_caps; i++) {
+		if (started)
+			print_stats(stderr, &caps[i]);
+		capture_teardown(&caps[i]);
+	}
+	return ret;
+}
 
-	free(data);
+/* Intern the comma separated names of --elements into setup_config */
+static int parse_elements(const char *list)
+{
+	const char *p, *end;
 
+	for (p = list; *p; p = *end ? end + 1 : end) {
+		end = p + strcspn(p, ",");
+		if (end == p || end - p >= SYSFS_NAME_LEN ||
+				setup_config.num_elements == IIO_SERVE_MAX_ELEMENTS)
+			return -1;
+		setup_elements[setup_config.num_elements] = iio_intern_len(p, end - p);
+		if (!setup_elements[setup_config.num_elements++])
+			return -1;
+	}
 	return 0;
 }
 
 int main(int argc, char **argv)
 {
-	struct iio_device *iio_dev;
 	struct iio_ring_buffer *ring_buffer;
 	static const struct option long_options[] = {
 		{ "version", 0, 0, 'V' },
 		{ "verbose", 0, 0, 'v' },
 		{ "csv", 0, 0, 'c' },
 		{ "xml", 0, 0, 'x' },
+		{ "binary", 0, 0, 'b' },
+		{ "packed", 0, 0, 'p' },
+		{ "merge", 0, 0, 'm' },
+		{ "queue", 1, 0, 'q' },
+		{ "length", 1, 0, 'l' },
+		{ "auto-length", 1, 0, 'a' },
+		{ "stats", 1, 0, 's' },
+		{ "output", 1, 0, 'o' },
+		{ "replay", 1, 0, 'r' },
+		{ "root", 1, 0, 'R' },
+		{ "decimate", 1, 0, 'd' },
+		{ "filter", 1, 0, 'f' },
+		{ "shm", 1, 0, 'S' },
+		{ "shm-scans", 1, 0, 'n' },
+		{ "attach", 1, 0, 'A' },
+		{ "serve", 1, 0, 'U' },
+		{ "connect", 1, 0, 'C' },
+		{ "elements", 1, 0, 'e' },
+		{ "batch", 1, 0, 'B' },
+		{ "realtime", 1, 0, 'P' },
+		{ "cpu", 1, 0, 'k' },
+		{ "uring", 0, 0, 'u' },
+		{ "trigger", 1, 0, 'T' },
 		{ 0, 0, 0, 0 }
 	};
 
 	int c, err = 0;
 
-	const char *path = NULL;
-	char trigger_name[SYSFS_NAME_LEN];
+	const char *paths[MAX_DEVICES];
+	unsigned num_paths = 0, i;
+	const char *out_file = NULL;
+	const char *replay_file = NULL;
+	const char *shm_name = NULL;
+	const char *attach_name = NULL;
+	const char *connect_path = NULL;
+	const char *elements = NULL;
+	unsigned batch = DEFAULT_BATCH;
+	FILE *info;
+	struct ring_capture caps[MAX_DEVICES];
+	sigset_t mask;
 
-    signal(SIGTERM, &quit);
-    signal(SIGABRT, &quit);
-    signal(SIGINT, &quit);
+	/* Termination and SIGUSR1 are picked up by the event loop through
+	 * a signalfd */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGUSR1);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
 
-	while ((c = getopt_long(argc, argv, "D:vV",
+	while ((c = getopt_long(argc, argv, "A:B:C:D:P:R:S:T:U:a:bcd:e:f:k:l:mn:pxo:q:r:s:uvV",
 			long_options, NULL)) != EOF) {
 		switch(c) {
 		case 'V':
@@ -227,7 +1692,12 @@ int main(int argc, char **argv)
 			break;
 
 		case 'D':
-			path = optarg;
+			if (num_paths == MAX_DEVICES) {
+				fprintf(stderr, "At most %d devices\n", MAX_DEVICES);
+				err++;
+				break;
+			}
+			paths[num_paths++] = optarg;
 			break;
 
 		case 'c':
@@ -238,55 +1708,451 @@ int main(int argc, char **argv)
 			out_type = OUTPUT_XML;
 			break;
 
+		case 'b':
+			out_type = OUTPUT_BINARY;
+			break;
+
+		case 'p':
+			out_type = OUTPUT_PACKED;
+			break;
+
+		case 'm':
+			merge_output = 1;
+			break;
+
+		case 'S':
+			out_type = OUTPUT_SHM;
+			shm_name = optarg;
+			break;
+
+		case 'n':
+			shm_scans = atoi(optarg);
+			if (shm_scans < 2 || shm_scans > MAX_SHM_SCANS) {
+				fprintf(stderr, "Shared memory ring must be 2 to %d scans\n",
+						MAX_SHM_SCANS);
+				err++;
+			}
+			break;
+
+		case 'A':
+			attach_name = optarg;
+			break;
+
+		case 'U':
+			out_type = OUTPUT_SERVE;
+			serve_path = optarg;
+			break;
+
+		case 'C':
+			connect_path = optarg;
+			break;
+
+		case 'e':
+			elements = optarg;
+			break;
+
+		case 'P':
+			realtime_priority = atoi(optarg);
+			if (realtime_priority < sched_get_priority_min(SCHED_FIFO) ||
+					realtime_priority > sched_get_priority_max(SCHED_FIFO)) {
+				fprintf(stderr, "SCHED_FIFO priority must be %d to %d\n",
+						sched_get_priority_min(SCHED_FIFO),
+						sched_get_priority_max(SCHED_FIFO));
+				err++;
+			}
+			break;
+
+		case 'k':
+			realtime_cpu = atoi(optarg);
+			if (realtime_cpu < 0 || realtime_cpu >= CPU_SETSIZE) {
+				fprintf(stderr, "Invalid CPU %s\n", optarg);
+				err++;
+			}
+			break;
+
+		case 'u':
+			use_uring = 1;
+			break;
+
+		case 'T':
+			setup_config.trigger = optarg;
+			break;
+
+		case 'B':
+			batch = atoi(optarg);
+			if (batch < 1 || batch > IIO_SERVE_MAX_BLOCK) {
+				fprintf(stderr, "Batches must be 1 to %d scans\n",
+						IIO_SERVE_MAX_BLOCK);
+				err++;
+			}
+			break;
+
+		case 'l':
+			ring_length = atoi(optarg);
+			if (ring_length < MIN_RING_LENGTH || ring_length > MAX_RING_LENGTH) {
+				fprintf(stderr, "Ring length must be %d to %d scans\n",
+						MIN_RING_LENGTH, MAX_RING_LENGTH);
+				err++;
+			}
+			break;
+
+		case 'a':
+			auto_wakeups = atoi(optarg);
+			if (!auto_wakeups) {
+				fprintf(stderr, "Auto-tuning needs a wakeup rate\n");
+				err++;
+			}
+			break;
+
+		case 'q': {
+			char *end;
+			unsigned long val = strtoul(optarg, &end, 10);
+
+			if (end == optarg || *end || optarg[0] == '-' ||
+					val < 2 || val > MAX_QUEUE_DEPTH) {
+				fprintf(stderr, "Queue must be 2 to %d blocks\n",
+						MAX_QUEUE_DEPTH);
+				err++;
+			}
+			queue_depth = val;
+			break;
+		}
+
+		case 'o':
+			out_file = optarg;
+			break;
+
+		case 'r':
+			replay_file = optarg;
+			break;
+
+		case 's': {
+			char *end;
+			unsigned long val = strtoul(optarg, &end, 10);
+
+			if (end == optarg || *end || optarg[0] == '-' ||
+					val < 1 || val > MAX_STATS_INTERVAL) {
+				fprintf(stderr, "Stats interval must be 1 to %d seconds\n",
+						MAX_STATS_INTERVAL);
+				err++;
+			}
+			stats_interval = val;
+			break;
+		}
+
+		case 'R':
+			if (iio_set_root(optarg) < 0) {
+				fprintf(stderr, "Cannot use root %s\n", optarg);
+				err++;
+			}
+			break;
+
+		case 'd':
+			decimation = atoi(optarg);
+			if (decimation < 1 || decimation > MAX_DECIMATION) {
+				fprintf(stderr, "Decimation must be 1 to %d\n",
+						MAX_DECIMATION);
+				err++;
+			}
+			break;
+
+		case 'f': {
+			const char *type = strchr(optarg, '=');
+			struct filter_spec *spec = &filter_specs[num_filter_specs];
+
+			if (num_filter_specs == MAX_FILTER_SPECS) {
+				fprintf(stderr, "At most %d filters\n", MAX_FILTER_SPECS);
+				err++;
+				break;
+			}
+			spec->element = type ? iio_intern_len(optarg, type - optarg) : NULL;
+			spec->type = iio_filter_type_from_name(type ? type + 1 : optarg);
+			if (spec->type == IIO_FILTER_UNKNOWN) {
+				fprintf(stderr, "Unknown filter %s\n", optarg);
+				err++;
+				break;
+			}
+			num_filter_specs++;
+			break;
+		}
+
 		case '?':
 		default:
 			err++;
 			break;
 		}
 	}
-	if (err || argc > optind || !path) {
-		fprintf(stderr, "Usage: iio_ring [options] -D <device>\n"
+	if (merge_output &&
+			(out_type == OUTPUT_BINARY || out_type == OUTPUT_PACKED)) {
+		fprintf(stderr, "Binary captures can not be merged\n");
+		err++;
+	}
+	if (decimation > 1 &&
+			(out_type == OUTPUT_BINARY || out_type == OUTPUT_PACKED)) {
+		fprintf(stderr, "Binary captures can not be decimated\n");
+		err++;
+	}
+	if (out_type == OUTPUT_SHM && (merge_output || decimation > 1 || out_file)) {
+		fprintf(stderr, "--shm publishes the scans of each device as they are\n");
+		err++;
+	}
+	if (out_type == OUTPUT_SERVE && (merge_output || decimation > 1 || out_file)) {
+		fprintf(stderr, "--serve sends the scans of each device as they are\n");
+		err++;
+	}
+	if ((out_type == OUTPUT_SHM || out_type == OUTPUT_SERVE) &&
+			(attach_name || replay_file || connect_path)) {
+		fprintf(stderr, "--shm and --serve need devices to read from\n");
+		err++;
+	}
+	if (connect_path && num_paths != 1) {
+		fprintf(stderr, "--connect needs exactly one device\n");
+		err++;
+	}
+	if (realtime_cpu >= 0 && !realtime_priority) {
+		fprintf(stderr, "--cpu needs --realtime\n");
+		err++;
+	}
+	if (realtime_priority && auto_wakeups) {
+		/* resizing rewrites sysfs files inside the loop */
+		fprintf(stderr, "--realtime keeps the ring length, drop --auto-length\n");
+		err++;
+	}
+	if (realtime_priority && (replay_file || attach_name || connect_path)) {
+		fprintf(stderr, "--realtime is for reading devices\n");
+		err++;
+	}
+	if (use_uring && (out_type == OUTPUT_SERVE || auto_wakeups)) {
+		/* clients and resizing need the read() path */
+		fprintf(stderr, "--uring works without --serve and --auto-length\n");
+		err++;
+	}
+	if (use_uring && (replay_file || attach_name || connect_path)) {
+		fprintf(stderr, "--uring is for reading devices\n");
+		err++;
+	}
+	if ((elements || setup_config.trigger) && (replay_file || attach_name)) {
+		fprintf(stderr, "--elements and --trigger need devices\n");
+		err++;
+	}
+	if (setup_config.trigger && connect_path) {
+		fprintf(stderr, "--trigger is for reading devices\n");
+		err++;
+	}
+	if (elements && !connect_path && parse_elements(elements) < 0) {
+		fprintf(stderr, "Invalid elements %s\n", elements);
+		err++;
+	}
+	if (num_filter_specs && decimation == 1) {
+		fprintf(stderr, "Filters need --decimate\n");
+		err++;
+	}
+	if (num_paths > 1 && !merge_output && !out_file && out_type != OUTPUT_SHM &&
+			out_type != OUTPUT_SERVE) {
+		fprintf(stderr, "Several devices need --merge, --output, --shm or --serve\n");
+		err++;
+	}
+	if (err || argc > optind ||
+			!!num_paths + !!replay_file + !!attach_name != 1) {
+		fprintf(stderr, "Usage: iio_ring [options] -D <device> [-D <device>...]\n"
+			"       iio_ring -r <capture>\n"
+			"       iio_ring -A <name>\n"
+			"       iio_ring -C <socket> -D <device>\n"
 			"Access industrial I/O ring buffers\n"
 			"  -v, --verbose\n"
 			"      Increase verbosity\n"
 			"  -D <device>\n"
-			"      Selects which device iio_ring will work on\n"
+			"      Selects which device iio_ring will work on, may be repeated\n"
 			"  -c, --csv\n"
 			"      Output CSV formatted data\n"
 			"  -x, --xml\n"
 			"      Output XML formatted data\n"
+			"  -b, --binary\n"
+			"      Write a binary capture: one header, then the raw scans\n"
+			"  -p, --packed\n"
+			"      Write a binary capture of losslessly packed scans\n"
+			"  -m, --merge\n"
+			"      Write the scans of all devices in timestamp order to one stream\n"
+			"  -o, --output <file>\n"
+			"      Write data to <file> instead of stdout, with several\n"
+			"      devices and no --merge to <file>.<device> each\n"
+			"  -l, --length <scans>\n"
+			"      Ring buffer length, default %d\n"
+			"  -a, --auto-length <wakeups>\n"
+			"      Size the ring for <wakeups> events per second from the\n"
+			"      sampling frequency and adapt it while capturing\n"
+			"  -q, --queue <blocks>\n"
+			"      Blocks of ring data queued for the output, default %d\n"
+			"  -d, --decimate <factor>\n"
+			"      Keep one of <factor> scans, filtered against aliasing\n"
+			"  -f, --filter [<element>=]<type>\n"
+			"      Filter in front of --decimate: pick, mean, cic or fir\n"
+			"      (default), for one scan element or channel or for all;\n"
+			"      may be repeated, later ones win\n"
+			"  -r, --replay <capture>\n"
+			"      Convert a binary or packed capture to CSV (or XML with -x),\n"
+			"      or to a raw (-b) or packed (-p) capture\n"
+			"  -S, --shm <name>\n"
+			"      Publish the decoded scans in POSIX shared memory <name>,\n"
+			"      with several devices in <name>.<device> each\n"
+			"  -n, --shm-scans <scans>\n"
+			"      Scans kept in shared memory for slow readers, default %d\n"
+			"  -A, --attach <name>\n"
+			"      Read the scans another iio_ring publishes with --shm and\n"
+			"      write them like --replay; overwritten scans are reported\n"
+			"  -U, --serve <socket>\n"
+			"      Keep the rings open and send their scans to the clients of\n"
+			"      the Unix socket <socket>; at most --queue frames are held\n"
+			"      back for a slow client, then its scans are dropped\n"
+			"  -C, --connect <socket>\n"
+			"      Get the scans of the device from iio_ring --serve and\n"
+			"      write them like --replay\n"
+			"  -e, --elements <element>[,<element>...]\n"
+			"      Scan elements or channels to enable on the devices, all\n"
+			"      others but the timestamp are disabled; or to ask for\n"
+			"      with --connect\n"
+			"  -T, --trigger <trigger>\n"
+			"      Trigger of the devices\n"
+			"  -B, --batch <scans>\n"
+			"      Scans per frame to ask for with --connect, default %d\n"
+			"  -P, --realtime <priority>\n"
+			"      Drain the rings with SCHED_FIFO <priority> from locked,\n"
+			"      prefaulted memory; the statistics show the worst time\n"
+			"      from a ring event to the end of its read\n"
+			"  -k, --cpu <cpu>\n"
+			"      Pin the reader of --realtime to <cpu>\n"
+			"  -u, --uring\n"
+			"      Keep the reads of events and ring data, and the writes of\n"
+			"      --binary, in flight on an io_uring; read() is used if the\n"
+			"      kernel does not offer it\n"
+			"  -s, --stats <seconds>\n"
+			"      Write a line of capture statistics to stderr every <seconds>,\n"
+			"      a full report is written on exit and on SIGUSR1\n"
+			"  -R, --root <dir>\n"
+			"      Find sysfs in <dir>/sys and the ring devices in <dir>/dev/iio,\n"
+			"      e.g. those of iio_sim\n"
 			"  -V, --version\n"
 			"      Show version of program\n"
-			);
+			, DEFAULT_RING_LENGTH, DEFAULT_QUEUE_DEPTH, DEFAULT_SHM_SCANS,
+			DEFAULT_BATCH);
 		exit(1);
 	}
 
-	iio_dev = iio_open_device_by_name(path);
-	if (!iio_dev) {
-		fprintf(stderr, "No industrial I/O device named %s!\n", path);
-		exit(1);
+	if (replay_file || attach_name || connect_path) {
+		if (out_file) {
+			out_fd = open(out_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (out_fd < 0) {
+				fprintf(stderr, "%s: %s\n", out_file, strerror(errno));
+				exit(1);
+			}
+		}
+		if (replay_file) {
+			err = replay_capture(replay_file) < 0;
+		} else if (attach_name) {
+			err = attach_shm(attach_name) < 0;
+		} else {
+			struct iio_serve_request req;
+			char line[IIO_SERVE_REQUEST_MAX];
+
+			/* the parser only looks names up, intern ours first */
+			snprintf(line, sizeof(line), "%s %u%s%s", paths[0], batch,
+					elements ? " " : "", elements ? elements : "");
+			if (!iio_intern(paths[0]) ||
+					(elements && parse_elements(elements) < 0) ||
+					iio_serve_parse_request(line, &req) < 0) {
+				fprintf(stderr, "Invalid device or elements\n");
+				err++;
+			} else {
+				err = connect_server(connect_path, &req) < 0;
+			}
+		}
+		if (out_fd != STDOUT_FILENO && close(out_fd) < 0) {
+			fprintf(stderr, "%s: %s\n", out_file, strerror(errno));
+			err++;
+		}
+		return err ? 1 : 0;
 	}
-	printf(	"Device\n"
-			"  path: %s\n"
-			"  name: %s\n"
-			"  number: %d\n", iio_dev->path, iio_dev->name, iio_dev->number);
 
-	ring_buffer = iio_get_ring_buffer(iio_dev);
-	if (!ring_buffer) {
-		fprintf(stderr, "Industrial I/O device has no ring buffer!\n");
-		exit(1);
+	/* keep machine readable output on stdout clean */
+	info = (out_type != OUTPUT_TABLE && !out_file) ? stderr : stdout;
+	if (verblevel > VERBLEVEL_DEFAULT)
+		fprintf(info, "Conversion: %s\n", iio_scan_convert_name());
+	if (verblevel > VERBLEVEL_DEFAULT && decimation > 1)
+		fprintf(info, "Decimation: %u\n", decimation);
+
+	memset(caps, 0, sizeof(caps));
+	for (i = 0; i < num_paths; i++) {
+		struct ring_capture *cap = &caps[i];
+
+		cap->out_fd = -1;
+		cap->dev = iio_open_device_by_name(paths[i]);
+		if (!cap->dev) {
+			fprintf(stderr, "No industrial I/O device named %s!\n", paths[i]);
+			goto err_close;
+		}
+		fprintf(info, "Device\n"
+				"  path: %s\n"
+				"  name: %s\n"
+				"  number: %d\n", cap->dev->path, cap->dev->name,
+				cap->dev->number);
+
+		ring_buffer = iio_get_ring_buffer(cap->dev);
+		if (!ring_buffer) {
+			fprintf(stderr, "Industrial I/O device has no ring buffer!\n");
+			goto err_close;
+		}
+
+		fprintf(info, "Buffer\n"
+				"  path: %s\n"
+				"  event: %s\n"
+				"  access: %s\n", ring_buffer->path, ring_buffer->event,
+				ring_buffer->access);
+
+		iio_get_trigger(cap->dev, cap->trigger);
+		fprintf(info, "Trigger: %s\n", cap->trigger);
 	}
+	fflush(info);
 
-	printf(	"Buffer\n"
-			"  path: %s\n"
-			"  event: %s\n"
-			"  access: %s\n", ring_buffer->path, ring_buffer->event, ring_buffer->access);
+	if (out_file) {
+		if (num_paths == 1 || merge_output) {
+			out_fd = open(out_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (out_fd < 0) {
+				fprintf(stderr, "%s: %s\n", out_file, strerror(errno));
+				goto err_close;
+			}
+		}
+		for (i = 0; i < num_paths && out_fd == STDOUT_FILENO; i++) {
+			char name[SYSFS_PATH_MAX];
+			snprintf(name, sizeof(name), "%s.%s", out_file, caps[i].dev->name);
+			caps[i].out_fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (caps[i].out_fd < 0) {
+				fprintf(stderr, "%s: %s\n", name, strerror(errno));
+				goto err_close;
+			}
+		}
+	}
+	for (i = 0; i < num_paths; i++)
+		if (caps[i].out_fd < 0)
+			caps[i].out_fd = out_fd;
+	for (i = 0; shm_name && i < num_paths; i++)
+		caps[i].shm_name = num_paths == 1 ? shm_name :
+			iio_intern_printf("%s.%s", shm_name, caps[i].dev->name);
 
-	iio_get_trigger(iio_dev, trigger_name);
-	printf( "Trigger: %s\n", trigger_name);
-	read_ring(iio_dev, DEFAULT_RING_LENGTH);
+	if (read_rings(caps, num_paths) < 0)
+		err++;
 	/* Disconnect from the trigger - writing something that doesn't exist.*/
 //	iio_set_trigger(iio_dev, "NULL");
 
-	return 0;
+	for (i = 0; i < num_paths; i++)
+		iio_close_device(caps[i].dev);
+	return err ? 1 : 0;
+
+err_close:
+	for (i = 0; i < num_paths; i++) {
+		if (caps[i].out_fd >= 0 && caps[i].out_fd != out_fd)
+			close(caps[i].out_fd);
+		if (caps[i].dev)
+			iio_close_device(caps[i].dev);
+	}
+	exit(1);
 }
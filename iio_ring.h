@@ -0,0 +1,148 @@
+/*
+ * Industrial I/O utilities - iio_ring.h
+ *
+ * Copyright (c) 2010 Manuel Stahl <manuel.stahl@iis.fraunhofer.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ */
+
+/* What the parts of iio_ring share, not part of the library */
+
+#ifndef __IIO_RING_H__
+#define __IIO_RING_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "iio.h"
+
+#define LATENCY_BUCKETS 24
+#define MAX_DEVICES 8
+#define MAX_CLIENTS 64
+
+enum verbosity {
+	VERBLEVEL_DEFAULT,
+};
+
+enum output_type {
+	OUTPUT_TABLE, OUTPUT_CVS, OUTPUT_XML, OUTPUT_BINARY, OUTPUT_PACKED,
+	OUTPUT_SHM, OUTPUT_SERVE,
+};
+
+extern enum verbosity verblevel;
+extern enum output_type out_type;
+extern unsigned queue_depth;
+
+/* What happened while draining one ring, kept by the main thread */
+struct capture_stats {
+	unsigned long events_50;
+	unsigned long events_75;
+	unsigned long events_100;
+	unsigned long events_unknown;
+	int unknown_code;		/* of the last unknown event */
+	unsigned long reads;
+	unsigned long short_reads;	/* less than asked for */
+	unsigned long eagain;
+	unsigned long long bytes;
+	unsigned long long scans;
+	/* event to end of read in microseconds: bucket 0 is below 1 us,
+	 * bucket i below 2^i us, the last one takes everything above */
+	unsigned long latency[LATENCY_BUCKETS];
+	unsigned long latency_max;
+	/* timestamp of the oldest event to end of read, same buckets:
+	 * the wakeup delay is included */
+	unsigned long wakeup[LATENCY_BUCKETS];
+	unsigned long wakeup_max;
+	unsigned long wakeup_unknown;	/* events without a timestamp */
+};
+
+/* Everything needed to capture from one ring buffer */
+struct ring_capture {
+	struct iio_device *dev;
+	char trigger[SYSFS_NAME_LEN];
+	unsigned length;		/* ring length in scans */
+	unsigned block;			/* scans moved per read */
+	struct dlist *scan_elements;
+	struct iio_setup *setup;	/* pre-opened sysfs attributes */
+	struct iio_scan_layout *layout;
+	struct iio_filter *filter;	/* text only, NULL without --decimate */
+	struct iio_output *out;
+	int out_fd;
+	const char *shm_name;		/* publish here with --shm */
+	struct iio_shm *shm;
+	unsigned num_clients;		/* of --serve, see serve_read() */
+	int enabled;
+	int closed;			/* event line went away */
+	int end_sent;			/* reader queued the end marker */
+	int ended;			/* writer saw the end marker */
+	struct iio_queue *queue;	/* reader to writer thread */
+	int ring_fd;
+	int event_fd;
+	int pipe_fd[2];			/* splice() path of binary captures */
+	struct capture_stats stats;
+
+	/* requests on the io_uring, see uring_loop() */
+	struct iio_event_data uring_events[16];
+	size_t uring_want;		/* bytes the drain still asks for, 0 if idle */
+	size_t uring_chunk;		/* asked for by the read in flight */
+	unsigned uring_again;		/* scans announced during the drain */
+	int uring_reading;
+	int uring_writing;
+	const char *uring_out;		/* binary: what is left of the block
+					 * being written */
+	size_t uring_out_len;
+	int uring_timed;		/* the drain was started by events */
+	struct timespec uring_start;
+	int64_t uring_oldest;
+
+	/* auto-tuning of the ring length, see tune_ring() */
+	unsigned min_length;		/* smaller rings ran full */
+	struct timespec tune_start;
+	unsigned long tune_events;
+	unsigned long tune_full;
+	char *data;			/* room for block scans when binary
+					 * or serving, for one packed block
+					 * when packed */
+	int32_t *samples;
+	float *values;
+	int64_t *timestamps;
+
+	/* scans waiting for the merged output, num_slots values each */
+	float *pending;
+	int64_t *pending_ts;
+	unsigned pending_len;
+	unsigned first_column;		/* of this device in the merged output */
+	int64_t last_ts;
+};
+
+/* iio_ring.c */
+void print_stats(FILE *f, const struct ring_capture *cap);
+void print_stats_line(FILE *f, const struct ring_capture *cap);
+char *queue_block(struct ring_capture *cap);
+void queue_commit(struct ring_capture *cap, size_t len);
+void queue_end(struct ring_capture *cap);
+void count_events(struct ring_capture *cap,
+		const struct iio_event_data *events, unsigned n, unsigned *toread,
+		int64_t *oldest);
+void record_drain(struct ring_capture *cap, const struct timespec *start,
+		int64_t oldest);
+
+/* iio_ring_serve.c */
+int serve_start(struct ring_capture *caps, unsigned num_caps, int epoll_fd,
+		const char *path);
+int serve_event(void *tag, uint32_t events);
+ssize_t serve_read(struct ring_capture *cap, size_t len);
+void serve_stop(void);
+
+/* iio_ring_uring.c */
+int uring_open(void);
+void uring_register(struct ring_capture *caps, unsigned num_caps);
+int uring_loop(struct ring_capture *caps, unsigned num_caps,
+		int sig_fd, int timer_fd);
+void uring_close(void);
+
+#endif /* __IIO_RING_H__ */
@@ -0,0 +1,425 @@
+/*
+ * Industrial I/O utilities - iio_ring_serve.c
+ *
+ * Copyright (c) 2010 Manuel Stahl <manuel.stahl@iis.fraunhofer.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "iio.h"
+#include "iio_ring.h"
+
+#define SERVE_CLOSE_MS 1000	/* to send what is left on exit */
+
+#define fail_return(msg...) { fprintf(stderr, msg); return -1; }
+
+/*
+ * Server of ring data over a Unix socket, see lib/iio_serve.c. It runs
+ * in the event loop of the main thread: every block read from a ring is
+ * decoded once and copied into the frames of the clients that asked for
+ * the device. Each client has its own backlog of at most queue_depth
+ * frames; a frame that does not fit is dropped for that client alone,
+ * which it learns from the next frame.
+ */
+struct serve_client {
+	int fd;				/* -1 if the entry is free */
+	struct ring_capture *cap;	/* NULL until the request arrived */
+	struct iio_scan_layout *layout;	/* of the requested elements */
+	unsigned *map;			/* slot of cap->layout for each slot */
+	unsigned block;			/* scans per frame */
+	unsigned fill;			/* scans in the next frame */
+	int32_t *samples;
+	int64_t *timestamps;
+	char *out;			/* frames not sent yet */
+	size_t out_start;
+	size_t out_len;
+	size_t out_size;
+	int polling_out;		/* waits for EPOLLOUT */
+	unsigned long dropped;		/* scans since the last frame */
+	unsigned long total_dropped;
+	char request[IIO_SERVE_REQUEST_MAX];
+	size_t request_len;
+};
+
+static struct {
+	const char *path;
+	int listen_fd;
+	int epoll_fd;
+	struct ring_capture *caps;
+	unsigned num_caps;
+	struct serve_client clients[MAX_CLIENTS];
+} server = { .listen_fd = -1 };
+
+static void serve_drop(struct serve_client *client)
+{
+	if (verblevel > VERBLEVEL_DEFAULT)
+		fprintf(stderr, "Client %d of %s gone, %lu scans dropped\n",
+				(int)(client - server.clients),
+				client->cap ? client->cap->dev->name : "no device",
+				client->total_dropped);
+	epoll_ctl(server.epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+	close(client->fd);
+	if (client->cap)
+		client->cap->num_clients--;
+	iio_scan_layout_free(client->layout);
+	free(client->map);
+	free(client->samples);
+	free(client->timestamps);
+	free(client->out);
+	memset(client, 0, sizeof(*client));
+	client->fd = -1;
+}
+
+/* Watch for EPOLLOUT only while the socket is full */
+static void serve_poll_out(struct serve_client *client, int on)
+{
+	struct epoll_event ev;
+
+	if (client->polling_out == on)
+		return;
+	ev.events = on ? EPOLLIN | EPOLLOUT : EPOLLIN;
+	ev.data.ptr = client;
+	epoll_ctl(server.epoll_fd, EPOLL_CTL_MOD, client->fd, &ev);
+	client->polling_out = on;
+}
+
+/* Send as much of the backlog as the socket takes, without waiting
+ * unless flags lack MSG_DONTWAIT. Returns -1 if the client was dropped.
+ */
+static int serve_flush(struct serve_client *client, int flags)
+{
+	while (client->out_len > 0) {
+		ssize_t len = send(client->fd, client->out + client->out_start,
+				client->out_len, flags | MSG_NOSIGNAL);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0 && errno == EAGAIN) {
+			serve_poll_out(client, 1);
+			return 0;
+		}
+		if (len < 0) {
+			serve_drop(client);
+			return -1;
+		}
+		client->out_start += len;
+		client->out_len -= len;
+	}
+	client->out_start = 0;
+	serve_poll_out(client, 0);
+	return 0;
+}
+
+/* Queue the scans gathered for the client as one frame, or drop them if
+ * its backlog is full */
+static int serve_frame(struct serve_client *client)
+{
+	const size_t len = sizeof(struct iio_serve_frame) +
+			client->fill * client->layout->scan_size;
+	struct iio_serve_frame frame;
+	char *p;
+
+	if (client->fill == 0)
+		return 0;
+	if (client->out_len + len > client->out_size) {
+		client->dropped += client->fill;
+		client->total_dropped += client->fill;
+		client->fill = 0;
+		return 0;
+	}
+	if (client->out_start + client->out_len + len > client->out_size) {
+		memmove(client->out, client->out + client->out_start, client->out_len);
+		client->out_start = 0;
+	}
+
+	p = client->out + client->out_start + client->out_len;
+	frame.nscans = client->fill;
+	frame.dropped = client->dropped;
+	memcpy(p, &frame, sizeof(frame));
+	iio_scan_encode(client->layout, client->samples, client->block,
+			client->timestamps, client->fill, p + sizeof(frame));
+	client->out_len += len;
+	client->fill = 0;
+	client->dropped = 0;
+	return serve_flush(client, MSG_DONTWAIT);
+}
+
+/* Read up to len bytes of scans from the ring and hand them to the
+ * clients of the device */
+ssize_t serve_read(struct ring_capture *cap, size_t len)
+{
+	ssize_t ret = read(cap->ring_fd, cap->data, len);
+	size_t nscans, s, n;
+	unsigned i, j;
+
+	if (ret <= 0 || cap->num_clients == 0)
+		return ret;
+
+	nscans = iio_scan_decode(cap->layout, cap->data, ret, cap->samples,
+			cap->block, cap->timestamps);
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		struct serve_client *client = &server.clients[i];
+
+		if (client->fd < 0 || client->cap != cap)
+			continue;
+		for (s = 0; s < nscans && client->fd >= 0; s += n) {
+			n = client->block - client->fill;
+			if (n > nscans - s)
+				n = nscans - s;
+			for (j = 0; j < client->layout->num_slots; j++)
+				memcpy(client->samples + j * client->block + client->fill,
+						cap->samples + client->map[j] * cap->block + s,
+						n * sizeof(int32_t));
+			memcpy(client->timestamps + client->fill, cap->timestamps + s,
+					n * sizeof(int64_t));
+			client->fill += n;
+			if (client->fill == client->block)
+				serve_frame(client);
+		}
+	}
+	return ret;
+}
+
+static void serve_refuse(struct serve_client *client, const char *reason)
+{
+	char line[IIO_SERVE_REQUEST_MAX];
+	int len = snprintf(line, sizeof(line), "ERR %s\n", reason);
+
+	if (send(client->fd, line, len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0 &&
+			verblevel > VERBLEVEL_DEFAULT)
+		perror("refusing client");
+	serve_drop(client);
+}
+
+/* Set up a client from its request line and queue the capture header */
+static void serve_request(struct serve_client *client)
+{
+	struct iio_serve_request req;
+	struct ring_capture *cap = NULL;
+	size_t header;
+	unsigned i;
+
+	client->request[client->request_len] = '\0';
+	if (iio_serve_parse_request(client->request, &req) < 0) {
+		serve_refuse(client, "invalid request");
+		return;
+	}
+	/* names nobody interned are NULL and match no device */
+	for (i = 0; req.device && i < server.num_caps; i++)
+		if (server.caps[i].dev->name == req.device)
+			cap = &server.caps[i];
+	if (!cap) {
+		serve_refuse(client, "no such device");
+		return;
+	}
+
+	client->map = malloc(cap->layout->num_slots * sizeof(unsigned));
+	if (!client->map) {
+		serve_refuse(client, "out of memory");
+		return;
+	}
+	client->layout = iio_scan_layout_select(cap->layout, req.elements,
+			req.num_elements, client->map);
+	if (!client->layout) {
+		serve_refuse(client, errno == EINVAL ? "no such scan element" :
+				"out of memory");
+		return;
+	}
+	client->block = req.block;
+	header = iio_capture_header_size(client->layout);
+	client->out_size = header + queue_depth * (sizeof(struct iio_serve_frame) +
+			req.block * client->layout->scan_size);
+	client->samples = malloc(client->layout->num_slots * req.block *
+			sizeof(int32_t));
+	client->timestamps = malloc(req.block * sizeof(int64_t));
+	client->out = malloc(client->out_size);
+	if (!client->samples || !client->timestamps || !client->out) {
+		serve_refuse(client, "out of memory");
+		return;
+	}
+
+	iio_capture_format_header(client->out, cap->dev->name, cap->trigger,
+			client->layout, IIO_CAPTURE_RAW);
+	client->out_len = header;
+	client->cap = cap;
+	cap->num_clients++;
+	if (verblevel > VERBLEVEL_DEFAULT)
+		fprintf(stderr, "Client %d: %u elements of %s, %u scans per frame\n",
+				(int)(client - server.clients), client->layout->num_slots,
+				cap->dev->name, client->block);
+	serve_flush(client, MSG_DONTWAIT);
+}
+
+/* Something happened on the socket of a client */
+static void serve_client_event(struct serve_client *client, uint32_t events)
+{
+	char buf[256];
+	ssize_t len;
+
+	if (events & (EPOLLERR | EPOLLHUP)) {
+		serve_drop(client);
+		return;
+	}
+	if ((events & EPOLLOUT) && serve_flush(client, MSG_DONTWAIT) < 0)
+		return;
+	if (!(events & EPOLLIN))
+		return;
+
+	if (client->cap) {
+		/* nothing is expected after the request but the end */
+		while ((len = recv(client->fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+			;
+		if (len == 0 || (errno != EAGAIN && errno != EINTR))
+			serve_drop(client);
+		return;
+	}
+
+	len = recv(client->fd, client->request + client->request_len,
+			sizeof(client->request) - 1 - client->request_len, MSG_DONTWAIT);
+	if (len < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (len <= 0) {
+		serve_drop(client);
+		return;
+	}
+	client->request_len += len;
+	if (memchr(client->request, '\n', client->request_len)) {
+		if (client->request[client->request_len - 1] != '\n') {
+			serve_refuse(client, "data after the request");
+			return;
+		}
+		client->request_len--;
+		serve_request(client);
+	} else if (client->request_len == sizeof(client->request) - 1) {
+		serve_refuse(client, "request too long");
+	}
+}
+
+static void serve_accept(void)
+{
+	struct epoll_event ev;
+	unsigned i;
+	int fd;
+
+	while ((fd = accept4(server.listen_fd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+		for (i = 0; i < MAX_CLIENTS && server.clients[i].fd >= 0; i++)
+			;
+		if (i == MAX_CLIENTS) {
+			if (verblevel > VERBLEVEL_DEFAULT)
+				fprintf(stderr, "Too many clients\n");
+			close(fd);
+			continue;
+		}
+		ev.events = EPOLLIN;
+		ev.data.ptr = &server.clients[i];
+		if (epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			close(fd);
+			continue;
+		}
+		server.clients[i].fd = fd;
+	}
+}
+
+/* Listen on path, accepting and serving in the event loop on epoll_fd */
+int serve_start(struct ring_capture *caps, unsigned num_caps, int epoll_fd,
+		const char *path)
+{
+	struct sockaddr_un addr;
+	struct epoll_event ev;
+	unsigned i;
+
+	server.path = path;
+	server.caps = caps;
+	server.num_caps = num_caps;
+	server.epoll_fd = epoll_fd;
+	for (i = 0; i < MAX_CLIENTS; i++)
+		server.clients[i].fd = -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(server.path) >= sizeof(addr.sun_path))
+		fail_return("%s: socket path too long\n", server.path);
+	strcpy(addr.sun_path, server.path);
+
+	/* a socket left behind by an earlier run is replaced */
+	unlink(server.path);
+	server.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK |
+			SOCK_CLOEXEC, 0);
+	if (server.listen_fd < 0 ||
+			bind(server.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+			listen(server.listen_fd, MAX_CLIENTS) < 0)
+		fail_return("%s: %s\n", server.path, strerror(errno));
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = &server;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server.listen_fd, &ev) < 0)
+		fail_return("Event loop failed: %s\n", strerror(errno));
+	return 0;
+}
+
+/* Take an event of the loop if tag is the listening socket or a client.
+ * Returns 1 if it was for the server and 0 if not
+ */
+int serve_event(void *tag, uint32_t events)
+{
+	struct serve_client *client = tag;
+
+	if (tag == &server) {
+		serve_accept();
+		return 1;
+	}
+	if (tag < (void *)server.clients ||
+			tag >= (void *)(server.clients + MAX_CLIENTS))
+		return 0;
+	if (client->fd >= 0)
+		serve_client_event(client, events);
+	return 1;
+}
+
+/* Send the last partial frames and whatever the clients can take in
+ * SERVE_CLOSE_MS, then close everything */
+void serve_stop(void)
+{
+	struct timeval tv = {
+		.tv_sec = SERVE_CLOSE_MS / 1000,
+		.tv_usec = SERVE_CLOSE_MS % 1000 * 1000,
+	};
+	unsigned i;
+
+	if (server.listen_fd < 0)
+		return;
+	for (i = 0; i < MAX_CLIENTS; i++) {
+		struct serve_client *client = &server.clients[i];
+
+		if (client->fd < 0)
+			continue;
+		if (client->cap) {
+			setsockopt(client->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+			serve_frame(client);
+			if (client->fd >= 0 && serve_flush(client, 0) < 0)
+				continue;
+		}
+		serve_drop(client);
+	}
+	close(server.listen_fd);
+	server.listen_fd = -1;
+	unlink(server.path);
+}
@@ -0,0 +1,342 @@
+/*
+ * Industrial I/O utilities - iio_ring_uring.c
+ *
+ * Copyright (c) 2010 Manuel Stahl <manuel.stahl@iis.fraunhofer.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/signalfd.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#include "iio.h"
+#include "iio_ring.h"
+
+#define URING_ENTRIES (4 * MAX_DEVICES + 2)	/* see uring_loop() */
+
+#define fail_return(msg...) { fprintf(stderr, msg); return -1; }
+
+/*
+ * --uring: the main thread keeps a read of every event line, of the
+ * signalfd and of the stats timer in flight on an io_uring, and submits
+ * the reads of a drain and, for binary captures, the writes of the
+ * output there as well. New requests and the wait for the next
+ * completions are one system call, whatever the number of devices.
+ * Data is read into the queue blocks, which are registered with the
+ * ring. A binary capture has no writer thread: its blocks are written
+ * in order, one write in flight per device, and a drain that finds the
+ * queue full goes on when a write completes.
+ */
+enum uring_kind {
+	URING_SIGNAL,
+	URING_TIMER,
+	URING_EVENTS,
+	URING_READ,
+	URING_WRITE,
+};
+
+#define URING_TAG(kind, i) ((uint64_t)(kind) << 32 | (i))
+
+static struct {
+	struct iio_uring *ring;		/* NULL with read() and epoll */
+	unsigned busy;			/* ring reads and writes in flight */
+	int stopping;			/* on a signal, let busy reach 0 */
+	struct signalfd_siginfo si;	/* targets of reads that may still be */
+	uint64_t expired;		/* in flight when the loop returns */
+} uring;
+
+/* Set up the io_uring, errno is ENOSYS where there is none.
+ * Returns 0 on success and -1 on failure
+ */
+int uring_open(void)
+{
+	uring.ring = iio_uring_new(URING_ENTRIES);
+	return uring.ring ? 0 : -1;
+}
+
+/* Closing the ring cancels the reads still in flight */
+void uring_close(void)
+{
+	iio_uring_free(uring.ring);
+	uring.ring = NULL;
+}
+
+/* Make fd block again: the io_uring waits for it instead of epoll */
+static void set_blocking(int fd)
+{
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+}
+
+/* Register the queue blocks of all captures, index i for caps[i]. The
+ * requests work without, only slower.
+ */
+void uring_register(struct ring_capture *caps, unsigned num_caps)
+{
+	struct iovec iov[MAX_DEVICES];
+	unsigned i;
+
+	for (i = 0; i < num_caps; i++) {
+		iov[i].iov_base = caps[i].queue->blocks;
+		iov[i].iov_len = caps[i].queue->depth * caps[i].queue->block_size;
+	}
+	if (iio_uring_register_buffers(uring.ring, iov, num_caps) < 0 &&
+			verblevel > VERBLEVEL_DEFAULT)
+		fprintf(stderr, "io_uring: buffers not registered: %s\n",
+				strerror(errno));
+}
+
+/* Submit the next read of a drain into a free queue block. Text output
+ * waits for the writer thread if there is none, a binary capture goes on
+ * when one of its writes completes.
+ */
+static void uring_read(struct ring_capture *cap, unsigned index)
+{
+	const size_t block = cap->block * cap->layout->scan_size;
+	char *buf;
+
+	if (cap->uring_reading || cap->uring_want == 0)
+		return;
+	buf = out_type == OUTPUT_BINARY ? iio_queue_reserve(cap->queue) :
+		queue_block(cap);
+	if (!buf)
+		return;
+	cap->uring_chunk = cap->uring_want < block ? cap->uring_want : block;
+	iio_uring_read(uring.ring, cap->ring_fd, buf, cap->uring_chunk, index,
+			URING_TAG(URING_READ, index));
+	cap->uring_reading = 1;
+	uring.busy++;
+}
+
+/* Submit the write of the oldest block of a binary capture, or of what
+ * is left of it */
+static void uring_write(struct ring_capture *cap, unsigned index)
+{
+	if (cap->uring_writing)
+		return;
+	if (!cap->uring_out)
+		cap->uring_out = iio_queue_peek(cap->queue, &cap->uring_out_len);
+	if (!cap->uring_out)
+		return;
+	iio_uring_write(uring.ring, cap->out_fd, cap->uring_out,
+			cap->uring_out_len, index, URING_TAG(URING_WRITE, index));
+	cap->uring_writing = 1;
+	uring.busy++;
+}
+
+/* Read toread scans, then keep going like drain_ring(). A drain that is
+ * already running is extended instead.
+ */
+static void uring_drain(struct ring_capture *cap, unsigned index,
+		unsigned toread)
+{
+	if (uring.stopping)
+		return;
+	if (cap->uring_want) {
+		if (cap->uring_again < toread)
+			cap->uring_again = toread;
+		return;
+	}
+	cap->uring_want = toread * cap->layout->scan_size;
+	uring_read(cap, index);
+}
+
+static int uring_events_done(struct ring_capture *cap, unsigned index, int res,
+		unsigned *open_lines)
+{
+	unsigned toread = 0;
+	int64_t oldest = 0;
+
+	if (res < 0 && res != -EINTR && res != -EAGAIN)
+		fail_return("Failed to read %s: %s\n", cap->dev->buffer->event,
+				strerror(-res));
+	if (res == 0) {
+		/* nobody left to signal new data, fetch the rest */
+		cap->closed = 1;
+		(*open_lines)--;
+		uring_drain(cap, index, cap->length);
+		return 0;
+	}
+
+	if (res > 0)
+		count_events(cap, cap->uring_events,
+				res / sizeof(struct iio_event_data), &toread, &oldest);
+	if (toread && !cap->uring_want) {
+		clock_gettime(CLOCK_MONOTONIC, &cap->uring_start);
+		cap->uring_oldest = oldest;
+		cap->uring_timed = 1;
+	}
+	if (toread)
+		uring_drain(cap, index, toread);
+	if (!uring.stopping)
+		iio_uring_read(uring.ring, cap->event_fd, cap->uring_events,
+				sizeof(cap->uring_events), -1,
+				URING_TAG(URING_EVENTS, index));
+	return 0;
+}
+
+static int uring_read_done(struct ring_capture *cap, unsigned index, int res)
+{
+	const size_t block = cap->block * cap->layout->scan_size;
+
+	cap->uring_reading = 0;
+	uring.busy--;
+	if (res == -EINTR) {
+		uring_read(cap, index);
+		return 0;
+	}
+	if (res < 0 && res != -EAGAIN)
+		fail_return("Failed to move data from %s: %s\n",
+				cap->dev->buffer->access, strerror(-res));
+
+	if (res == -EAGAIN)
+		cap->stats.eagain++;
+	if (res > 0) {
+		cap->stats.reads++;
+		cap->stats.bytes += res;
+		cap->stats.scans += res / cap->layout->scan_size;
+		if (out_type == OUTPUT_BINARY) {
+			iio_queue_commit(cap->queue, res);
+			uring_write(cap, index);
+		} else {
+			queue_commit(cap, res);
+		}
+		if ((size_t)res == cap->uring_chunk && !uring.stopping) {
+			cap->uring_want -= res;
+			if (cap->uring_want == 0)
+				cap->uring_want = block;
+			uring_read(cap, index);
+			return 0;
+		}
+		if ((size_t)res < cap->uring_chunk)
+			cap->stats.short_reads++;
+	}
+
+	/* the ring is empty */
+	cap->uring_want = 0;
+	if (cap->uring_timed)
+		record_drain(cap, &cap->uring_start, cap->uring_oldest);
+	cap->uring_timed = 0;
+	if (cap->uring_again) {
+		uring_drain(cap, index, cap->uring_again);
+		cap->uring_again = 0;
+	} else if (cap->closed) {
+		queue_end(cap);
+	}
+	return 0;
+}
+
+static int uring_write_done(struct ring_capture *cap, unsigned index, int res)
+{
+	cap->uring_writing = 0;
+	uring.busy--;
+	if (res == -EINTR || res == -EAGAIN)
+		res = 0;
+	else if (res <= 0)
+		fail_return("Failed to write output: %s\n",
+				strerror(res ? -res : EIO));
+
+	cap->uring_out += res;
+	cap->uring_out_len -= res;
+	if (cap->uring_out_len == 0) {
+		iio_queue_release(cap->queue);
+		cap->uring_out = NULL;
+		/* a drain may wait for the block */
+		uring_read(cap, index);
+	}
+	uring_write(cap, index);
+	return 0;
+}
+
+/* The event loop of --uring, see the comment above uring. Returns
+ * when a signal stopped it or all event lines are closed, and every
+ * read of ring data and every write has completed.
+ */
+int uring_loop(struct ring_capture *caps, unsigned num_caps,
+		int sig_fd, int timer_fd)
+{
+	unsigned i, open_lines = num_caps;
+	uint64_t tag;
+	int res;
+
+	set_blocking(sig_fd);
+	iio_uring_read(uring.ring, sig_fd, &uring.si, sizeof(uring.si), -1,
+			URING_TAG(URING_SIGNAL, 0));
+	if (timer_fd >= 0) {
+		set_blocking(timer_fd);
+		iio_uring_read(uring.ring, timer_fd, &uring.expired,
+				sizeof(uring.expired), -1, URING_TAG(URING_TIMER, 0));
+	}
+	for (i = 0; i < num_caps; i++) {
+		set_blocking(caps[i].event_fd);
+		iio_uring_read(uring.ring, caps[i].event_fd, caps[i].uring_events,
+				sizeof(caps[i].uring_events), -1,
+				URING_TAG(URING_EVENTS, i));
+	}
+
+	while ((open_lines > 0 && !uring.stopping) || uring.busy > 0) {
+		if (iio_uring_submit(uring.ring, 1) < 0)
+			fail_return("Event loop failed: %s\n", strerror(errno));
+
+		while (iio_uring_complete(uring.ring, &tag, &res)) {
+			struct ring_capture *cap = &caps[(uint32_t)tag];
+			const unsigned index = (uint32_t)tag;
+			int ret = 0;
+
+			switch (tag >> 32) {
+			case URING_SIGNAL:
+				if (res < 0 && res != -EINTR && res != -EAGAIN)
+					fail_return("Failed to read signals: %s\n",
+							strerror(-res));
+				if (res == sizeof(uring.si) &&
+						uring.si.ssi_signo != SIGUSR1) {
+					uring.stopping = 1;
+					break;
+				}
+				for (i = 0; res > 0 && i < num_caps; i++)
+					print_stats(stderr, &caps[i]);
+				iio_uring_read(uring.ring, sig_fd, &uring.si,
+						sizeof(uring.si), -1,
+						URING_TAG(URING_SIGNAL, 0));
+				break;
+			case URING_TIMER:
+				if (res < 0 && res != -EINTR && res != -EAGAIN)
+					fail_return("Failed to read the stats timer: %s\n",
+							strerror(-res));
+				for (i = 0; res > 0 && i < num_caps; i++)
+					print_stats_line(stderr, &caps[i]);
+				iio_uring_read(uring.ring, timer_fd, &uring.expired,
+						sizeof(uring.expired), -1,
+						URING_TAG(URING_TIMER, 0));
+				break;
+			case URING_EVENTS:
+				ret = uring_events_done(cap, index, res, &open_lines);
+				break;
+			case URING_READ:
+				ret = uring_read_done(cap, index, res);
+				break;
+			case URING_WRITE:
+				ret = uring_write_done(cap, index, res);
+				break;
+			}
+			if (ret < 0)
+				return -1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,671 @@
+/*
+ * Industrial I/O utilities - iio_sim.c
+ *
+ * Copyright (c) 2010 Manuel Stahl <manuel.stahl@iis.fraunhofer.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <getopt.h>
+
+/*
+ * Simulated industrial I/O devices. A sysfs tree with devices, channels,
+ * ring buffers and scan elements is built below a root directory, the
+ * ring access and event devices are FIFOs in <root>/dev/iio. Once a
+ * reader opened them, every device produces scans at the given rate and
+ * sends the ring events a driver would send. Point the tools at the
+ * tree with their --root option.
+ */
+#define MAX_DEVICES 8
+#define DEFAULT_CHANNELS 3
+#define DEFAULT_RATE 1000
+#define DEFAULT_RING_LENGTH 64
+#define TICK_NS 1000000			/* scans are produced once per tick */
+
+#define IIO_EVENT_CODE_RING_50_FULL 200
+#define IIO_EVENT_CODE_RING_75_FULL 201
+#define IIO_EVENT_CODE_RING_100_FULL 202
+
+#define fail_return(msg...) { fprintf(stderr, msg); return -1; }
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define HOST_ENDIAN "be"
+#else
+#define HOST_ENDIAN "le"
+#endif
+
+static const struct sim_channel {
+	const char *name;
+	const char *type;	/* prefix of the shared scale and offset */
+	const char *scale;
+	const char *offset;
+} channel_table[] = {
+	{ "accel_x", "accel", "0.00333", NULL },
+	{ "accel_y", "accel", "0.00333", NULL },
+	{ "accel_z", "accel", "0.00333", NULL },
+	{ "gyro_x", "gyro", "0.05", NULL },
+	{ "gyro_y", "gyro", "0.05", NULL },
+	{ "gyro_z", "gyro", "0.05", NULL },
+	{ "magn_x", "magn", "0.0005", NULL },
+	{ "magn_y", "magn", "0.0005", NULL },
+	{ "magn_z", "magn", "0.0005", NULL },
+	{ "temp", "temp", "0.14", "-850" },
+};
+#define MAX_CHANNELS (sizeof(channel_table) / sizeof(channel_table[0]))
+
+struct iio_event_data {
+	int id;
+	int64_t timestamp;
+};
+
+struct sim_device {
+	unsigned number;
+	char sysfs[PATH_MAX];
+	char access[PATH_MAX];
+	char event[PATH_MAX];
+	unsigned length;		/* ring length in scans */
+	unsigned size;			/* bytes per scan */
+	unsigned char enabled[MAX_CHANNELS];	/* scan elements the reader */
+	int timestamp;				/* enabled, see read_elements() */
+	pthread_t thread;
+
+	uint64_t scans;			/* scans due, written or dropped */
+	uint64_t dropped;		/* scans that did not fit into the ring */
+	unsigned long events[3];	/* 50%, 75% and 100% events sent */
+	unsigned long events_lost;
+	double seconds;
+	int failed;
+};
+
+static const char *root;
+static unsigned num_devices = 1;
+static unsigned num_channels = DEFAULT_CHANNELS;
+static unsigned long rate = DEFAULT_RATE;
+static uint64_t count;			/* scans per device, 0 runs until killed */
+static unsigned ring_length = DEFAULT_RING_LENGTH;
+static int verbose;
+static int tree_only;
+static volatile sig_atomic_t stop;
+
+static int write_file(const char *dir, const char *name, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+static int write_file(const char *dir, const char *name, const char *fmt, ...)
+{
+	char path[PATH_MAX];
+	va_list ap;
+	FILE *f;
+
+	snprintf(path, PATH_MAX, "%s/%s", dir, name);
+	f = fopen(path, "w");
+	if (!f)
+		fail_return("%s: %s\n", path, strerror(errno));
+	va_start(ap, fmt);
+	vfprintf(f, fmt, ap);
+	va_end(ap);
+	if (fclose(f))
+		fail_return("%s: %s\n", path, strerror(errno));
+	return 0;
+}
+
+/* mkdir -p */
+static int make_dirs(const char *path)
+{
+	char tmp[PATH_MAX];
+	char *p;
+
+	snprintf(tmp, PATH_MAX, "%s", path);
+	for (p = tmp + 1; *p; p++) {
+		if (*p != '/')
+			continue;
+		*p = '\0';
+		if (mkdir(tmp, 0755) < 0 && errno != EEXIST)
+			fail_return("%s: %s\n", tmp, strerror(errno));
+		*p = '/';
+	}
+	if (mkdir(tmp, 0755) < 0 && errno != EEXIST)
+		fail_return("%s: %s\n", tmp, strerror(errno));
+	return 0;
+}
+
+static int make_fifo(const char *path)
+{
+	unlink(path);
+	if (mkfifo(path, 0600) < 0)
+		fail_return("%s: %s\n", path, strerror(errno));
+	return 0;
+}
+
+static int build_device(struct sim_device *dev)
+{
+	char buffer[PATH_MAX], scan[PATH_MAX], trigger[PATH_MAX], name[64];
+	unsigned i;
+	int ret = 0;
+
+	snprintf(dev->sysfs, PATH_MAX, "%s/sys/bus/iio/devices/device%u",
+			root, dev->number);
+	snprintf(buffer, PATH_MAX, "%s/device%u:buffer%u", dev->sysfs,
+			dev->number, dev->number);
+	snprintf(scan, PATH_MAX, "%s/scan_elements", dev->sysfs);
+	snprintf(trigger, PATH_MAX, "%s/trigger", dev->sysfs);
+	if (make_dirs(buffer) < 0 || make_dirs(scan) < 0 || make_dirs(trigger) < 0)
+		return -1;
+
+	ret |= write_file(dev->sysfs, "name", "sim%u\n", dev->number);
+	ret |= write_file(dev->sysfs, "sampling_frequency", "%lu\n", rate);
+	ret |= write_file(trigger, "current_trigger", "simtrig%u\n", dev->number);
+	ret |= write_file(buffer, "length", "%u\n", ring_length);
+	ret |= write_file(buffer, "ring_enable", "0\n");
+	ret |= write_file(buffer, "bps", "2\n");
+
+	for (i = 0; i < num_channels; i++) {
+		const struct sim_channel *chan = &channel_table[i];
+
+		snprintf(name, sizeof(name), "%s_raw", chan->name);
+		ret |= write_file(dev->sysfs, name, "%u\n", 100 * (i + 1));
+		snprintf(name, sizeof(name), "%s_scale", chan->type);
+		ret |= write_file(dev->sysfs, name, "%s\n", chan->scale);
+		if (chan->offset) {
+			snprintf(name, sizeof(name), "%s_offset", chan->type);
+			ret |= write_file(dev->sysfs, name, "%s\n", chan->offset);
+		}
+
+		snprintf(name, sizeof(name), "%02u_%s_en", i, chan->name);
+		ret |= write_file(scan, name, "1\n");
+		snprintf(name, sizeof(name), "%02u_%s_bits", i, chan->name);
+		ret |= write_file(scan, name, "14\n");
+		snprintf(name, sizeof(name), "%02u_%s_type", i, chan->name);
+		ret |= write_file(scan, name, HOST_ENDIAN ":s14/16>>0\n");
+	}
+	snprintf(name, sizeof(name), "%02u_timestamp_en", i);
+	ret |= write_file(scan, name, "1\n");
+	snprintf(name, sizeof(name), "%02u_timestamp_bits", i);
+	ret |= write_file(scan, name, "64\n");
+	snprintf(name, sizeof(name), "%02u_timestamp_type", i);
+	ret |= write_file(scan, name, HOST_ENDIAN ":s64/64>>0\n");
+	if (ret)
+		return -1;
+
+	/* the device nodes come last, scripts may wait for them */
+	snprintf(buffer, PATH_MAX, "%s/dev/iio", root);
+	if (make_dirs(buffer) < 0)
+		return -1;
+	snprintf(dev->access, PATH_MAX, "%s/dev/iio/ring_access%u", root,
+			dev->number);
+	snprintf(dev->event, PATH_MAX, "%s/dev/iio/ring_event_line%u", root,
+			dev->number);
+	if (make_fifo(dev->access) < 0 || make_fifo(dev->event) < 0)
+		return -1;
+	return 0;
+}
+
+/* The reader writes the ring length before it opens the ring.
+ * Returns 0 if the path does not fit
+ */
+static unsigned read_length(const struct sim_device *dev)
+{
+	char path[PATH_MAX];
+	unsigned length = 0;
+	FILE *f;
+
+	if (snprintf(path, PATH_MAX, "%s/device%u:buffer%u/length", dev->sysfs,
+			dev->number, dev->number) >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return 0;
+	}
+	f = fopen(path, "r");
+	if (f) {
+		if (fscanf(f, "%u", &length) != 1)
+			length = 0;
+		fclose(f);
+	}
+	return length ? length : ring_length;
+}
+
+/* Read the number the reader wrote to dir/name.
+ * Returns 0 on success and -1 on failure
+ */
+static int read_file(const char *dir, const char *name, unsigned *val)
+{
+	char path[PATH_MAX];
+	FILE *f;
+	int ret;
+
+	if (snprintf(path, PATH_MAX, "%s/%s", dir, name) >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	ret = fscanf(f, "%u", val) == 1 ? 0 : -1;
+	fclose(f);
+	if (ret < 0)
+		errno = EINVAL;
+	return ret;
+}
+
+/* The reader enables scan elements before it opens the ring, the scans
+ * hold only those: the enabled channels in index order, 14 bit signed
+ * in 16 bit, then the 64 bit timestamp aligned to 8 bytes, as
+ * lib/iio_scan.c places them. Returns the scan size, 0 on failure
+ */
+static unsigned read_elements(struct sim_device *dev)
+{
+	char scan[PATH_MAX], name[64];
+	unsigned i, on, size = 0;
+
+	if (snprintf(scan, PATH_MAX, "%s/scan_elements", dev->sysfs) >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return 0;
+	}
+	for (i = 0; i < num_channels; i++) {
+		snprintf(name, sizeof(name), "%02u_%s_en", i, channel_table[i].name);
+		if (read_file(scan, name, &on) < 0)
+			return 0;
+		dev->enabled[i] = on != 0;
+		if (on)
+			size += 2;
+	}
+	snprintf(name, sizeof(name), "%02u_timestamp_en", i);
+	if (read_file(scan, name, &on) < 0)
+		return 0;
+	dev->timestamp = on != 0;
+	if (on)
+		size = (size + 7) / 8 * 8 + 8;
+	if (!size)
+		errno = EINVAL;
+	return size;
+}
+
+static int64_t timespec_ns(const struct timespec *ts)
+{
+	return (int64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+static void fill_scans(const struct sim_device *dev, char *buf,
+		uint64_t first, unsigned n, int64_t start_ns)
+{
+	unsigned i, c, offset;
+
+	for (i = 0; i < n; i++) {
+		uint64_t k = first + i;
+		char *scan = buf + i * dev->size;
+		int64_t ts = start_ns + (rate ? (int64_t)(k / rate * 1000000000 +
+					k % rate * 1000000000 / rate) : (int64_t)k);
+
+		/* a triangle wave per channel, each with its own period */
+		for (c = 0, offset = 0; c < num_channels; c++) {
+			int v = (k * (c + 1) * 7) & 0x3fff;
+			int16_t s = (v < 0x2000 ? v : 0x3fff - v) - 0x1000;
+
+			if (!dev->enabled[c])
+				continue;
+			memcpy(scan + offset, &s, 2);
+			offset += 2;
+		}
+		if (dev->timestamp)
+			memcpy(scan + dev->size - 8, &ts, 8);
+	}
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t ret = write(fd, buf, len);
+		if (ret < 0) {
+			if (errno == EINTR && !stop)
+				continue;
+			return -1;
+		}
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/* 0 below half full, 1 from half, 2 from three quarters, 3 full */
+static unsigned fill_level(const struct sim_device *dev, unsigned fill)
+{
+	if (fill >= dev->length)
+		return 3;
+	if (fill >= dev->length * 3 / 4)
+		return 2;
+	return fill >= dev->length / 2 ? 1 : 0;
+}
+
+/* Send the event a driver sends when the fill level passes a mark */
+static void send_event(struct sim_device *dev, int event_fd, unsigned before,
+		unsigned after)
+{
+	struct iio_event_data ev;
+	struct timespec now;
+	unsigned level = fill_level(dev, after);
+
+	if (level <= fill_level(dev, before))
+		return;
+
+	/* drivers stamp events with the real time clock */
+	clock_gettime(CLOCK_REALTIME, &now);
+	ev.id = IIO_EVENT_CODE_RING_50_FULL + level - 1;
+	ev.timestamp = timespec_ns(&now);
+	if (write(event_fd, &ev, sizeof(ev)) == sizeof(ev))
+		dev->events[level - 1]++;
+	else
+		dev->events_lost++;
+}
+
+/*
+ * With a rate, scans that do not fit into the ring when they are due
+ * are dropped, as a device overwrites scans nobody read in time. Without
+ * a rate the device waits for the reader, which gives the throughput of
+ * the reader alone. Scans are written up to the next mark at a time, so
+ * the reader gets an event for every mark the ring passes.
+ */
+static void *produce(void *arg)
+{
+	struct sim_device *dev = arg;
+	struct timespec start, next, now;
+	unsigned capacity, size;
+	int event_fd, ring_fd, queued;
+	int64_t start_ns;
+	char *buf;
+
+	/* both block until the reader opened its end */
+	event_fd = open(dev->event, O_WRONLY | O_CLOEXEC);
+	ring_fd = event_fd < 0 ? -1 : open(dev->access, O_WRONLY | O_CLOEXEC);
+	if (ring_fd < 0) {
+		if (!stop) {
+			fprintf(stderr, "sim%u: %s\n", dev->number, strerror(errno));
+			dev->failed = 1;
+		}
+		goto out;
+	}
+	fcntl(event_fd, F_SETFL, O_NONBLOCK);
+
+	dev->length = read_length(dev);
+	if (!dev->length) {
+		fprintf(stderr, "sim%u: %s\n", dev->number, strerror(errno));
+		dev->failed = 1;
+		goto out;
+	}
+	size = dev->size = read_elements(dev);
+	if (!size) {
+		fprintf(stderr, "sim%u: scan elements: %s\n", dev->number,
+				strerror(errno));
+		dev->failed = 1;
+		goto out;
+	}
+	capacity = fcntl(ring_fd, F_SETPIPE_SZ, dev->length * size);
+	if ((int)capacity < 0)
+		capacity = fcntl(ring_fd, F_GETPIPE_SZ);
+	capacity /= size;
+	if (capacity > dev->length)
+		capacity = dev->length;
+	/* a ring longer than the pipe fills up at the pipe size */
+	dev->length = capacity;
+	/* padding between the elements stays zero */
+	buf = calloc(capacity, size);
+	if (!buf) {
+		fprintf(stderr, "sim%u: out of memory\n", dev->number);
+		dev->failed = 1;
+		goto out;
+	}
+	if (verbose)
+		fprintf(stderr, "sim%u: ring of %u scans, %u bytes each\n",
+				dev->number, dev->length, size);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	start_ns = timespec_ns(&start);
+	next = start;
+	while (!stop && (!count || dev->scans < count)) {
+		uint64_t due, elapsed;
+		unsigned n, fit, before, mark;
+
+		if (rate) {
+			next.tv_nsec += TICK_NS;
+			if (next.tv_nsec >= 1000000000) {
+				next.tv_nsec -= 1000000000;
+				next.tv_sec++;
+			}
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+					&next, NULL) == EINTR && !stop)
+				;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			elapsed = timespec_ns(&now) - start_ns;
+			due = elapsed / 1000000000 * rate +
+				elapsed % 1000000000 * rate / 1000000000;
+			if (count && due > count)
+				due = count;
+		} else {
+			due = dev->scans + capacity / 2 + 1;
+			if (count && due > count)
+				due = count;
+		}
+
+		while (dev->scans < due && !stop) {
+			n = due - dev->scans < capacity ? due - dev->scans : capacity;
+			if (ioctl(ring_fd, FIONREAD, &queued) < 0)
+				queued = 0;
+			before = queued / size;
+
+			/* stop at each mark, so it gets its event */
+			if (before < dev->length / 2)
+				mark = dev->length / 2;
+			else if (before < dev->length * 3 / 4)
+				mark = dev->length * 3 / 4;
+			else
+				mark = capacity;
+			fit = before < mark ? mark - before : 0;
+			if (fit > n)
+				fit = n;
+			if (!fit) {
+				if (rate) {
+					dev->dropped += n;
+					dev->scans += n;
+				} else {
+					struct pollfd pfd = { ring_fd, POLLOUT, 0 };
+					poll(&pfd, 1, 100);
+				}
+				continue;
+			}
+
+			fill_scans(dev, buf, dev->scans, fit, start_ns);
+			if (write_all(ring_fd, buf, fit * size) < 0) {
+				/* EPIPE: the reader is done */
+				if (!stop && errno != EPIPE) {
+					fprintf(stderr, "sim%u: %s\n", dev->number,
+							strerror(errno));
+					dev->failed = 1;
+				}
+				goto out_free;
+			}
+			dev->scans += fit;
+			send_event(dev, event_fd, before, before + fit);
+		}
+	}
+
+out_free:
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	dev->seconds = (timespec_ns(&now) - start_ns) / 1e9;
+	free(buf);
+out:
+	if (ring_fd >= 0)
+		close(ring_fd);
+	if (event_fd >= 0)
+		close(event_fd);
+	return NULL;
+}
+
+static void handle_signal(int sig)
+{
+	if (stop)
+		_exit(128 + sig);
+	stop = 1;
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option long_options[] = {
+		{ "version", 0, 0, 'V' },
+		{ "verbose", 0, 0, 'v' },
+		{ "devices", 1, 0, 'd' },
+		{ "channels", 1, 0, 'c' },
+		{ "rate", 1, 0, 'r' },
+		{ "scans", 1, 0, 'n' },
+		{ "length", 1, 0, 'l' },
+		{ "tree-only", 0, 0, 't' },
+		{ 0, 0, 0, 0 }
+	};
+
+	struct sim_device devs[MAX_DEVICES];
+	struct sigaction sa;
+	int c, err = 0, ret = 0;
+	unsigned i;
+
+	while ((c = getopt_long(argc, argv, "c:d:l:n:r:tvV",
+			long_options, NULL)) != EOF) {
+		switch(c) {
+		case 'V':
+			printf("iio_sim (" PACKAGE ") " VERSION "\n");
+			exit(0);
+
+		case 'v':
+			verbose++;
+			break;
+
+		case 'd':
+			num_devices = atoi(optarg);
+			if (num_devices < 1 || num_devices > MAX_DEVICES) {
+				fprintf(stderr, "1 to %d devices\n", MAX_DEVICES);
+				err++;
+			}
+			break;
+
+		case 'c':
+			num_channels = atoi(optarg);
+			if (num_channels < 1 || num_channels > MAX_CHANNELS) {
+				fprintf(stderr, "1 to %u channels\n",
+						(unsigned)MAX_CHANNELS);
+				err++;
+			}
+			break;
+
+		case 'r':
+			rate = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'n':
+			count = strtoull(optarg, NULL, 0);
+			break;
+
+		case 'l':
+			ring_length = atoi(optarg);
+			if (ring_length < 2) {
+				fprintf(stderr, "Invalid ring length %s\n", optarg);
+				err++;
+			}
+			break;
+
+		case 't':
+			tree_only = 1;
+			break;
+
+		case '?':
+		default:
+			err++;
+			break;
+		}
+	}
+	if (err || argc != optind + 1) {
+		fprintf(stderr, "Usage: iio_sim [options] <root>\n"
+			"Simulate industrial I/O devices with ring buffers below <root>\n"
+			"  -v, --verbose\n"
+			"      Increase verbosity\n"
+			"  -d, --devices <n>\n"
+			"      Number of devices sim0, sim1, ..., default 1\n"
+			"  -c, --channels <n>\n"
+			"      Channels per device, default %d\n"
+			"  -r, --rate <scans>\n"
+			"      Scans per second and device, default %d; 0 waits\n"
+			"      for the reader instead of dropping scans\n"
+			"  -n, --scans <n>\n"
+			"      Stop after <n> scans per device, default never\n"
+			"  -l, --length <scans>\n"
+			"      Initial ring length, default %d\n"
+			"  -t, --tree-only\n"
+			"      Build the tree and exit without producing scans\n"
+			"  -V, --version\n"
+			"      Show version of program\n"
+			"Exits with 2 if scans were dropped.\n"
+			, DEFAULT_CHANNELS, DEFAULT_RATE, DEFAULT_RING_LENGTH);
+		exit(1);
+	}
+	root = argv[optind];
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handle_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	/* a reader that goes away shows up as EPIPE */
+	signal(SIGPIPE, SIG_IGN);
+
+	memset(devs, 0, sizeof(devs));
+	for (i = 0; i < num_devices; i++) {
+		devs[i].number = i;
+		if (build_device(&devs[i]) < 0)
+			return 1;
+	}
+	if (verbose)
+		fprintf(stderr, "%u devices below %s\n", num_devices, root);
+	if (tree_only)
+		return 0;
+
+	for (i = 0; i < num_devices; i++)
+		if (pthread_create(&devs[i].thread, NULL, produce, &devs[i])) {
+			fprintf(stderr, "Could not start device %u\n", i);
+			return 1;
+		}
+	for (i = 0; i < num_devices; i++) {
+		struct sim_device *dev = &devs[i];
+
+		pthread_join(dev->thread, NULL);
+		fprintf(stderr, "sim%u: %llu scans, %llu dropped, events "
+				"50%%: %lu 75%%: %lu 100%%: %lu lost: %lu, "
+				"%.0f scans/s\n", dev->number,
+				(unsigned long long)dev->scans,
+				(unsigned long long)dev->dropped,
+				dev->events[0], dev->events[1], dev->events[2],
+				dev->events_lost,
+				dev->seconds > 0 ? dev->scans / dev->seconds : 0.0);
+		if (dev->failed)
+			ret = 1;
+		else if (dev->dropped && !ret)
+			ret = 2;
+	}
+	return ret;
+}
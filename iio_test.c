@@ -0,0 +1,698 @@
+/*
+ * Industrial I/O utilities - iio_test.c
+ *
+ * Copyright (c) 2010 Manuel Stahl <manuel.stahl@iis.fraunhofer.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published by
+ * the Free Software Foundation.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+#include <float.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "iio.h"
+
+/*
+ * Checks of the library parts, run by "make check": the conversion
+ * kernels, the number formatting of the text output, the decimation
+ * filters, the packed capture codec and the request line of the ring
+ * data server need no device. The device setup is checked on a tree
+ * from "iio_sim -t" if one is given. Every failed check is reported on
+ * stderr; the exit status is 1 if any failed.
+ */
+#define MAX_TEST_SLOTS 4
+#define CONVERT_STRIDE 1000
+#define FORMAT_VALUES 4096
+#define FORMAT_RUNS 64
+#define FILTER_SCANS 1000
+#define FILTER_BLOCK 37
+
+static unsigned failures;
+
+#define check(cond, msg...) do { \
+		if (!(cond)) { \
+			fprintf(stderr, "FAIL %s:%d: ", __func__, __LINE__); \
+			fprintf(stderr, msg); \
+			fprintf(stderr, "\n"); \
+			failures++; \
+		} \
+	} while (0)
+
+/* xorshift64, the same sequence on every run */
+static uint64_t rand_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t next_rand(void)
+{
+	rand_state ^= rand_state << 13;
+	rand_state ^= rand_state >> 7;
+	rand_state ^= rand_state << 17;
+	return rand_state;
+}
+
+static struct iio_scan_element test_elements[MAX_TEST_SLOTS] = {
+	{ .name = "test0" }, { .name = "test1" },
+	{ .name = "test2" }, { .name = "test3" },
+};
+
+/* A layout with one slot per entry of bits, negative for signed ones */
+static struct iio_scan_layout *make_layout(const int *bits, unsigned n,
+		int has_timestamp)
+{
+	struct iio_scan_layout *layout;
+	unsigned i;
+
+	layout = calloc(1, sizeof(struct iio_scan_layout) +
+			n * sizeof(struct iio_scan_slot));
+	if (!layout) {
+		perror("iio_test");
+		exit(1);
+	}
+	for (i = 0; i < n; i++) {
+		struct iio_scan_slot *slot = &layout->slots[i];
+		slot->bits = bits[i] < 0 ? -bits[i] : bits[i];
+		slot->is_signed = bits[i] < 0;
+		slot->bytes = slot->bits <= 8 ? 1 : slot->bits <= 16 ? 2 : 4;
+		slot->offset = layout->scan_size;
+		slot->mask = slot->bits == 32 ? 0xffffffff : (1u << slot->bits) - 1;
+		slot->scale = 1.0f;
+		slot->elem = &test_elements[i];
+		layout->scan_size += 4;
+	}
+	layout->num_slots = n;
+	layout->ts_offset = has_timestamp ? (int)layout->scan_size : -1;
+	layout->scan_size += 8;
+	return layout;
+}
+
+/* A sample as iio_scan_decode() stores it: sign extended or zero filled */
+static int32_t make_sample(const struct iio_scan_slot *slot, uint32_t v)
+{
+	const unsigned sh = 32 - slot->bits;
+
+	v &= slot->mask;
+	if (slot->is_signed)
+		return (int32_t)(v << sh) >> sh;
+	return v;
+}
+
+/* What iio_scan_convert() makes of a sample, written out */
+static float expect_value(const struct iio_scan_slot *slot, int32_t raw)
+{
+	const unsigned sh = slot->is_signed ? 32 - slot->bits : 0;
+
+	if (!slot->is_signed && slot->bits == 32)
+		return ((float)(uint32_t)raw + slot->value_offset) * slot->scale;
+	return ((float)((int32_t)((uint32_t)raw << sh) >> sh) +
+			slot->value_offset) * slot->scale;
+}
+
+/* Every conversion kernel the CPU runs against the formula, over
+ * lengths that end in each tail of the vector loops
+ */
+static void test_convert(void)
+{
+	static const char *const kernels[] = { "scalar", "sse2", "avx2" };
+	static const int bits[MAX_TEST_SLOTS] = { -12, 24, -32, 32 };
+	static const float scales[MAX_TEST_SLOTS] = { 0.00333f, 0.05f, 1.0f, 1e-6f };
+	static const float offsets[MAX_TEST_SLOTS] = { 0.0f, -850.0f, 0.5f, 0.0f };
+	static int32_t samples[MAX_TEST_SLOTS * CONVERT_STRIDE];
+	static float values[MAX_TEST_SLOTS * CONVERT_STRIDE];
+	struct iio_scan_layout *layout = make_layout(bits, MAX_TEST_SLOTS, 0);
+	const char *const in_use = iio_scan_convert_name();
+	const float unset = -1.0f / 3;
+	unsigned k, i;
+	size_t n, s;
+
+	for (i = 0; i < layout->num_slots; i++) {
+		struct iio_scan_slot *slot = &layout->slots[i];
+		slot->scale = scales[i];
+		slot->value_offset = offsets[i];
+		/* signed samples both extended and as read from the device */
+		for (s = 0; s < CONVERT_STRIDE; s++)
+			samples[i * CONVERT_STRIDE + s] = slot->is_signed && (s & 1) ?
+				(int32_t)next_rand() : make_sample(slot, next_rand());
+	}
+
+	for (k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+		if (iio_scan_convert_use(kernels[k]) < 0)
+			continue;
+		for (n = 0; n <= CONVERT_STRIDE; n += n < 40 ? 1 : 97) {
+			for (s = 0; s < MAX_TEST_SLOTS * CONVERT_STRIDE; s++)
+				values[s] = unset;
+			iio_scan_convert(layout, samples, values, CONVERT_STRIDE, n);
+			for (i = 0; i < layout->num_slots; i++)
+			for (s = 0; s < CONVERT_STRIDE; s++) {
+				const size_t at = i * CONVERT_STRIDE + s;
+				float expect = s < n ?
+					expect_value(&layout->slots[i], samples[at]) : unset;
+				if (memcmp(&values[at], &expect, sizeof(float))) {
+					check(0, "%s: %zu scans, slot %u scan %zu: "
+							"%a instead of %a", kernels[k], n, i, s,
+							values[at], expect);
+					break;
+				}
+			}
+		}
+	}
+	iio_scan_convert_use(in_use);
+	free(layout);
+}
+
+/* Format values through a CSV output of one slot and compare each line
+ * to what printf() makes of it
+ */
+static void check_format(const float *values, size_t n, unsigned prec)
+{
+	static const int bits[] = { 32 };
+	struct iio_scan_layout *layout = make_layout(bits, 1, 0);
+	struct iio_output *out;
+	char *text, *line, expect[64];
+	size_t size = n * 64 + 64, len = 0, i;
+	FILE *f = tmpfile();
+	ssize_t ret;
+
+	text = malloc(size);
+	if (!f || !text) {
+		perror("iio_test");
+		exit(1);
+	}
+	out = iio_output_new(fileno(f), IIO_OUTPUT_CSV, layout, "test");
+	check(out != NULL, "no output");
+	if (!out)
+		goto out_free;
+	out->precision = prec;
+	check(iio_output_scans(out, values, n, NULL, n) == 0, "output failed");
+	check(iio_output_close(out) == 0, "flush failed");
+
+	lseek(fileno(f), 0, SEEK_SET);
+	while ((ret = read(fileno(f), text + len, size - 1 - len)) > 0)
+		len += ret;
+	text[len] = '\0';
+
+	line = strtok(text, "\n");
+	check(line && strcmp(line, test_elements[0].name) == 0,
+			"header %s", line ? line : "missing");
+	for (i = 0; i < n; i++) {
+		line = strtok(NULL, "\n");
+		snprintf(expect, sizeof(expect), "%.*f", prec, (double)values[i]);
+		check(line && strcmp(line, expect) == 0, "%a with %u decimals: "
+				"%s instead of %s", values[i], prec,
+				line ? line : "nothing", expect);
+		if (!line)
+			break;
+	}
+
+out_free:
+	free(text);
+	fclose(f);
+	free(layout);
+}
+
+static void test_format(void)
+{
+	static const float special[] = {
+		0.0f, -0.0f, 0.5f, 1.5f, 2.5f, -2.5f, 0.125f, 0.375f, -0.0625f,
+		1e-9f, -1e-9f, 0.0000005f, -0.0000005f, 9.999999e5f, 123456.789f,
+		9.0e12f, -9.5e12f, 1e13f, 2147483648.0f, 4294967296.0f,
+		9.2e18f, 1.8e19f, FLT_MIN, -FLT_MIN, FLT_MAX, -FLT_MAX,
+		INFINITY, -INFINITY,
+	};
+	static float values[FORMAT_VALUES];
+	unsigned prec, run;
+	size_t i;
+
+	for (prec = 0; prec <= 6; prec++)
+		check_format(special, sizeof(special) / sizeof(special[0]), prec);
+
+	for (run = 0; run < FORMAT_RUNS; run++) {
+		for (i = 0; i < FORMAT_VALUES; i++) {
+			uint32_t bits = next_rand();
+			/* mostly in the range of sensor values, some anywhere */
+			if (i & 3)
+				values[i] = (float)((int32_t)bits) / (1 << (bits & 15));
+			else
+				memcpy(&values[i], &bits, sizeof(float));
+			/* NaN marks a missing sample in the output */
+			if (isnan(values[i]))
+				values[i] = 0.0f;
+		}
+		check_format(values, FORMAT_VALUES, run % 7);
+	}
+}
+
+/* Decimate the same scans in one block and in blocks of random
+ * sizes: the kept scans, their values and timestamps must not depend
+ * on where the blocks end
+ */
+static void check_filter(const struct iio_scan_layout *layout,
+		const enum iio_filter_type *types, unsigned factor)
+{
+	static float input[MAX_TEST_SLOTS * FILTER_SCANS];
+	static float whole[MAX_TEST_SLOTS * FILTER_SCANS];
+	static float parts[MAX_TEST_SLOTS * FILTER_SCANS];
+	static float block[MAX_TEST_SLOTS * FILTER_BLOCK];
+	static int64_t ts_whole[FILTER_SCANS], ts_block[FILTER_BLOCK];
+	static int64_t ts_parts[FILTER_SCANS];
+	struct iio_filter *one, *many;
+	size_t kept, total = 0, done, n, k, s;
+	unsigned i;
+
+	for (i = 0; i < layout->num_slots; i++)
+		for (s = 0; s < FILTER_SCANS; s++)
+			input[i * FILTER_SCANS + s] = 100.0f * sinf(0.05f * s + i) +
+				(float)(int32_t)next_rand() / (1u << 28);
+
+	one = iio_filter_new(layout, factor, types, FILTER_SCANS);
+	many = iio_filter_new(layout, factor, types, FILTER_BLOCK);
+	check(one && many, "no filter of factor %u", factor);
+	if (!one || !many)
+		goto out_free;
+
+	memcpy(whole, input, sizeof(whole));
+	for (s = 0; s < FILTER_SCANS; s++)
+		ts_whole[s] = s;
+	kept = iio_filter_run(one, whole, FILTER_SCANS, ts_whole, FILTER_SCANS);
+	check(kept == FILTER_SCANS / factor, "factor %u: %zu of %u scans kept",
+			factor, kept, FILTER_SCANS);
+
+	check(iio_filter_run(many, block, FILTER_BLOCK, NULL, 0) == 0,
+			"factor %u: empty block gave scans", factor);
+	for (done = 0; done < FILTER_SCANS; done += n) {
+		n = 1 + next_rand() % FILTER_BLOCK;
+		if (n > FILTER_SCANS - done)
+			n = FILTER_SCANS - done;
+		for (i = 0; i < layout->num_slots; i++)
+			memcpy(block + i * n, input + i * FILTER_SCANS + done,
+					n * sizeof(float));
+		for (s = 0; s < n; s++)
+			ts_block[s] = done + s;
+		k = iio_filter_run(many, block, n, ts_block, n);
+		if (total + k > kept) {
+			check(0, "factor %u: more scans kept in blocks", factor);
+			goto out_free;
+		}
+		for (i = 0; i < layout->num_slots; i++)
+			memcpy(parts + i * FILTER_SCANS + total, block + i * n,
+					k * sizeof(float));
+		memcpy(ts_parts + total, ts_block, k * sizeof(int64_t));
+		total += k;
+	}
+	check(total == kept, "factor %u: %zu scans kept in blocks, %zu in one",
+			factor, total, kept);
+
+	for (k = 0; k < total; k++)
+		check(ts_whole[k] == (int64_t)(k * factor + factor - 1) &&
+				ts_parts[k] == ts_whole[k],
+				"factor %u: scan %zu kept at %lld and %lld", factor, k,
+				(long long)ts_whole[k], (long long)ts_parts[k]);
+	for (i = 0; i < layout->num_slots; i++) {
+		for (k = 0; k < total; k++)
+			if (memcmp(&whole[i * FILTER_SCANS + k],
+					&parts[i * FILTER_SCANS + k], sizeof(float)))
+				break;
+		check(k == total, "factor %u: %s differs at scan %zu",
+				factor, iio_filter_name[types[i]], k);
+		if (types[i] != IIO_FILTER_PICK)
+			continue;
+		/* pick keeps the last scan of each group as it is */
+		for (k = 0; k < total; k++)
+			if (whole[i * FILTER_SCANS + k] !=
+					input[i * FILTER_SCANS + k * factor + factor - 1])
+				break;
+		check(k == total, "factor %u: pick changed scan %zu", factor, k);
+	}
+
+out_free:
+	iio_filter_free(one);
+	iio_filter_free(many);
+}
+
+static void test_filter(void)
+{
+	static const int bits[] = { -16, -16, -16, -16 };
+	static const enum iio_filter_type types[MAX_TEST_SLOTS] = {
+		IIO_FILTER_PICK, IIO_FILTER_MEAN, IIO_FILTER_CIC, IIO_FILTER_FIR,
+	};
+	static const unsigned factors[] = { 1, 2, 3, 4, 7, 16 };
+	struct iio_scan_layout *layout = make_layout(bits, MAX_TEST_SLOTS, 0);
+	unsigned f;
+
+	for (f = 0; f < sizeof(factors) / sizeof(factors[0]); f++)
+		check_filter(layout, types, factors[f]);
+	free(layout);
+}
+
+static void check_round_trip(const struct iio_scan_layout *layout,
+		const int32_t *samples, const int64_t *timestamps, size_t nscans,
+		const char *what)
+{
+	static int32_t restored[MAX_TEST_SLOTS * IIO_PACK_SCANS];
+	static int64_t restored_ts[IIO_PACK_SCANS];
+	struct iio_pack_header hdr;
+	size_t bound = iio_pack_bound(layout, nscans), len;
+	char *buf = malloc(bound);
+	ssize_t ret;
+	unsigned i;
+
+	if (!buf) {
+		perror("iio_test");
+		exit(1);
+	}
+	len = iio_pack_block(layout, samples, IIO_PACK_SCANS, timestamps,
+			nscans, buf);
+	check(len <= bound, "%s: %zu bytes packed, bound %zu", what, len, bound);
+	memcpy(&hdr, buf, sizeof(hdr));
+	check(hdr.nscans == nscans && hdr.size + sizeof(hdr) == len,
+			"%s: header of %u scans, %u bytes", what, hdr.nscans, hdr.size);
+
+	memset(restored, 0x55, sizeof(restored));
+	ret = iio_unpack_block(layout, buf + sizeof(hdr), &hdr, restored,
+			IIO_PACK_SCANS, restored_ts);
+	check(ret == (ssize_t)nscans, "%s: %zd scans unpacked", what, ret);
+	for (i = 0; ret > 0 && i < layout->num_slots; i++)
+		check(memcmp(samples + i * IIO_PACK_SCANS,
+				restored + i * IIO_PACK_SCANS,
+				nscans * sizeof(int32_t)) == 0,
+				"%s: slot %u differs", what, i);
+	if (ret > 0 && layout->ts_offset >= 0)
+		check(memcmp(timestamps, restored_ts, nscans * sizeof(int64_t)) == 0,
+				"%s: timestamps differ", what);
+
+	/* every packed word is used, one less is an overrun */
+	if (hdr.size >= 4) {
+		hdr.size -= 4;
+		ret = iio_unpack_block(layout, buf + sizeof(hdr), &hdr, restored,
+				IIO_PACK_SCANS, restored_ts);
+		check(ret < 0 && errno == EINVAL,
+				"%s: truncated block accepted", what);
+	}
+	free(buf);
+}
+
+static void test_pack(void)
+{
+	static const int widths[][MAX_TEST_SLOTS] = {
+		{ 1, -1, 7, -8 },
+		{ 12, -12, 16, -16 },
+		{ 24, -24, 31, -31 },
+		{ 32, -32, 32, -32 },
+	};
+	static const size_t counts[] = { 1, 2, 3, 17, IIO_PACK_SCANS };
+	static int32_t samples[MAX_TEST_SLOTS * IIO_PACK_SCANS];
+	static int64_t timestamps[IIO_PACK_SCANS];
+	unsigned w, c, i, pattern, has_ts;
+	char what[64];
+	size_t s;
+
+	for (w = 0; w < sizeof(widths) / sizeof(widths[0]); w++)
+	for (has_ts = 0; has_ts < 2; has_ts++)
+	for (pattern = 0; pattern < 4; pattern++)
+	for (c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+		struct iio_scan_layout *layout =
+			make_layout(widths[w], MAX_TEST_SLOTS, has_ts);
+		uint64_t ts = next_rand();
+
+		for (i = 0; i < layout->num_slots; i++) {
+			const struct iio_scan_slot *slot = &layout->slots[i];
+			for (s = 0; s < counts[c]; s++) {
+				uint32_t v;
+				switch (pattern) {
+				case 0:		/* constant */
+					v = 0x5a5a5a5a;
+					break;
+				case 1:		/* slow ramp, wrapping around */
+					v = 0xfffffff0 + s;
+					break;
+				case 2:		/* full scale jumps */
+					v = s & 1 ? 0x80000000 >> (32 - slot->bits) :
+						(0x80000000 >> (32 - slot->bits)) - 1;
+					break;
+				default:
+					v = next_rand();
+					break;
+				}
+				samples[i * IIO_PACK_SCANS + s] = make_sample(slot, v);
+			}
+		}
+		for (s = 0; s < counts[c]; s++) {
+			switch (pattern) {
+			case 0:		/* even spacing */
+				ts += 1000000;
+				break;
+			case 1:		/* jitter */
+				ts += 999000 + next_rand() % 2001;
+				break;
+			case 2:		/* steps backwards and across the range */
+				ts += s & 1 ? (uint64_t)INT64_MIN / 3 : (uint64_t)-7;
+				break;
+			default:
+				ts = next_rand();
+				break;
+			}
+			timestamps[s] = ts;
+		}
+
+		snprintf(what, sizeof(what), "widths %u ts %u pattern %u scans %zu",
+				w, has_ts, pattern, counts[c]);
+		check_round_trip(layout, samples, timestamps, counts[c], what);
+		free(layout);
+	}
+}
+
+static void test_request(void)
+{
+	static const struct {
+		const char *line;
+		int ok;
+		unsigned block;
+		unsigned num_elements;
+	} cases[] = {
+		{ "sim0 256", 1, 256, 0 },
+		{ "sim0 1 accel_x", 1, 1, 1 },
+		{ "sim0 65536 accel_x,00_accel_y,timestamp", 1, 65536, 3 },
+		{ "", 0, 0, 0 },
+		{ "sim0", 0, 0, 0 },
+		{ "sim0 ", 0, 0, 0 },
+		{ " sim0 256", 0, 0, 0 },
+		{ "sim0  256", 0, 0, 0 },
+		{ "sim0 0", 0, 0, 0 },
+		{ "sim0 -1", 0, 0, 0 },
+		{ "sim0 65537", 0, 0, 0 },
+		{ "sim0 99999999999999999999999", 0, 0, 0 },
+		{ "sim0 12x", 0, 0, 0 },
+		{ "sim0 256 accel_x,", 0, 0, 0 },
+		{ "sim0 256 ,accel_x", 0, 0, 0 },
+		{ "sim0 256 accel_x,,accel_y", 0, 0, 0 },
+		{ "sim0 256 accel_x accel_y", 0, 0, 0 },
+	};
+	struct iio_serve_request req;
+	char line[IIO_SERVE_REQUEST_MAX];
+	unsigned i;
+	size_t len;
+	int ret;
+
+	/* as if the devices had been opened */
+	iio_intern("sim0");
+	iio_intern("accel_x");
+	iio_intern("00_accel_y");
+	iio_intern("timestamp");
+
+	for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		errno = 0;
+		ret = iio_serve_parse_request(cases[i].line, &req);
+		if (!cases[i].ok) {
+			check(ret < 0 && errno == EINVAL, "\"%s\" accepted",
+					cases[i].line);
+			continue;
+		}
+		check(ret == 0, "\"%s\" refused", cases[i].line);
+		check(ret < 0 || (req.device == iio_intern("sim0") &&
+				req.block == cases[i].block &&
+				req.num_elements == cases[i].num_elements),
+				"\"%s\" parsed wrong", cases[i].line);
+	}
+
+	ret = iio_serve_parse_request("sim0 8 00_accel_y,accel_x", &req);
+	check(ret == 0 && req.elements[0] == iio_intern("00_accel_y") &&
+			req.elements[1] == iio_intern("accel_x"),
+			"element names not interned");
+
+	/* names from clients are looked up, never added to the pool */
+	ret = iio_serve_parse_request("sim9 8 accel_x,no_such_element", &req);
+	check(ret == 0 && !req.device && req.elements[0] == iio_intern("accel_x") &&
+			!req.elements[1], "unknown names not NULL");
+	check(!iio_intern_find("sim9", 4) &&
+			!iio_intern_find("no_such_element", 15),
+			"unknown names interned");
+
+	/* names up to SYSFS_NAME_LEN - 1 characters */
+	memset(line, 'd', SYSFS_NAME_LEN - 1);
+	strcpy(line + SYSFS_NAME_LEN - 1, " 8");
+	check(iio_serve_parse_request(line, &req) == 0, "longest device refused");
+	memset(line, 'd', SYSFS_NAME_LEN);
+	strcpy(line + SYSFS_NAME_LEN, " 8");
+	check(iio_serve_parse_request(line, &req) < 0, "too long device accepted");
+
+	len = sprintf(line, "sim0 8 ");
+	memset(line + len, 'e', SYSFS_NAME_LEN);
+	line[len + SYSFS_NAME_LEN] = '\0';
+	check(iio_serve_parse_request(line, &req) < 0, "too long element accepted");
+
+	/* at most IIO_SERVE_MAX_ELEMENTS elements */
+	len = sprintf(line, "sim0 8 ");
+	for (i = 0; i < IIO_SERVE_MAX_ELEMENTS; i++)
+		len += sprintf(line + len, "%se%u", i ? "," : "", i);
+	check(iio_serve_parse_request(line, &req) == 0 &&
+			req.num_elements == IIO_SERVE_MAX_ELEMENTS,
+			"%d elements refused", IIO_SERVE_MAX_ELEMENTS);
+	sprintf(line + len, ",e%u", i);
+	check(iio_serve_parse_request(line, &req) < 0,
+			"%d elements accepted", IIO_SERVE_MAX_ELEMENTS + 1);
+}
+
+/* An attribute of the tree as the test sees it, without newline */
+static const char *attr(const char *dir, const char *name)
+{
+	static char value[SYSFS_NAME_LEN];
+	char path[SYSFS_PATH_MAX];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	value[0] = '\0';
+	f = fopen(path, "r");
+	if (f) {
+		if (!fgets(value, sizeof(value), f))
+			value[0] = '\0';
+		value[strcspn(value, "\n")] = '\0';
+		fclose(f);
+	}
+	return value;
+}
+
+/* Device sim0 of a tree from "iio_sim -t": one setup that sticks, one
+ * that fails half way and is undone, and one refused before any write
+ */
+static void test_setup(const char *root)
+{
+	const char *elements[2];
+	struct iio_setup_config config = { .elements = elements };
+	struct iio_device *dev;
+	struct iio_setup *setup;
+	struct dlist *scan_elements;
+	char scan_dir[SYSFS_PATH_MAX], trigger_dir[SYSFS_PATH_MAX];
+	char length_path[SYSFS_PATH_MAX];
+	int fd;
+
+	if (iio_set_root(root) < 0) {
+		check(0, "root %s refused", root);
+		return;
+	}
+	dev = iio_open_device_by_name("sim0");
+	check(dev != NULL, "no device sim0 below %s", root);
+	if (!dev)
+		return;
+	iio_get_device_channels(dev);
+	scan_elements = iio_get_ring_buffer(dev) ?
+		iio_get_ring_buffer_scan_elements(dev->buffer) : NULL;
+	setup = scan_elements ? iio_setup_open(dev->buffer, scan_elements) : NULL;
+	check(setup != NULL, "no setup of sim0");
+	if (!setup)
+		goto out_close;
+	check(setup->truncate, "plain files taken for sysfs");
+	snprintf(scan_dir, sizeof(scan_dir), "%s/scan_elements", dev->path);
+	snprintf(trigger_dir, sizeof(trigger_dir), "%s/trigger", dev->path);
+	snprintf(length_path, sizeof(length_path), "%s/length", dev->buffer->path);
+
+	elements[0] = iio_intern("00_accel_x");
+	elements[1] = iio_intern("accel_y");
+	config.num_elements = 2;
+	config.trigger = "simtrig1";
+	config.length = 128;
+	config.enable = 1;
+	check(iio_setup_apply(setup, &config) == 0, "setup failed");
+	check(strcmp(attr(trigger_dir, "current_trigger"), "simtrig1") == 0 &&
+			strcmp(attr(dev->buffer->path, "length"), "128") == 0 &&
+			strcmp(attr(dev->buffer->path, "ring_enable"), "1") == 0,
+			"trigger, length or enable not written");
+	check(strcmp(attr(scan_dir, "00_accel_x_en"), "1") == 0 &&
+			strcmp(attr(scan_dir, "01_accel_y_en"), "1") == 0 &&
+			strcmp(attr(scan_dir, "02_accel_z_en"), "0") == 0,
+			"scan elements not written");
+
+	/* a length that does not stick, after trigger and elements */
+	fd = open(length_path, O_RDONLY);
+	if (fd < 0 || dup2(fd, setup->length_fd) < 0) {
+		check(0, "%s: %s", length_path, strerror(errno));
+		goto out_free;
+	}
+	close(fd);
+	elements[0] = iio_intern("02_accel_z");
+	config.num_elements = 1;
+	config.trigger = "simtrig0";
+	config.length = 256;
+	check(iio_setup_apply(setup, &config) < 0, "length change did not fail");
+	check(strcmp(attr(trigger_dir, "current_trigger"), "simtrig1") == 0 &&
+			strcmp(setup->trigger, "simtrig1") == 0,
+			"trigger not restored");
+	check(strcmp(attr(dev->buffer->path, "length"), "128") == 0 &&
+			setup->length == 128, "length changed");
+	check(strcmp(attr(scan_dir, "00_accel_x_en"), "1") == 0 &&
+			strcmp(attr(scan_dir, "01_accel_y_en"), "1") == 0 &&
+			strcmp(attr(scan_dir, "02_accel_z_en"), "0") == 0 &&
+			setup->elements[2].elem->enabled == 0,
+			"scan elements not restored");
+	check(strcmp(attr(dev->buffer->path, "ring_enable"), "1") == 0 &&
+			setup->enabled == 1, "ring not enabled again");
+
+	/* unknown names are refused before the ring is touched */
+	elements[0] = "no_such_element";
+	check(iio_setup_apply(setup, &config) < 0 && errno == EINVAL,
+			"unknown element accepted");
+	check(strcmp(attr(dev->buffer->path, "ring_enable"), "1") == 0,
+			"ring disabled for a refused setup");
+
+out_free:
+	iio_setup_close(setup);
+out_close:
+	iio_close_device(dev);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 2) {
+		fprintf(stderr, "Usage: iio_test [root]\n"
+			"Check the conversion, the number formatting, the filters,\n"
+			"the packed format and the server requests, and the device\n"
+			"setup on a tree from iio_sim -t below <root>; exits with 1\n"
+			"if a check failed.\n");
+		exit(1);
+	}
+
+	test_convert();
+	test_format();
+	test_filter();
+	test_pack();
+	test_request();
+	if (argc > 1)
+		test_setup(argv[1]);
+
+	if (failures) {
+		fprintf(stderr, "%u checks failed\n", failures);
+		return 1;
+	}
+	printf("All checks passed\n");
+	return 0;
+}
@@ -0,0 +1,396 @@
+/*
+ * Industrial I/O utilities - iio_capture.c
+ *
+ * Copyright (c) 2010 Manuel Stahl <manuel.stahl@iis.fraunhofer.de>
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <fcntl.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "iio.h"
+
+/*
+ * A capture file starts with one header describing the device and the
+ * scan layout, followed by the raw scans exactly as read from the ring
+ * access device, or by blocks of iio_pack_block() in version 2. All
+ * header fields are stored in host byte order, the byte_order field
+ * tells a reader whether it can use the file.
+ */
+#define IIO_CAPTURE_MAGIC	"IIOCAP\r\n"
+#define IIO_CAPTURE_VERSION	1
+#define IIO_CAPTURE_VERSION_PACKED	2
+#define IIO_CAPTURE_BYTE_ORDER	0x01020304
+
+struct iio_capture_file_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t scan_size;
+	int32_t ts_offset;
+	uint32_t num_slots;
+	uint32_t encoding;	/* enum iio_capture_encoding, 0 in version 1 */
+	char device[SYSFS_NAME_LEN];
+	char trigger[SYSFS_NAME_LEN];
+};
+
+struct iio_capture_file_slot {
+	char name[SYSFS_NAME_LEN];
+	uint32_t index;
+	uint32_t bits;
+	uint32_t storagebits;
+	uint32_t shift;
+	uint32_t is_signed;
+	uint32_t offset;
+	float scale;
+	float value_offset;
+};
+
+/**
+ * iio_capture_write_block: write a block of data completely
+ * Returns 0 on success and -1 on failure
+ */
+int iio_capture_write_block(int fd, const char *data, size_t len)
+{
+	while (len > 0) {
+		ssize_t ret = write(fd, data, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		data += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/**
+ * iio_capture_write_packed: pack scans and write them to a capture
+ * @fd: file descriptor to write to
+ * @layout: scan layout the capture was started with
+ * @samples: samples as stored by iio_scan_decode()
+ * @stride: distance between two slots in @samples
+ * @timestamps: one per scan, only used if the scans have a timestamp
+ * @nscans: number of scans, split into blocks of IIO_PACK_SCANS
+ * @buf: room for iio_pack_bound(layout, IIO_PACK_SCANS) bytes
+ * Returns 0 on success and -1 on failure
+ */
+int iio_capture_write_packed(int fd, const struct iio_scan_layout *layout,
+		const int32_t *samples, size_t stride, const int64_t *timestamps,
+		size_t nscans, char *buf)
+{
+	size_t s, n, len;
+
+	for (s = 0; s < nscans; s += n) {
+		n = nscans - s < IIO_PACK_SCANS ? nscans - s : IIO_PACK_SCANS;
+		len = iio_pack_block(layout, samples + s, stride,
+				timestamps ? timestamps + s : NULL, n, buf);
+		if (iio_capture_write_block(fd, buf, len) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/**
+ * iio_capture_header_size: bytes of the header of a capture of layout
+ */
+size_t iio_capture_header_size(const struct iio_scan_layout *layout)
+{
+	return sizeof(struct iio_capture_file_header) +
+		layout->num_slots * sizeof(struct iio_capture_file_slot);
+}
+
+/**
+ * iio_capture_format_header: build the header of a capture in memory
+ * @buf: room for iio_capture_header_size() bytes
+ *
+ * The other arguments are those of iio_capture_write_header().
+ */
+void iio_capture_format_header(char *buf, const char *device,
+		const char *trigger, const struct iio_scan_layout *layout,
+		enum iio_capture_encoding encoding)
+{
+	struct iio_capture_file_header hdr;
+	struct iio_capture_file_slot fslot;
+	unsigned i;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, IIO_CAPTURE_MAGIC, sizeof(hdr.magic));
+	hdr.version = encoding == IIO_CAPTURE_RAW ? IIO_CAPTURE_VERSION :
+			IIO_CAPTURE_VERSION_PACKED;
+	hdr.byte_order = IIO_CAPTURE_BYTE_ORDER;
+	hdr.scan_size = layout->scan_size;
+	hdr.ts_offset = layout->ts_offset;
+	hdr.num_slots = layout->num_slots;
+	hdr.encoding = encoding;
+	snprintf(hdr.device, SYSFS_NAME_LEN, "%s", device);
+	if (trigger)
+		snprintf(hdr.trigger, SYSFS_NAME_LEN, "%s", trigger);
+	memcpy(buf, &hdr, sizeof(hdr));
+	buf += sizeof(hdr);
+
+	for (i = 0; i < layout->num_slots; i++) {
+		const struct iio_scan_slot *slot = &layout->slots[i];
+		memset(&fslot, 0, sizeof(fslot));
+		snprintf(fslot.name, SYSFS_NAME_LEN, "%s", slot->elem->name);
+		fslot.index = slot->elem->index;
+		fslot.bits = slot->bits;
+		fslot.storagebits = slot->bytes * 8;
+		fslot.shift = slot->shift;
+		fslot.is_signed = slot->is_signed;
+		fslot.offset = slot->offset;
+		fslot.scale = slot->scale;
+		fslot.value_offset = slot->value_offset;
+		memcpy(buf, &fslot, sizeof(fslot));
+		buf += sizeof(fslot);
+	}
+}
+
+/**
+ * iio_capture_write_header: start a capture file
+ * @fd: file descriptor to write to
+ * @device: name of the device the scans come from
+ * @trigger: name of the current trigger, may be NULL
+ * @layout: scan layout of the data that will follow
+ * @encoding: how the scans will be written
+ * Returns 0 on success and -1 on failure
+ */
+int iio_capture_write_header(int fd, const char *device, const char *trigger,
+		const struct iio_scan_layout *layout,
+		enum iio_capture_encoding encoding)
+{
+	size_t len = iio_capture_header_size(layout);
+	char *buf = malloc(len);
+	int ret;
+
+	if (!buf)
+		return -1;
+	iio_capture_format_header(buf, device, trigger, layout, encoding);
+	ret = iio_capture_write_block(fd, buf, len);
+	free(buf);
+	return ret;
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	while (len > 0) {
+		ssize_t ret = read(fd, p, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		p += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/**
+ * iio_capture_open_fd: read the header of a capture from a stream
+ * @fd: file, pipe or socket positioned at the header
+ * @path: name of the stream in messages
+ *
+ * The capture takes over @fd, it is closed on failure as well.
+ * Returns the capture on success and NULL on failure
+ */
+struct iio_capture *iio_capture_open_fd(int fd, const char *path)
+{
+	struct iio_capture_file_header hdr;
+	struct iio_capture_file_slot fslot;
+	struct iio_capture *cap;
+	unsigned i;
+
+	if (read_all(fd, &hdr, sizeof(hdr)) ||
+			memcmp(hdr.magic, IIO_CAPTURE_MAGIC, sizeof(hdr.magic))) {
+		fprintf(stderr, "%s is no industrial I/O capture\n", path);
+		goto err_close;
+	}
+	if (hdr.byte_order != IIO_CAPTURE_BYTE_ORDER) {
+		fprintf(stderr, "%s: unsupported byte order\n", path);
+		goto err_close;
+	}
+	if ((hdr.version != IIO_CAPTURE_VERSION || hdr.encoding != IIO_CAPTURE_RAW) &&
+			(hdr.version != IIO_CAPTURE_VERSION_PACKED ||
+			 hdr.encoding != IIO_CAPTURE_PACKED)) {
+		fprintf(stderr, "%s: unsupported capture version\n", path);
+		goto err_close;
+	}
+	if (hdr.scan_size == 0 || hdr.num_slots > hdr.scan_size ||
+			(hdr.ts_offset >= 0 &&
+			 hdr.ts_offset + sizeof(int64_t) > hdr.scan_size)) {
+		fprintf(stderr, "%s: invalid scan layout\n", path);
+		goto err_close;
+	}
+
+	cap = calloc(1, sizeof(struct iio_capture));
+	if (!cap)
+		goto err_close;
+	cap->layout = calloc(1, sizeof(struct iio_scan_layout) +
+			hdr.num_slots * sizeof(struct iio_scan_slot));
+	cap->elements = calloc(hdr.num_slots + 1, sizeof(struct iio_scan_element));
+	if (!cap->layout || !cap->elements)
+		goto err_free;
+
+	cap->fd = fd;
+	cap->encoding = hdr.encoding;
+	snprintf(cap->device, SYSFS_NAME_LEN, "%.*s", SYSFS_NAME_LEN - 1, hdr.device);
+	snprintf(cap->trigger, SYSFS_NAME_LEN, "%.*s", SYSFS_NAME_LEN - 1, hdr.trigger);
+	cap->layout->scan_size = hdr.scan_size;
+	cap->layout->ts_offset = hdr.ts_offset;
+	cap->layout->num_slots = hdr.num_slots;
+
+	for (i = 0; i < hdr.num_slots; i++) {
+		struct iio_scan_element *elem = &cap->elements[i];
+		struct iio_scan_slot *slot = &cap->layout->slots[i];
+		const char *end;
+
+		if (read_all(fd, &fslot, sizeof(fslot))) {
+			fprintf(stderr, "%s: truncated capture header\n", path);
+			goto err_free;
+		}
+		if ((fslot.storagebits != 8 && fslot.storagebits != 16 &&
+				fslot.storagebits != 32) || fslot.bits == 0 ||
+				fslot.bits + fslot.shift > fslot.storagebits ||
+				fslot.offset + fslot.storagebits / 8 > hdr.scan_size) {
+			fprintf(stderr, "%s: invalid scan element %u\n", path, i);
+			goto err_free;
+		}
+
+		end = memchr(fslot.name, '\0', SYSFS_NAME_LEN);
+		elem->name = iio_intern_len(fslot.name,
+				end ? end - fslot.name : SYSFS_NAME_LEN);
+		if (!elem->name)
+			goto err_free;
+		elem->index = fslot.index;
+		elem->bits = fslot.bits;
+		elem->storagebits = fslot.storagebits;
+		elem->shift = fslot.shift;
+		elem->is_signed = fslot.is_signed;
+		elem->big_endian = __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__;
+		elem->enabled = 1;
+
+		slot->elem = elem;
+		slot->offset = fslot.offset;
+		slot->bytes = fslot.storagebits / 8;
+		slot->shift = fslot.shift;
+		slot->bits = fslot.bits;
+		slot->mask = fslot.bits == 32 ? 0xffffffff : (1u << fslot.bits) - 1;
+		slot->is_signed = fslot.is_signed;
+		slot->scale = fslot.scale;
+		slot->value_offset = fslot.value_offset;
+	}
+
+	if (cap->encoding == IIO_CAPTURE_PACKED) {
+		cap->block = malloc(iio_pack_bound(cap->layout, IIO_PACK_SCANS));
+		if (!cap->block)
+			goto err_free;
+	}
+	return cap;
+
+err_free:
+	free(cap->elements);
+	free(cap->layout);
+	free(cap);
+err_close:
+	if (fd != STDIN_FILENO)
+		close(fd);
+	return NULL;
+}
+
+/**
+ * iio_capture_open: open a capture file for reading
+ * @path: file name, "-" reads from stdin
+ *
+ * On success the file position is at the first scan.
+ * Returns the capture on success and NULL on failure
+ */
+struct iio_capture *iio_capture_open(const char *path)
+{
+	int fd = strcmp(path, "-") ? open(path, O_RDONLY) : STDIN_FILENO;
+
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+	return iio_capture_open_fd(fd, path);
+}
+
+/**
+ * iio_capture_read_packed: read the next block of a packed capture
+ * @cap: capture opened by iio_capture_open()
+ * @samples: output, same arrangement as iio_scan_decode() uses
+ * @stride: distance between two slots in @samples, at least IIO_PACK_SCANS
+ * @timestamps: output for one timestamp per scan, may be NULL
+ * Returns the number of scans read, 0 at the end of the file and -1 on
+ * failure
+ */
+ssize_t iio_capture_read_packed(struct iio_capture *cap, int32_t *samples,
+		size_t stride, int64_t *timestamps)
+{
+	const size_t max = iio_pack_bound(cap->layout, IIO_PACK_SCANS) -
+			sizeof(struct iio_pack_header);
+	struct iio_pack_header hdr;
+	ssize_t len;
+
+	/* a clean end is only allowed between blocks */
+	do
+		len = read(cap->fd, &hdr, sizeof(hdr));
+	while (len < 0 && errno == EINTR);
+	if (len == 0)
+		return 0;
+	if (len < 0)
+		return -1;
+	if ((size_t)len < sizeof(hdr) && read_all(cap->fd, (char *)&hdr + len,
+			sizeof(hdr) - len))
+		goto err_corrupt;
+
+	if (hdr.size > max || read_all(cap->fd, cap->block, hdr.size))
+		goto err_corrupt;
+	len = iio_unpack_block(cap->layout, cap->block, &hdr, samples, stride,
+			timestamps);
+	if (len < 0)
+		goto err_corrupt;
+	return len;
+
+err_corrupt:
+	errno = EINVAL;
+	return -1;
+}
+
+void iio_capture_close(struct iio_capture *cap)
+{
+	if (cap) {
+		if (cap->fd != STDIN_FILENO)
+			close(cap->fd);
+		free(cap->block);
+		free(cap->elements);
+		free(cap->layout);
+		free(cap);
+	}
+}
@@ -0,0 +1,278 @@
+/*
+ * Industrial I/O utilities - iio_filter.c
+ *
+ * Copyright (c) 2010 Manuel Stahl <manuel.stahl@iis.fraunhofer.de>
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "iio.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+/*
+ * Decimation of converted scans by an integer factor. Every filter type
+ * is a FIR filter that is only evaluated for the scans that are kept:
+ *   pick  one tap, every factor-th scan as it is
+ *   mean  factor taps of 1/factor, the average since the last kept scan
+ *   cic   three means in a row, as a 3rd order CIC decimator without
+ *         the integer wrap-around arithmetic it needs at run time
+ *   fir   windowed sinc low pass at 80% of the new Nyquist frequency
+ * All taps are symmetric and sum up to one. Each slot keeps the inputs
+ * the next block still needs in front of a copy of the new block, so
+ * every output is a dot product over contiguous memory.
+ */
+#define FIR_TAPS_PER_FACTOR 8
+#define FIR_CUTOFF 0.8
+
+const char *iio_filter_name[IIO_FILTER_UNKNOWN] = {
+	"pick",
+	"mean",
+	"cic",
+	"fir",
+};
+
+/**
+ * iio_filter_type_from_name: look up a filter type
+ * Returns the type or IIO_FILTER_UNKNOWN
+ */
+enum iio_filter_type iio_filter_type_from_name(const char *name)
+{
+	unsigned i;
+
+	for (i = 0; i < IIO_FILTER_UNKNOWN; i++)
+		if (strcmp(name, iio_filter_name[i]) == 0)
+			break;
+	return i;
+}
+
+static unsigned filter_taps(enum iio_filter_type type, unsigned factor)
+{
+	switch (type) {
+	case IIO_FILTER_PICK:
+		return 1;
+	case IIO_FILTER_MEAN:
+		return factor;
+	case IIO_FILTER_CIC:
+		return 3 * (factor - 1) + 1;
+	default:
+		return FIR_TAPS_PER_FACTOR * factor + 1;
+	}
+}
+
+static int design_taps(float *taps, unsigned n, enum iio_filter_type type,
+		unsigned factor)
+{
+	double *h = calloc(n, sizeof(double)), sum = 0;
+	unsigned i, j, k, len;
+
+	if (!h)
+		return -1;
+
+	switch (type) {
+	case IIO_FILTER_PICK:
+	case IIO_FILTER_MEAN:
+		for (i = 0; i < n; i++)
+			h[i] = 1;
+		break;
+	case IIO_FILTER_CIC:
+		/* convolve a box of factor ones with itself twice, in
+		 * place from the end; h is zero beyond len */
+		for (i = 0; i < factor; i++)
+			h[i] = 1;
+		for (k = 1, len = factor; k < 3; k++, len += factor - 1)
+			for (i = len + factor - 1; i-- > 0; ) {
+				double acc = 0;
+				for (j = 0; j < factor && j <= i; j++)
+					acc += h[i - j];
+				h[i] = acc;
+			}
+		break;
+	default: {
+		const double fc = FIR_CUTOFF * 0.5 / factor;
+		const double m = (n - 1) / 2.0;
+		for (i = 0; i < n; i++) {
+			double x = i - m;
+			double sinc = x == 0 ? 2 * fc : sin(2 * M_PI * fc * x) / (M_PI * x);
+			/* Blackman window */
+			h[i] = sinc * (0.42 - 0.5 * cos(2 * M_PI * i / (n - 1)) +
+					0.08 * cos(4 * M_PI * i / (n - 1)));
+		}
+		break;
+	}
+	}
+
+	for (i = 0; i < n; i++)
+		sum += h[i];
+	for (i = 0; i < n; i++)
+		taps[i] = h[i] / sum;
+	free(h);
+	return 0;
+}
+
+/**
+ * iio_filter_new: set up decimation of blocks of scans
+ * @layout: table built by iio_scan_layout_new()
+ * @factor: keep one of @factor scans, at least 1
+ * @types: filter of each slot of @layout
+ * @max_scans: most scans passed to one iio_filter_run()
+ * Returns the filter on success and NULL on failure
+ */
+struct iio_filter *iio_filter_new(const struct iio_scan_layout *layout,
+		unsigned factor, const enum iio_filter_type *types, size_t max_scans)
+{
+	struct iio_filter *filter;
+	unsigned i;
+
+	if (factor == 0 || max_scans == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	filter = calloc(1, sizeof(struct iio_filter) +
+			layout->num_slots * sizeof(struct iio_filter_slot));
+	if (!filter) {
+		fprintf(stderr, "Could not allocate filter\n");
+		return NULL;
+	}
+	filter->factor = factor;
+	filter->max_scans = max_scans;
+	filter->num_slots = layout->num_slots;
+
+	for (i = 0; i < filter->num_slots; i++) {
+		struct iio_filter_slot *slot = &filter->slots[i];
+
+		if (types[i] >= IIO_FILTER_UNKNOWN) {
+			fprintf(stderr, "Unknown filter for %s\n",
+					layout->slots[i].elem->name);
+			iio_filter_free(filter);
+			errno = EINVAL;
+			return NULL;
+		}
+		slot->type = types[i];
+		slot->num_taps = filter_taps(types[i], factor);
+		slot->taps = malloc(slot->num_taps * sizeof(float));
+		slot->history = malloc((slot->num_taps - 1 + max_scans) * sizeof(float));
+		if (!slot->taps || !slot->history ||
+				design_taps(slot->taps, slot->num_taps, types[i], factor) < 0) {
+			fprintf(stderr, "Could not allocate filter\n");
+			iio_filter_free(filter);
+			return NULL;
+		}
+	}
+	return filter;
+}
+
+void iio_filter_free(struct iio_filter *filter)
+{
+	unsigned i;
+
+	if (!filter)
+		return;
+	for (i = 0; i < filter->num_slots; i++) {
+		free(filter->slots[i].history);
+		free(filter->slots[i].taps);
+	}
+	free(filter);
+}
+
+/* Eight partial sums in a fixed order: the compiler can map them to
+ * vector lanes without reordering the float additions, so the result
+ * does not depend on the instruction set.
+ */
+static float dot(const float *restrict a, const float *restrict b, unsigned n)
+{
+	float acc[8] = { 0 };
+	unsigned i, j;
+
+	for (i = 0; i + 8 <= n; i += 8)
+		for (j = 0; j < 8; j++)
+			acc[j] += a[i + j] * b[i + j];
+	for (j = 0; i < n; i++, j++)
+		acc[j] += a[i] * b[i];
+	return ((acc[0] + acc[4]) + (acc[1] + acc[5])) +
+		((acc[2] + acc[6]) + (acc[3] + acc[7]));
+}
+
+/**
+ * iio_filter_run: decimate a block of converted scans in place
+ * @filter: state built by iio_filter_new()
+ * @values: values as stored by iio_scan_convert(), the kept scans are
+ * written to the start of each slot
+ * @stride: distance between two slots in @values
+ * @timestamps: one per scan, the ones of the kept scans are moved to
+ * the start; may be NULL
+ * @nscans: number of scans in the block, at most max_scans
+ *
+ * Scans are kept at the same positions across blocks. Before the first
+ * block the inputs are taken to have been constant.
+ * Returns the number of scans kept
+ */
+size_t iio_filter_run(struct iio_filter *filter, float *values, size_t stride,
+		int64_t *timestamps, size_t nscans)
+{
+	const unsigned factor = filter->factor;
+	size_t first, s, k, kept;
+	unsigned i;
+
+	if (nscans > filter->max_scans)
+		nscans = filter->max_scans;
+	if (nscans == 0)
+		return 0;
+
+	/* the first kept scan completes the group begun in earlier blocks */
+	first = factor - 1 - filter->phase;
+	kept = first < nscans ? (nscans - first - 1) / factor + 1 : 0;
+
+	for (i = 0; i < filter->num_slots; i++) {
+		struct iio_filter_slot *slot = &filter->slots[i];
+		const unsigned old = slot->num_taps - 1;
+		float *in = values + i * stride;
+
+		if (!filter->primed)
+			for (s = 0; s < old; s++)
+				slot->history[s] = in[0];
+		memcpy(slot->history + old, in, nscans * sizeof(float));
+
+		/* output k ends with input first + k * factor */
+		for (k = 0, s = first; k < kept; k++, s += factor)
+			in[k] = dot(slot->taps, slot->history + s, slot->num_taps);
+
+		memmove(slot->history, slot->history + nscans, old * sizeof(float));
+	}
+
+	if (timestamps)
+		for (k = 0, s = first; k < kept; k++, s += factor)
+			timestamps[k] = timestamps[s];
+
+	filter->phase = (filter->phase + nscans) % factor;
+	filter->primed = 1;
+	return kept;
+}
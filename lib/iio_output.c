@@ -0,0 +1,360 @@
+/*
+ * Industrial I/O utilities - iio_output.c
+ *
+ * Copyright (c) 2010 Manuel Stahl <manuel.stahl@iis.fraunhofer.de>
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "iio.h"
+
+/*
+ * Text output of decoded scans. Rows are formatted by hand into one large
+ * buffer which is handed to write() only when it is nearly full, so the
+ * cost per sample is a few integer divisions and a memcpy.
+ */
+#define OUTPUT_BUFFER_SIZE	(256 * 1024)
+#define MAX_NUMBER_LEN		48	/* longest formatted number: -FLT_MAX */
+
+static const char digit_pairs[201] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+static const uint64_t pow10_table[] = {
+	1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+};
+
+/* Write the decimal digits of v to the end of dest,
+ * returns the number of characters written.
+ */
+static inline unsigned format_uint(char *dest, uint64_t v)
+{
+	char tmp[20];
+	char *p = tmp + sizeof(tmp);
+	unsigned len;
+
+	while (v >= 100) {
+		unsigned i = (v % 100) * 2;
+		v /= 100;
+		p -= 2;
+		p[0] = digit_pairs[i];
+		p[1] = digit_pairs[i + 1];
+	}
+	if (v >= 10) {
+		p -= 2;
+		p[0] = digit_pairs[v * 2];
+		p[1] = digit_pairs[v * 2 + 1];
+	} else {
+		*--p = '0' + v;
+	}
+	len = tmp + sizeof(tmp) - p;
+	memcpy(dest, p, len);
+	return len;
+}
+
+static inline unsigned format_int(char *dest, int64_t v)
+{
+	if (v < 0) {
+		*dest = '-';
+		return format_uint(dest + 1, -(uint64_t)v) + 1;
+	}
+	return format_uint(dest, v);
+}
+
+/* Fixed point formatting with up to 6 decimals, gives the same digits as
+ * "%.*f". A float times 10^6 is exact in a double, so rounding half to
+ * even here matches the C library. Values that do not fit into 64 bit
+ * after scaling and non-finite ones are left to snprintf() with the same
+ * format.
+ */
+static unsigned format_fixed(char *dest, float value, unsigned prec, int plus)
+{
+	const uint64_t mult = pow10_table[prec];
+	double v = value, frac;
+	uint64_t fixed, ipart, fpart;
+	char *p = dest;
+	unsigned flen;
+
+	if (isnan(v) || isinf(v) || fabs(v) * mult >= 9.0e18)
+		return snprintf(dest, MAX_NUMBER_LEN, plus ? "%+.*f" : "%.*f",
+				prec, v);
+
+	/* -0.0 keeps its sign, as with %f */
+	if (signbit(v)) {
+		*p++ = '-';
+		v = -v;
+	} else if (plus) {
+		*p++ = '+';
+	}
+	v *= mult;
+	fixed = (uint64_t)v;
+	frac = v - (double)fixed;
+	if (frac > 0.5 || (frac == 0.5 && (fixed & 1)))
+		fixed++;
+	ipart = fixed / mult;
+	fpart = fixed - ipart * mult;
+
+	p += format_uint(p, ipart);
+	if (prec) {
+		*p++ = '.';
+		flen = format_uint(p, fpart);
+		/* move the digits right and pad with leading zeros */
+		memmove(p + prec - flen, p, flen);
+		memset(p, '0', prec - flen);
+		p += prec;
+	}
+	return p - dest;
+}
+
+static inline void put(struct iio_output *out, const char *s, size_t len)
+{
+	memcpy(out->buf + out->len, s, len);
+	out->len += len;
+}
+
+static char *dup_printf(const char *fmt, const char *arg)
+{
+	char *s;
+	size_t len = strlen(fmt) + strlen(arg);
+
+	s = malloc(len);
+	if (s)
+		snprintf(s, len, fmt, arg);
+	return s;
+}
+
+/**
+ * iio_output_flush: write all buffered output
+ * Returns 0 on success and -1 on failure
+ */
+int iio_output_flush(struct iio_output *out)
+{
+	int ret = iio_capture_write_block(out->fd, out->buf, out->len);
+	out->len = 0;
+	return ret;
+}
+
+static int reserve(struct iio_output *out, size_t len)
+{
+	if (out->len + len > out->size)
+		return iio_output_flush(out);
+	return 0;
+}
+
+/**
+ * iio_output_new: create a text output for decoded scans
+ * @fd: file descriptor to write to, it is not closed by the output
+ * @format: one of enum iio_output_format
+ * @layout: layout of the scans that will be written
+ * @device: device name, used in the XML header
+ *
+ * The CSV header line or XML prolog is written on the first flush.
+ * Returns the output on success and NULL on failure
+ */
+struct iio_output *iio_output_new(int fd, enum iio_output_format format,
+		const struct iio_scan_layout *layout, const char *device)
+{
+	struct iio_output *out;
+	unsigned i;
+	size_t row = 64;
+
+	out = calloc(1, sizeof(struct iio_output));
+	if (!out)
+		return NULL;
+	out->fd = fd;
+	out->format = format;
+	out->layout = layout;
+	out->precision = format == IIO_OUTPUT_TABLE ? 3 : 6;
+	out->prefix = calloc(layout->num_slots + 1, sizeof(char *));
+	if (!out->prefix)
+		goto err_free;
+
+	for (i = 0; i < layout->num_slots; i++) {
+		const char *name = layout->slots[i].elem->name;
+		if (format == IIO_OUTPUT_XML)
+			out->prefix[i] = dup_printf("<value name=\"%s\">", name);
+		else
+			out->prefix[i] = dup_printf(i ? ",%s" : "%s", name);
+		if (!out->prefix[i])
+			goto err_free;
+		row += strlen(out->prefix[i]) + MAX_NUMBER_LEN + sizeof("</value>");
+	}
+
+	/* the buffer always has room for one more row */
+	out->size = OUTPUT_BUFFER_SIZE;
+	out->buf = malloc(out->size + row + 256);
+	if (!out->buf)
+		goto err_free;
+
+	switch (format) {
+	case IIO_OUTPUT_CSV:
+		if (layout->ts_offset >= 0)
+			put(out, "timestamp,", 10);
+		for (i = 0; i < layout->num_slots; i++)
+			put(out, out->prefix[i], strlen(out->prefix[i]));
+		put(out, "\n", 1);
+		break;
+	case IIO_OUTPUT_XML:
+		out->len = snprintf(out->buf, out->size,
+				"<?xml version=\"1.0\"?>\n<capture device=\"%s\">\n",
+				device ? device : "");
+		break;
+	default:
+		break;
+	}
+	return out;
+
+err_free:
+	iio_output_close(out);
+	return NULL;
+}
+
+/**
+ * iio_output_scans: format a block of converted scans
+ * @out: output created by iio_output_new()
+ * @values: scaled samples as stored by iio_scan_convert()
+ * @stride: distance between two slots in @values
+ * @timestamps: one timestamp per scan, ignored without timestamp slot
+ * @nscans: number of scans
+ *
+ * A NaN value marks a sample missing from this scan, it is left empty.
+ * Returns 0 on success and -1 on write errors
+ */
+int iio_output_scans(struct iio_output *out, const float *values,
+		size_t stride, const int64_t *timestamps, size_t nscans)
+{
+	const struct iio_scan_layout *layout = out->layout;
+	const int has_ts = layout->ts_offset >= 0 && timestamps;
+	const unsigned prec = out->precision;
+	size_t s;
+	unsigned i;
+	char *p;
+
+	for (s = 0; s < nscans; s++) {
+		p = out->buf + out->len;
+		switch (out->format) {
+		case IIO_OUTPUT_CSV:
+			if (has_ts) {
+				p += format_int(p, timestamps[s]);
+				*p++ = ',';
+			}
+			for (i = 0; i < layout->num_slots; i++) {
+				if (i)
+					*p++ = ',';
+				if (!isnan(values[i * stride + s]))
+					p += format_fixed(p, values[i * stride + s], prec, 0);
+			}
+			break;
+
+		case IIO_OUTPUT_XML:
+			if (has_ts) {
+				memcpy(p, "<scan timestamp=\"", 17);
+				p += 17;
+				p += format_int(p, timestamps[s]);
+				memcpy(p, "\">", 2);
+				p += 2;
+			} else {
+				memcpy(p, "<scan>", 6);
+				p += 6;
+			}
+			for (i = 0; i < layout->num_slots; i++) {
+				size_t len = strlen(out->prefix[i]);
+				if (isnan(values[i * stride + s]))
+					continue;
+				memcpy(p, out->prefix[i], len);
+				p += len;
+				p += format_fixed(p, values[i * stride + s], prec, 0);
+				memcpy(p, "</value>", 8);
+				p += 8;
+			}
+			memcpy(p, "</scan>", 7);
+			p += 7;
+			break;
+
+		default:
+			for (i = 0; i < layout->num_slots; i++) {
+				char num[MAX_NUMBER_LEN];
+				unsigned len = 0;
+				if (!isnan(values[i * stride + s]))
+					len = format_fixed(num, values[i * stride + s], prec, 1);
+				if (len < 8) {
+					memset(p, ' ', 8 - len);
+					p += 8 - len;
+				}
+				memcpy(p, num, len);
+				p += len;
+				*p++ = ' ';
+			}
+			if (has_ts) {
+				*p++ = ' ';
+				p += format_int(p, timestamps[s]);
+			}
+			break;
+		}
+		*p++ = '\n';
+		out->len = p - out->buf;
+
+		if (reserve(out, 0) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/**
+ * iio_output_close: finish the document, flush and free the output
+ * Returns 0 on success and -1 if writing failed
+ */
+int iio_output_close(struct iio_output *out)
+{
+	int ret = 0;
+	unsigned i;
+
+	if (!out)
+		return 0;
+	if (out->buf) {
+		if (out->format == IIO_OUTPUT_XML)
+			put(out, "</capture>\n", 11);
+		ret = iio_output_flush(out);
+		free(out->buf);
+	}
+	if (out->prefix) {
+		for (i = 0; i < out->layout->num_slots; i++)
+			free(out->prefix[i]);
+		free(out->prefix);
+	}
+	free(out);
+	return ret;
+}
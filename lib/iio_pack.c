@@ -0,0 +1,338 @@
+/*
+ * Industrial I/O utilities - iio_pack.c
+ *
+ * Copyright (c) 2010 Manuel Stahl <manuel.stahl@iis.fraunhofer.de>
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+#include "iio.h"
+
+/*
+ * Lossless packing of decoded samples. A block of up to IIO_PACK_SCANS
+ * scans is a struct iio_pack_header followed by a bit stream that holds,
+ * for each slot in layout order:
+ *   6 bits   width w of the deltas, at most the bits of the element
+ *   bits     the first sample
+ *   w bits   for every further scan, the zigzag coded difference to the
+ *            scan before, taken modulo 2^bits so it always fits
+ * and then, if the scans have a timestamp:
+ *   64 bits  the first timestamp
+ *   7+w bits the zigzag coded difference to the second one
+ *   7+w*n    the zigzag coded change of that difference for the rest
+ * Bits are filled from the least significant end of 32 bit words in host
+ * byte order, like the rest of a capture. Blocks do not depend on each
+ * other. Bits of the storage word outside the sample are not kept.
+ */
+#define SLOT_WIDTH_BITS 6
+#define TS_WIDTH_BITS 7
+
+struct bit_writer {
+	uint64_t acc;
+	unsigned n;		/* bits in acc */
+	char *p;
+};
+
+struct bit_reader {
+	uint64_t acc;
+	unsigned n;
+	const char *p;
+	const char *end;
+	int overrun;
+};
+
+/* v must fit in bits. The low word is always stored and only kept
+ * once it is full, which saves a hard to predict branch; the writer may
+ * thus touch one word past the end of the data.
+ */
+static inline void put_bits(struct bit_writer *bw, uint32_t v, unsigned bits)
+{
+	uint32_t word;
+	unsigned full;
+
+	bw->acc |= (uint64_t)v << bw->n;
+	bw->n += bits;
+	word = (uint32_t)bw->acc;
+	memcpy(bw->p, &word, sizeof(word));
+	full = bw->n >> 5;
+	bw->p += full * sizeof(word);
+	bw->acc >>= full * 32;
+	bw->n -= full * 32;
+}
+
+static inline void put_bits64(struct bit_writer *bw, uint64_t v, unsigned bits)
+{
+	if (bits > 32) {
+		put_bits(bw, (uint32_t)v, 32);
+		put_bits(bw, (uint32_t)(v >> 32), bits - 32);
+	} else {
+		put_bits(bw, (uint32_t)v, bits);
+	}
+}
+
+static void flush_bits(struct bit_writer *bw)
+{
+	if (bw->n > 0) {
+		uint32_t word = (uint32_t)bw->acc;
+		memcpy(bw->p, &word, sizeof(word));
+		bw->p += sizeof(word);
+		bw->acc = 0;
+		bw->n = 0;
+	}
+}
+
+static inline uint32_t get_bits(struct bit_reader *br, unsigned bits)
+{
+	uint32_t v;
+
+	if (bits == 0)
+		return 0;
+	if (br->n < bits) {
+		uint32_t word = 0;
+		if (br->p + sizeof(word) <= br->end)
+			memcpy(&word, br->p, sizeof(word));
+		else
+			br->overrun = 1;
+		br->p += sizeof(word);
+		br->acc |= (uint64_t)word << br->n;
+		br->n += 32;
+	}
+	v = (uint32_t)br->acc & (0xffffffffu >> (32 - bits));
+	br->acc >>= bits;
+	br->n -= bits;
+	return v;
+}
+
+static inline uint64_t get_bits64(struct bit_reader *br, unsigned bits)
+{
+	uint64_t lo;
+
+	if (bits <= 32)
+		return get_bits(br, bits);
+	lo = get_bits(br, 32);
+	return lo | (uint64_t)get_bits(br, bits - 32) << 32;
+}
+
+static inline uint32_t zigzag(int32_t v)
+{
+	return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+static inline int32_t unzigzag(uint32_t v)
+{
+	return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+}
+
+static inline uint64_t zigzag64(int64_t v)
+{
+	return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t unzigzag64(uint64_t v)
+{
+	return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static inline unsigned width(uint64_t max)
+{
+	return max ? 64 - __builtin_clzll(max) : 0;
+}
+
+/* Change of the time between scans at scan s, s >= 2 */
+static inline uint64_t ts_change(const int64_t *ts, size_t s)
+{
+	return zigzag64((int64_t)(((uint64_t)ts[s] - (uint64_t)ts[s - 1]) -
+			((uint64_t)ts[s - 1] - (uint64_t)ts[s - 2])));
+}
+
+/* Difference of two samples of a slot, sign extended from slot->bits */
+static inline uint32_t slot_delta(const struct iio_scan_slot *slot,
+		int32_t cur, int32_t prev)
+{
+	const unsigned sh = 32 - slot->bits;
+	uint32_t d = ((uint32_t)cur - (uint32_t)prev) & slot->mask;
+	return zigzag((int32_t)(d << sh) >> sh);
+}
+
+/**
+ * iio_pack_bound: most bytes iio_pack_block() writes for nscans scans
+ */
+size_t iio_pack_bound(const struct iio_scan_layout *layout, size_t nscans)
+{
+	size_t bits = 0;
+	unsigned i;
+
+	for (i = 0; i < layout->num_slots; i++)
+		bits += SLOT_WIDTH_BITS + layout->slots[i].bits * nscans;
+	if (layout->ts_offset >= 0)
+		bits += 2 * TS_WIDTH_BITS + 64 * (nscans + 1);
+	/* one word more for put_bits() */
+	return sizeof(struct iio_pack_header) + (bits + 31) / 32 * 4 + 4;
+}
+
+/**
+ * iio_pack_block: pack a block of decoded scans
+ * @layout: table built by iio_scan_layout_new()
+ * @samples: samples as stored by iio_scan_decode()
+ * @stride: distance between two slots in @samples
+ * @timestamps: one per scan, only used if the scans have a timestamp
+ * @nscans: number of scans, 1 to IIO_PACK_SCANS
+ * @out: room for iio_pack_bound() bytes
+ * Returns the number of bytes written
+ */
+size_t iio_pack_block(const struct iio_scan_layout *layout,
+		const int32_t *samples, size_t stride, const int64_t *timestamps,
+		size_t nscans, char *out)
+{
+	struct iio_pack_header hdr;
+	struct bit_writer bw = { 0, 0, out + sizeof(hdr) };
+	uint32_t delta[IIO_PACK_SCANS];
+	size_t s;
+	unsigned i;
+
+	for (i = 0; i < layout->num_slots; i++) {
+		const struct iio_scan_slot *slot = &layout->slots[i];
+		const int32_t *in = samples + i * stride;
+		uint32_t max = 0;
+		unsigned w;
+
+		for (s = 1; s < nscans; s++) {
+			delta[s] = slot_delta(slot, in[s], in[s - 1]);
+			max |= delta[s];
+		}
+		w = width(max);
+
+		put_bits(&bw, w, SLOT_WIDTH_BITS);
+		put_bits(&bw, (uint32_t)in[0] & slot->mask, slot->bits);
+		for (s = 1; s < nscans; s++)
+			put_bits(&bw, delta[s], w);
+	}
+
+	if (layout->ts_offset >= 0) {
+		uint64_t max = 0, first = 0;
+		unsigned w;
+
+		put_bits64(&bw, (uint64_t)timestamps[0], 64);
+		if (nscans > 1)
+			first = zigzag64((int64_t)((uint64_t)timestamps[1] -
+					(uint64_t)timestamps[0]));
+		w = width(first);
+		put_bits(&bw, w, TS_WIDTH_BITS);
+		put_bits64(&bw, first, w);
+
+		for (s = 2; s < nscans; s++)
+			max |= ts_change(timestamps, s);
+		w = width(max);
+		put_bits(&bw, w, TS_WIDTH_BITS);
+		for (s = 2; s < nscans; s++)
+			put_bits64(&bw, ts_change(timestamps, s), w);
+	}
+	flush_bits(&bw);
+
+	hdr.size = bw.p - out - sizeof(hdr);
+	hdr.nscans = nscans;
+	memcpy(out, &hdr, sizeof(hdr));
+	return bw.p - out;
+}
+
+/**
+ * iio_unpack_block: restore a block written by iio_pack_block()
+ * @layout: the layout the block was packed with
+ * @in: the bit stream following the struct iio_pack_header
+ * @hdr: header of the block
+ * @samples: output, same arrangement as iio_scan_decode() uses
+ * @stride: distance between two slots in @samples, at least hdr->nscans
+ * @timestamps: output for one timestamp per scan, may be NULL
+ * Returns the number of scans restored and -1 on corrupt data
+ */
+ssize_t iio_unpack_block(const struct iio_scan_layout *layout, const char *in,
+		const struct iio_pack_header *hdr, int32_t *samples, size_t stride,
+		int64_t *timestamps)
+{
+	struct bit_reader br = { 0, 0, in, in + hdr->size, 0 };
+	const size_t nscans = hdr->nscans;
+	size_t s;
+	unsigned i;
+
+	if (nscans == 0 || nscans > IIO_PACK_SCANS || nscans > stride) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (i = 0; i < layout->num_slots; i++) {
+		const struct iio_scan_slot *slot = &layout->slots[i];
+		const unsigned sh = slot->is_signed ? 32 - slot->bits : 0;
+		int32_t *out = samples + i * stride;
+		unsigned w = get_bits(&br, SLOT_WIDTH_BITS);
+		uint32_t v;
+
+		if (w > slot->bits) {
+			errno = EINVAL;
+			return -1;
+		}
+		v = get_bits(&br, slot->bits);
+		out[0] = (int32_t)(v << sh) >> sh;
+		for (s = 1; s < nscans; s++) {
+			v = (v + unzigzag(get_bits(&br, w))) & slot->mask;
+			out[s] = (int32_t)(v << sh) >> sh;
+		}
+	}
+
+	if (layout->ts_offset >= 0) {
+		uint64_t ts, delta;
+		unsigned w;
+
+		ts = get_bits64(&br, 64);
+		w = get_bits(&br, TS_WIDTH_BITS);
+		if (w > 64) {
+			errno = EINVAL;
+			return -1;
+		}
+		delta = unzigzag64(get_bits64(&br, w));
+		if (timestamps)
+			timestamps[0] = ts;
+		w = get_bits(&br, TS_WIDTH_BITS);
+		if (w > 64) {
+			errno = EINVAL;
+			return -1;
+		}
+		for (s = 1; s < nscans; s++) {
+			if (s > 1)
+				delta += unzigzag64(get_bits64(&br, w));
+			ts += delta;
+			if (timestamps)
+				timestamps[s] = ts;
+		}
+	}
+
+	if (br.overrun) {
+		errno = EINVAL;
+		return -1;
+	}
+	return nscans;
+}
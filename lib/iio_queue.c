@@ -0,0 +1,144 @@
+/*
+ * Industrial I/O utilities - iio_queue.c
+ *
+ * Copyright (c) 2010 Manuel Stahl <manuel.stahl@iis.fraunhofer.de>
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#define _POSIX_C_SOURCE 200112L	/* posix_memalign() */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "iio.h"
+
+/*
+ * Single producer, single consumer ring of blocks. head and tail count
+ * up forever and are masked on use, so head - tail is the fill level.
+ * The producer publishes a block by a release store of head, the
+ * consumer gives it back by a release store of tail; no locks needed.
+ */
+#define load_acquire(p)		__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define store_release(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+/**
+ * iio_queue_new: allocate a block queue
+ * @depth: number of blocks, rounded up to a power of two; 2 to 2^31
+ * @block_size: size of each block in bytes
+ * Returns the queue on success and NULL on failure
+ */
+struct iio_queue *iio_queue_new(unsigned depth, size_t block_size)
+{
+	struct iio_queue *q;
+
+	/* a larger depth would round up to 0 */
+	if (depth < 2 || depth > 1u << 31 || block_size == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (posix_memalign((void **)&q, IIO_CACHE_LINE, sizeof(struct iio_queue)))
+		return NULL;
+	memset(q, 0, sizeof(struct iio_queue));
+	q->depth = next_power_of_two(depth);
+	q->block_size = block_size;
+	q->lengths = calloc(q->depth, sizeof(size_t));
+	if (!q->lengths ||
+			posix_memalign((void **)&q->blocks, IIO_CACHE_LINE,
+				q->depth * block_size)) {
+		iio_queue_free(q);
+		return NULL;
+	}
+	return q;
+}
+
+void iio_queue_free(struct iio_queue *q)
+{
+	if (q) {
+		free(q->blocks);
+		free(q->lengths);
+		free(q);
+	}
+}
+
+/**
+ * iio_queue_has_space: test for a free block, producer side
+ */
+int iio_queue_has_space(struct iio_queue *q)
+{
+	return q->head - load_acquire(&q->tail) < q->depth;
+}
+
+/**
+ * iio_queue_reserve: get the next free block, producer side
+ *
+ * The block is handed to the consumer by iio_queue_commit().
+ * Returns the block or NULL if the queue is full, which is counted
+ */
+char *iio_queue_reserve(struct iio_queue *q)
+{
+	if (!iio_queue_has_space(q)) {
+		q->full++;
+		return NULL;
+	}
+	return q->blocks + (q->head & (q->depth - 1)) * q->block_size;
+}
+
+/**
+ * iio_queue_commit: pass the reserved block on, producer side
+ * @len: bytes used in the block, 0 may serve as end marker
+ */
+void iio_queue_commit(struct iio_queue *q, size_t len)
+{
+	unsigned fill = q->head + 1 - load_acquire(&q->tail);
+
+	q->lengths[q->head & (q->depth - 1)] = len;
+	store_release(&q->head, q->head + 1);
+	if (fill > q->max_fill)
+		q->max_fill = fill;
+}
+
+/**
+ * iio_queue_peek: get the oldest queued block, consumer side
+ * @len: output, bytes used in the block
+ * Returns the block or NULL if the queue is empty
+ */
+const char *iio_queue_peek(struct iio_queue *q, size_t *len)
+{
+	unsigned i = q->tail & (q->depth - 1);
+
+	if (load_acquire(&q->head) == q->tail)
+		return NULL;
+	*len = q->lengths[i];
+	return q->blocks + i * q->block_size;
+}
+
+/**
+ * iio_queue_release: give the block from iio_queue_peek() back
+ */
+void iio_queue_release(struct iio_queue *q)
+{
+	store_release(&q->tail, q->tail + 1);
+}
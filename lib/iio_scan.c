@@ -0,0 +1,497 @@
+/*
+ * Industrial I/O utilities - iio_scan.c
+ *
+ * Copyright (c) 2010 Manuel Stahl <manuel.stahl@iis.fraunhofer.de>
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "iio.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define IIO_SCAN_X86
+#include <immintrin.h>
+#endif
+
+static inline int is_timestamp(const struct iio_scan_element *elem)
+{
+	const char *ts = strstr(elem->name, "timestamp");
+	return ts && ts[strlen("timestamp")] == '\0';
+}
+
+static int compare_slots(const void *a, const void *b)
+{
+	const struct iio_scan_slot *sa = a, *sb = b;
+	return (int)sa->elem->index - (int)sb->elem->index;
+}
+
+static inline unsigned align(unsigned offset, unsigned bytes)
+{
+	return (offset + bytes - 1) & ~(bytes - 1);
+}
+
+/* Place the slots one after the other in their order, each aligned to
+ * its own storage size, and the timestamp last, aligned to 8 bytes.
+ * Returns the scan size.
+ */
+static unsigned place_slots(struct iio_scan_layout *layout, int has_timestamp)
+{
+	unsigned offset = 0, max_bytes = 1, i;
+
+	for (i = 0; i < layout->num_slots; i++) {
+		struct iio_scan_slot *slot = &layout->slots[i];
+		offset = align(offset, slot->bytes);
+		slot->offset = offset;
+		offset += slot->bytes;
+		if (slot->bytes > max_bytes)
+			max_bytes = slot->bytes;
+	}
+
+	layout->ts_offset = -1;
+	if (has_timestamp) {
+		offset = align(offset, sizeof(int64_t));
+		layout->ts_offset = offset;
+		offset += sizeof(int64_t);
+		max_bytes = sizeof(int64_t);
+	}
+
+	return align(offset, max_bytes);
+}
+
+/**
+ * iio_scan_layout_new: build the decoding table for a ring buffer scan
+ * @scan_elements: dlist of struct iio_scan_element, as returned by
+ * iio_get_ring_buffer_scan_elements(). It must stay valid as long as the
+ * layout is used.
+ *
+ * Enabled elements are placed in index order, each aligned to its own
+ * storage size; the timestamp comes last, aligned to 8 bytes. Elements
+ * stored in the other byte order than the host's are refused.
+ * Returns the layout on success and NULL on failure
+ */
+struct iio_scan_layout *iio_scan_layout_new(struct dlist *scan_elements)
+{
+	struct iio_scan_layout *layout;
+	struct iio_scan_element *elem;
+	const struct iio_scan_element *ts_elem = NULL;
+	unsigned count = 0;
+
+	if (!scan_elements) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	dlist_for_each_data(scan_elements, elem, struct iio_scan_element)
+		if (elem->enabled > 0)
+			count++;
+
+	layout = calloc(1, sizeof(struct iio_scan_layout) +
+			count * sizeof(struct iio_scan_slot));
+	if (!layout) {
+		fprintf(stderr, "Could not allocate scan layout\n");
+		return NULL;
+	}
+
+	dlist_for_each_data(scan_elements, elem, struct iio_scan_element) {
+		struct iio_scan_slot *slot;
+
+		if (elem->enabled <= 0)
+			continue;
+		/* samples are decoded in host byte order */
+		if (elem->big_endian != (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)) {
+			fprintf(stderr, "Unsupported byte order of %s\n", elem->name);
+			free(layout);
+			return NULL;
+		}
+		if (is_timestamp(elem)) {
+			ts_elem = elem;
+			continue;
+		}
+		if (elem->storagebits != 8 && elem->storagebits != 16 &&
+				elem->storagebits != 32) {
+			fprintf(stderr, "Unsupported storage size %u of %s\n",
+					elem->storagebits, elem->name);
+			free(layout);
+			return NULL;
+		}
+		if (elem->bits == 0 || elem->bits + elem->shift > elem->storagebits) {
+			fprintf(stderr, "Invalid bit width %u of %s\n",
+					elem->bits, elem->name);
+			free(layout);
+			return NULL;
+		}
+
+		slot = &layout->slots[layout->num_slots++];
+		slot->elem = elem;
+		slot->bytes = elem->storagebits / 8;
+		slot->shift = elem->shift;
+		slot->bits = elem->bits;
+		slot->mask = elem->bits == 32 ? 0xffffffff : (1u << elem->bits) - 1;
+		slot->is_signed = elem->is_signed;
+		slot->scale = elem->channel ? iio_channel_scale(elem->channel) : 1.0f;
+		slot->value_offset = elem->channel ? iio_channel_offset(elem->channel) : 0.0f;
+	}
+
+	qsort(layout->slots, layout->num_slots, sizeof(struct iio_scan_slot),
+			compare_slots);
+
+	layout->scan_size = place_slots(layout, ts_elem != NULL);
+	if (layout->scan_size == 0) {
+		fprintf(stderr, "No scan elements enabled\n");
+		free(layout);
+		return NULL;
+	}
+	return layout;
+}
+
+/**
+ * iio_scan_layout_select: layout of a part of the slots of another one
+ * @layout: table built by iio_scan_layout_new()
+ * @names: interned names of scan elements or of their channels, NULL
+ * for a name that was never interned, it matches nothing
+ * @num_names: number of @names, 0 selects every slot
+ * @map: output, for each slot of the new layout the slot of @layout it
+ * takes its samples from; room for layout->num_slots entries
+ *
+ * The slots keep their order and are packed as iio_scan_layout_new()
+ * would, the timestamp is always kept.
+ * Returns the layout on success and NULL on failure
+ */
+struct iio_scan_layout *iio_scan_layout_select(const struct iio_scan_layout *layout,
+		const char *const *names, unsigned num_names, unsigned *map)
+{
+	struct iio_scan_layout *sel;
+	unsigned i, j;
+
+	for (j = 0; j < num_names; j++) {
+		for (i = 0; i < layout->num_slots; i++) {
+			const struct iio_scan_element *elem = layout->slots[i].elem;
+			if (names[j] == elem->name ||
+					(elem->channel && names[j] == elem->channel->name))
+				break;
+		}
+		if (i == layout->num_slots) {
+			if (names[j])
+				fprintf(stderr, "No scan element %s\n", names[j]);
+			errno = EINVAL;
+			return NULL;
+		}
+	}
+
+	sel = calloc(1, sizeof(struct iio_scan_layout) +
+			layout->num_slots * sizeof(struct iio_scan_slot));
+	if (!sel) {
+		fprintf(stderr, "Could not allocate scan layout\n");
+		return NULL;
+	}
+	for (i = 0; i < layout->num_slots; i++) {
+		const struct iio_scan_element *elem = layout->slots[i].elem;
+
+		for (j = 0; j < num_names; j++)
+			if (names[j] == elem->name ||
+					(elem->channel && names[j] == elem->channel->name))
+				break;
+		if (num_names && j == num_names)
+			continue;
+		map[sel->num_slots] = i;
+		sel->slots[sel->num_slots++] = layout->slots[i];
+	}
+	sel->scan_size = place_slots(sel, layout->ts_offset >= 0);
+	return sel;
+}
+
+void iio_scan_layout_free(struct iio_scan_layout *layout)
+{
+	free(layout);
+}
+
+#define DECODE_SLOT(type) \
+	for (s = 0; s < nscans; s++, src += layout->scan_size) { \
+		type v; \
+		memcpy(&v, src, sizeof(type)); \
+		out[s] = ((uint32_t)v >> slot->shift) & slot->mask; \
+	}
+
+/**
+ * iio_scan_decode: extract all samples of a block of scans
+ * @layout: table built by iio_scan_layout_new()
+ * @data: raw bytes as read from the ring access device
+ * @len: number of bytes in @data, trailing partial scans are ignored
+ * @samples: output, sample s of slot i is stored at samples[i * stride + s]
+ * @stride: distance between two slots in @samples, at least len / scan_size
+ * @timestamps: output for one timestamp per scan, may be NULL
+ *
+ * Signed samples are sign extended to 32 bit.
+ * Returns the number of scans decoded
+ */
+size_t iio_scan_decode(const struct iio_scan_layout *layout, const char *data,
+		size_t len, int32_t *samples, size_t stride, int64_t *timestamps)
+{
+	size_t nscans = len / layout->scan_size, s;
+	unsigned i;
+
+	if (nscans > stride)
+		nscans = stride;
+
+	for (i = 0; i < layout->num_slots; i++) {
+		const struct iio_scan_slot *slot = &layout->slots[i];
+		const char *src = data + slot->offset;
+		int32_t *out = samples + i * stride;
+
+		switch (slot->bytes) {
+		case 1:
+			DECODE_SLOT(uint8_t);
+			break;
+		case 2:
+			DECODE_SLOT(uint16_t);
+			break;
+		default:
+			DECODE_SLOT(uint32_t);
+			break;
+		}
+
+		if (slot->is_signed && slot->bits < 32) {
+			unsigned sh = 32 - slot->bits;
+			for (s = 0; s < nscans; s++)
+				out[s] = (int32_t)((uint32_t)out[s] << sh) >> sh;
+		}
+	}
+
+	if (timestamps && layout->ts_offset >= 0) {
+		const char *src = data + layout->ts_offset;
+		for (s = 0; s < nscans; s++, src += layout->scan_size)
+			memcpy(&timestamps[s], src, sizeof(int64_t));
+	}
+
+	return nscans;
+}
+
+#define ENCODE_SLOT(type) \
+	for (s = 0; s < nscans; s++, dst += layout->scan_size) { \
+		type v = ((uint32_t)in[s] & slot->mask) << slot->shift; \
+		memcpy(dst, &v, sizeof(type)); \
+	}
+
+/**
+ * iio_scan_encode: build raw scans from samples, the reverse of
+ * iio_scan_decode()
+ * @layout: table built by iio_scan_layout_new()
+ * @samples: sample s of slot i is taken from samples[i * stride + s]
+ * @stride: distance between two slots in @samples
+ * @timestamps: one timestamp per scan, may be NULL
+ * @nscans: number of scans
+ * @data: output, room for nscans * scan_size bytes
+ *
+ * Padding and the bits around each sample are cleared.
+ */
+void iio_scan_encode(const struct iio_scan_layout *layout, const int32_t *samples,
+		size_t stride, const int64_t *timestamps, size_t nscans, char *data)
+{
+	size_t s;
+	unsigned i;
+
+	memset(data, 0, nscans * layout->scan_size);
+	for (i = 0; i < layout->num_slots; i++) {
+		const struct iio_scan_slot *slot = &layout->slots[i];
+		const int32_t *in = samples + i * stride;
+		char *dst = data + slot->offset;
+
+		switch (slot->bytes) {
+		case 1:
+			ENCODE_SLOT(uint8_t);
+			break;
+		case 2:
+			ENCODE_SLOT(uint16_t);
+			break;
+		default:
+			ENCODE_SLOT(uint32_t);
+			break;
+		}
+	}
+
+	if (timestamps && layout->ts_offset >= 0) {
+		char *dst = data + layout->ts_offset;
+		for (s = 0; s < nscans; s++, dst += layout->scan_size)
+			memcpy(dst, &timestamps[s], sizeof(int64_t));
+	}
+}
+
+/*
+ * Conversion of decoded samples to engineering units:
+ *   value = (sign_extend(raw) + offset) * scale
+ * Sign extension by shifting left and back is a no-op on samples that
+ * are already extended, so the kernels accept both. All variants do the
+ * same float operations in the same order and give identical results.
+ */
+typedef void (*convert_fn)(const int32_t *raw, float *out, size_t n,
+		unsigned sh, float scale, float offset);
+
+static void convert_scalar(const int32_t *raw, float *out, size_t n,
+		unsigned sh, float scale, float offset)
+{
+	size_t i;
+	for (i = 0; i < n; i++) {
+		int32_t v = (int32_t)((uint32_t)raw[i] << sh) >> sh;
+		out[i] = ((float)v + offset) * scale;
+	}
+}
+
+#ifdef IIO_SCAN_X86
+__attribute__((target("sse2")))
+static void convert_sse2(const int32_t *raw, float *out, size_t n,
+		unsigned sh, float scale, float offset)
+{
+	const __m128i cnt = _mm_cvtsi32_si128(sh);
+	const __m128 sc = _mm_set1_ps(scale);
+	const __m128 off = _mm_set1_ps(offset);
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(raw + i));
+		x = _mm_sra_epi32(_mm_sll_epi32(x, cnt), cnt);
+		_mm_storeu_ps(out + i,
+				_mm_mul_ps(_mm_add_ps(_mm_cvtepi32_ps(x), off), sc));
+	}
+	convert_scalar(raw + i, out + i, n - i, sh, scale, offset);
+}
+
+__attribute__((target("avx2")))
+static void convert_avx2(const int32_t *raw, float *out, size_t n,
+		unsigned sh, float scale, float offset)
+{
+	const __m128i cnt = _mm_cvtsi32_si128(sh);
+	const __m256 sc = _mm256_set1_ps(scale);
+	const __m256 off = _mm256_set1_ps(offset);
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)(raw + i));
+		x = _mm256_sra_epi32(_mm256_sll_epi32(x, cnt), cnt);
+		_mm256_storeu_ps(out + i,
+				_mm256_mul_ps(_mm256_add_ps(_mm256_cvtepi32_ps(x), off), sc));
+	}
+	convert_sse2(raw + i, out + i, n - i, sh, scale, offset);
+}
+#endif
+
+static struct {
+	convert_fn fn;
+	const char *name;
+} converter;
+static pthread_once_t converter_once = PTHREAD_ONCE_INIT;
+
+/* Install the kernel called name if the CPU runs it */
+static int use_converter(const char *name)
+{
+#ifdef IIO_SCAN_X86
+	__builtin_cpu_init();
+	if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+		converter.name = "avx2";
+		converter.fn = convert_avx2;
+		return 0;
+	}
+	if (strcmp(name, "sse2") == 0 && __builtin_cpu_supports("sse2")) {
+		converter.name = "sse2";
+		converter.fn = convert_sse2;
+		return 0;
+	}
+#endif
+	if (strcmp(name, "scalar") == 0) {
+		converter.name = "scalar";
+		converter.fn = convert_scalar;
+		return 0;
+	}
+	return -1;
+}
+
+static void select_converter(void)
+{
+	if (use_converter("avx2") < 0 && use_converter("sse2") < 0)
+		use_converter("scalar");
+}
+
+/**
+ * iio_scan_convert_use: replace the conversion kernel
+ * @name: "avx2", "sse2" or "scalar"
+ *
+ * For comparing the kernels; no other thread may convert meanwhile.
+ * Returns 0 on success and -1 with ENOTSUP if the CPU lacks the kernel
+ */
+int iio_scan_convert_use(const char *name)
+{
+	pthread_once(&converter_once, select_converter);
+	if (use_converter(name) < 0) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * iio_scan_convert_name: name of the conversion kernel in use
+ */
+const char *iio_scan_convert_name(void)
+{
+	pthread_once(&converter_once, select_converter);
+	return converter.name;
+}
+
+/**
+ * iio_scan_convert: scale a block of decoded samples
+ * @layout: table built by iio_scan_layout_new()
+ * @samples: raw samples as stored by iio_scan_decode()
+ * @values: output, same arrangement as @samples
+ * @stride: distance between two slots in @samples and @values
+ * @nscans: number of scans to convert
+ *
+ * The fastest kernel supported by the CPU is picked on first use.
+ */
+void iio_scan_convert(const struct iio_scan_layout *layout,
+		const int32_t *samples, float *values, size_t stride, size_t nscans)
+{
+	unsigned i;
+
+	pthread_once(&converter_once, select_converter);
+
+	for (i = 0; i < layout->num_slots; i++) {
+		const struct iio_scan_slot *slot = &layout->slots[i];
+		const int32_t *raw = samples + i * stride;
+		float *out = values + i * stride;
+
+		if (!slot->is_signed && slot->bits == 32) {
+			/* does not fit the signed integer conversion */
+			size_t s;
+			for (s = 0; s < nscans; s++)
+				out[s] = ((float)(uint32_t)raw[s] + slot->value_offset) *
+						slot->scale;
+			continue;
+		}
+		converter.fn(raw, out, nscans, slot->is_signed ? 32 - slot->bits : 0,
+				slot->scale, slot->value_offset);
+	}
+}
@@ -0,0 +1,210 @@
+/*
+ * Industrial I/O utilities - iio_serve.c
+ *
+ * Copyright (c) 2010 Manuel Stahl <manuel.stahl@iis.fraunhofer.de>
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "iio.h"
+
+/*
+ * Protocol between a server of ring data and its clients, over a Unix
+ * stream socket. The client sends one line
+ *   <device> <scans per frame> [<element>[,<element>...]]
+ * naming scan elements or their channels, none for all of them. The
+ * server answers with a capture header of the requested elements, see
+ * iio_capture_write_header(), or with a line "ERR <reason>" and closes
+ * the connection. Then follow frames: a struct iio_serve_frame and
+ * nscans raw scans in the layout of that header. A server that has to
+ * drop scans for a slow client says so in the next frame.
+ */
+
+static int read_all(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	while (len > 0) {
+		ssize_t ret = read(fd, p, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		p += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/**
+ * iio_serve_parse_request: read the request line of a client
+ * @line: the line without its newline
+ * @req: output, the interned names; names that were never interned, and
+ * so cannot name a device or scan element, are NULL
+ *
+ * The line comes from a client, so nothing is added to the string pool.
+ * Returns 0 on success and -1 on an invalid request
+ */
+int iio_serve_parse_request(const char *line, struct iio_serve_request *req)
+{
+	const char *p, *end;
+	char *stop;
+	unsigned long block;
+	size_t len;
+
+	memset(req, 0, sizeof(*req));
+	len = strcspn(line, " ");
+	if (len == 0 || len >= SYSFS_NAME_LEN)
+		goto err_inval;
+	req->device = iio_intern_find(line, len);
+
+	p = line + len;
+	if (*p++ != ' ' || *p < '0' || *p > '9')
+		goto err_inval;
+	block = strtoul(p, &stop, 10);
+	if (block == 0 || block > IIO_SERVE_MAX_BLOCK ||
+			(*stop != ' ' && *stop != '\0'))
+		goto err_inval;
+	req->block = block;
+
+	/* names are separated by single commas, nothing may follow */
+	for (p = stop; *p; p = end) {
+		p++;
+		end = p + strcspn(p, ", ");
+		if (end == p || *end == ' ' || end - p >= SYSFS_NAME_LEN ||
+				req->num_elements == IIO_SERVE_MAX_ELEMENTS)
+			goto err_inval;
+		req->elements[req->num_elements++] = iio_intern_find(p, end - p);
+	}
+	return 0;
+
+err_inval:
+	errno = EINVAL;
+	return -1;
+}
+
+/**
+ * iio_serve_connect: ask a server for the scans of a device
+ * @path: Unix socket of the server
+ * @req: what to ask for
+ *
+ * Read the frames with iio_serve_read_frame().
+ * Returns the stream on success and NULL on failure
+ */
+struct iio_capture *iio_serve_connect(const char *path,
+		const struct iio_serve_request *req)
+{
+	struct sockaddr_un addr;
+	char line[IIO_SERVE_REQUEST_MAX], reply[4];
+	size_t len;
+	unsigned i;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "%s: socket path too long\n", path);
+		return NULL;
+	}
+	strcpy(addr.sun_path, path);
+
+	len = snprintf(line, sizeof(line), "%s %u", req->device, req->block);
+	for (i = 0; i < req->num_elements && len < sizeof(line); i++)
+		len += snprintf(line + len, sizeof(line) - len, "%c%s",
+				i ? ',' : ' ', req->elements[i]);
+	if (len + 1 >= sizeof(line)) {
+		fprintf(stderr, "Request too long\n");
+		return NULL;
+	}
+	line[len++] = '\n';
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+			iio_capture_write_block(fd, line, len) < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+
+	/* a refusal is a line of text instead of a capture header */
+	while ((len = recv(fd, reply, sizeof(reply), MSG_PEEK | MSG_WAITALL)) ==
+			(size_t)-1 && errno == EINTR)
+		;
+	if (len == sizeof(reply) && memcmp(reply, "ERR ", sizeof(reply)) == 0) {
+		len = 0;
+		while (len < sizeof(line) - 1 && read(fd, line + len, 1) == 1 &&
+				line[len] != '\n')
+			len++;
+		line[len] = '\0';
+		fprintf(stderr, "%s: %s\n", path, line + sizeof(reply));
+		close(fd);
+		return NULL;
+	}
+	return iio_capture_open_fd(fd, path);
+}
+
+/**
+ * iio_serve_read_frame: read the next frame from a server
+ * @cap: stream from iio_serve_connect()
+ * @data: output for the raw scans
+ * @max_scans: room in @data, in scans
+ * @dropped: output, scans the server dropped before this frame
+ * Returns the number of scans read, 0 when the server closed the
+ * connection and -1 on failure
+ */
+ssize_t iio_serve_read_frame(struct iio_capture *cap, char *data,
+		size_t max_scans, unsigned long *dropped)
+{
+	struct iio_serve_frame frame;
+	ssize_t len;
+
+	do
+		len = read(cap->fd, &frame, sizeof(frame));
+	while (len < 0 && errno == EINTR);
+	if (len == 0)
+		return 0;
+	if (len < 0)
+		return -1;
+	if ((size_t)len < sizeof(frame) && read_all(cap->fd, (char *)&frame + len,
+			sizeof(frame) - len))
+		goto err_corrupt;
+
+	if (frame.nscans == 0 || frame.nscans > max_scans ||
+			read_all(cap->fd, data, frame.nscans * cap->layout->scan_size))
+		goto err_corrupt;
+	*dropped = frame.dropped;
+	return frame.nscans;
+
+err_corrupt:
+	errno = EINVAL;
+	return -1;
+}
@@ -0,0 +1,389 @@
+/*
+ * Industrial I/O utilities - iio_setup.c
+ *
+ * Copyright (c) 2010 Manuel Stahl <manuel.stahl@iis.fraunhofer.de>
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <fcntl.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/vfs.h>
+
+#include "iio.h"
+
+#ifndef SYSFS_MAGIC
+#define SYSFS_MAGIC 0x62656572
+#endif
+
+#define fail_return(msg...) { fprintf(stderr, msg); return -1; }
+
+/*
+ * Capture configuration of a device: trigger, enabled scan elements,
+ * ring length and ring enable. All attribute files are opened once by
+ * iio_setup_open() and the state is read then. iio_setup_apply() only
+ * writes what changes, each with one pwrite() and one pread() to check
+ * the value stuck, and turns the ring off first when anything else has
+ * to change. The first value that does not stick undoes the
+ * attributes written before.
+ */
+
+static int open_attr(const char *dir, const char *name)
+{
+	char path[SYSFS_PATH_MAX];
+
+	if (snprintf(path, sizeof(path), "%s/%s", dir, name) >= (int)sizeof(path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	return open(path, O_RDWR | O_CLOEXEC);
+}
+
+/* Read the value at offset 0, which makes sysfs show it anew. The
+ * trailing newline is dropped.
+ */
+static int load(int fd, char *buf, size_t size)
+{
+	ssize_t len = pread(fd, buf, size - 1, 0);
+
+	if (len < 0)
+		return -1;
+	while (len > 0 && (buf[len - 1] == '\n' || buf[len - 1] == ' '))
+		len--;
+	buf[len] = '\0';
+	return 0;
+}
+
+static int load_int(int fd, int *val)
+{
+	char buf[32];
+
+	if (load(fd, buf, sizeof(buf)) < 0 || sscanf(buf, "%d", val) != 1)
+		return -1;
+	return 0;
+}
+
+/* Plain files, as iio_sim makes them, are cut to the new value */
+static int put(const struct iio_setup *setup, int fd, const char *value)
+{
+	const size_t len = strlen(value);
+
+	if (pwrite(fd, value, len, 0) != (ssize_t)len ||
+			(setup->truncate && ftruncate(fd, len) < 0))
+		return -1;
+	return 0;
+}
+
+/* Write val and read back what the attribute holds now into now.
+ * Returns 0 if the value stuck
+ */
+static int store_int(const struct iio_setup *setup, int fd, int val, int *now)
+{
+	char value[32];
+	int ret;
+
+	snprintf(value, sizeof(value), "%d", val);
+	ret = put(setup, fd, value);
+	if (load_int(fd, now) < 0 || ret < 0)
+		return -1;
+	if (*now != val) {
+		errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+
+static int set_enable(struct iio_setup *setup, int on)
+{
+	if (store_int(setup, setup->enable_fd, on, &setup->enabled) < 0)
+		fail_return("Failed to %s the ring buffer\n",
+				on ? "enable" : "disable");
+	return 0;
+}
+
+static int set_length(struct iio_setup *setup, unsigned length)
+{
+	int now = setup->length;
+
+	if (store_int(setup, setup->length_fd, length, &now) < 0) {
+		setup->length = now;
+		fail_return("Failed to set the ring length to %u\n", length);
+	}
+	setup->length = now;
+	return 0;
+}
+
+static int set_trigger(struct iio_setup *setup, const char *trigger)
+{
+	int ret = put(setup, setup->trigger_fd, trigger);
+
+	if (load(setup->trigger_fd, setup->trigger, sizeof(setup->trigger)) < 0 ||
+			ret < 0)
+		fail_return("Failed to set trigger %s\n", trigger);
+	if (strcmp(setup->trigger, trigger)) {
+		errno = EIO;
+		fail_return("Failed to set trigger %s\n", trigger);
+	}
+	return 0;
+}
+
+static int set_element(const struct iio_setup *setup,
+		struct iio_setup_element *e, int on)
+{
+	int now = e->elem->enabled;
+
+	if (store_int(setup, e->fd, on, &now) < 0) {
+		e->elem->enabled = now;
+		fail_return("Failed to %s scan element %s\n",
+				on ? "enable" : "disable", e->elem->name);
+	}
+	e->elem->enabled = now;
+	return 0;
+}
+
+/* name is interned, of the element or of its channel */
+static int matches(const struct iio_scan_element *elem, const char *name)
+{
+	return name == elem->name || (elem->channel && name == elem->channel->name);
+}
+
+static int selected(const struct iio_setup_config *config,
+		const struct iio_scan_element *elem)
+{
+	unsigned j;
+
+	for (j = 0; j < config->num_elements; j++)
+		if (matches(elem, config->elements[j]))
+			return 1;
+	return 0;
+}
+
+/* State an element is to be in: on if named, the timestamp as it was */
+static int wanted(const struct iio_setup_config *config,
+		const struct iio_setup_element *e)
+{
+	const size_t len = strlen(e->elem->name);
+
+	if (selected(config, e->elem))
+		return 1;
+	if (len >= 9 && strcmp(e->elem->name + len - 9, "timestamp") == 0)
+		return e->old;
+	return 0;
+}
+
+/**
+ * iio_setup_open: open the capture attributes of a ring buffer
+ * @buffer: the ring buffer
+ * @scan_elements: list from iio_get_ring_buffer_scan_elements(), it is
+ * kept up to date by iio_setup_apply() and must outlive the setup
+ * Returns the setup on success and NULL on failure, errno is ENAMETOOLONG
+ * if an attribute path does not fit SYSFS_PATH_MAX
+ */
+struct iio_setup *iio_setup_open(struct iio_ring_buffer *buffer,
+		struct dlist *scan_elements)
+{
+	char dir[SYSFS_PATH_MAX];
+	struct iio_scan_element *elem;
+	struct iio_setup *setup;
+	struct statfs fs;
+	unsigned n = 0;
+	int val;
+
+	dlist_for_each_data(scan_elements, elem, struct iio_scan_element)
+		n++;
+	setup = calloc(1, sizeof(struct iio_setup) +
+			n * sizeof(struct iio_setup_element));
+	if (!setup) {
+		fprintf(stderr, "Could not allocate device setup\n");
+		return NULL;
+	}
+	setup->trigger_fd = -1;
+
+	setup->length_fd = open_attr(buffer->path, "length");
+	setup->enable_fd = open_attr(buffer->path, "ring_enable");
+	if (setup->length_fd < 0 || setup->enable_fd < 0) {
+		fprintf(stderr, "%s: %s\n", buffer->path, strerror(errno));
+		goto err_close;
+	}
+	setup->truncate = fstatfs(setup->enable_fd, &fs) == 0 &&
+		fs.f_type != SYSFS_MAGIC;
+	if (load_int(setup->length_fd, &val) < 0 ||
+			load_int(setup->enable_fd, &setup->enabled) < 0) {
+		fprintf(stderr, "%s: unreadable ring state\n", buffer->path);
+		goto err_close;
+	}
+	setup->length = val;
+
+	if (snprintf(dir, sizeof(dir), "%s/trigger", buffer->device->path) >=
+			(int)sizeof(dir))
+		goto err_path;
+	/* not every device has a trigger */
+	setup->trigger_fd = open_attr(dir, "current_trigger");
+	if (setup->trigger_fd < 0 && errno == ENAMETOOLONG)
+		goto err_path;
+	if (setup->trigger_fd >= 0 &&
+			load(setup->trigger_fd, setup->trigger, sizeof(setup->trigger)) < 0) {
+		close(setup->trigger_fd);
+		setup->trigger_fd = -1;
+	}
+
+	if (snprintf(dir, sizeof(dir), "%s/scan_elements", buffer->device->path) >=
+			(int)sizeof(dir))
+		goto err_path;
+	dlist_for_each_data(scan_elements, elem, struct iio_scan_element) {
+		struct iio_setup_element *e = &setup->elements[setup->num_elements];
+		char name[SYSFS_NAME_LEN];
+
+		if (snprintf(name, sizeof(name), "%s_en", elem->name) >=
+				(int)sizeof(name))
+			goto err_path;
+		e->elem = elem;
+		e->fd = open_attr(dir, name);
+		if (e->fd < 0) {
+			fprintf(stderr, "%s/%s: %s\n", dir, name, strerror(errno));
+			goto err_close;
+		}
+		setup->num_elements++;
+	}
+	return setup;
+
+err_path:
+	fprintf(stderr, "%s: %s\n", buffer->device->path, strerror(ENAMETOOLONG));
+	iio_setup_close(setup);
+	errno = ENAMETOOLONG;
+	return NULL;
+
+err_close:
+	iio_setup_close(setup);
+	return NULL;
+}
+
+void iio_setup_close(struct iio_setup *setup)
+{
+	unsigned i;
+
+	if (!setup)
+		return;
+	for (i = 0; i < setup->num_elements; i++)
+		close(setup->elements[i].fd);
+	if (setup->trigger_fd >= 0)
+		close(setup->trigger_fd);
+	if (setup->length_fd >= 0)
+		close(setup->length_fd);
+	if (setup->enable_fd >= 0)
+		close(setup->enable_fd);
+	free(setup);
+}
+
+/**
+ * iio_setup_apply: bring the device into a capture configuration
+ * @setup: from iio_setup_open()
+ * @config: what to change
+ *
+ * On failure the attributes written are set back to their values from
+ * before the call, as far as the device lets them.
+ * Returns 0 on success and -1 on failure
+ */
+int iio_setup_apply(struct iio_setup *setup, const struct iio_setup_config *config)
+{
+	char old_trigger[SYSFS_NAME_LEN];
+	const unsigned old_length = setup->length;
+	const int old_enabled = setup->enabled;
+	int change = 0, err;
+	unsigned i, j;
+
+	/* check the whole request before the first write */
+	if (config->trigger && setup->trigger_fd < 0) {
+		fprintf(stderr, "Device has no trigger\n");
+		errno = ENOENT;
+		return -1;
+	}
+	if (config->trigger && strlen(config->trigger) >= SYSFS_NAME_LEN) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (j = 0; j < config->num_elements; j++) {
+		for (i = 0; i < setup->num_elements; i++)
+			if (matches(setup->elements[i].elem, config->elements[j]))
+				break;
+		if (i == setup->num_elements) {
+			fprintf(stderr, "No scan element %s\n", config->elements[j]);
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	strcpy(old_trigger, setup->trigger);
+	for (i = 0; i < setup->num_elements; i++) {
+		struct iio_setup_element *e = &setup->elements[i];
+		e->old = e->elem->enabled > 0;
+		if (config->num_elements && wanted(config, e) != e->old)
+			change = 1;
+	}
+	if (config->trigger && strcmp(config->trigger, setup->trigger))
+		change = 1;
+	if (config->length && config->length != setup->length)
+		change = 1;
+
+	/* the ring is only reconfigured while it is off */
+	if (setup->enabled && (change || !config->enable) && set_enable(setup, 0) < 0)
+		goto err_rollback;
+	if (config->trigger && strcmp(config->trigger, setup->trigger) &&
+			set_trigger(setup, config->trigger) < 0)
+		goto err_rollback;
+	for (i = 0; config->num_elements && i < setup->num_elements; i++) {
+		struct iio_setup_element *e = &setup->elements[i];
+		int on = wanted(config, e);
+		if ((e->elem->enabled > 0) != on && set_element(setup, e, on) < 0)
+			goto err_rollback;
+	}
+	if (config->length && config->length != setup->length &&
+			set_length(setup, config->length) < 0)
+		goto err_rollback;
+	if (config->enable && !setup->enabled && set_enable(setup, 1) < 0)
+		goto err_rollback;
+	return 0;
+
+err_rollback:
+	err = errno;
+	if (setup->enabled)
+		set_enable(setup, 0);
+	for (i = 0; i < setup->num_elements; i++) {
+		struct iio_setup_element *e = &setup->elements[i];
+		if ((e->elem->enabled > 0) != e->old)
+			set_element(setup, e, e->old);
+	}
+	if (setup->length != old_length)
+		set_length(setup, old_length);
+	if (setup->trigger_fd >= 0 && strcmp(setup->trigger, old_trigger))
+		set_trigger(setup, old_trigger);
+	if (old_enabled && !setup->enabled)
+		set_enable(setup, 1);
+	errno = err;
+	return -1;
+}
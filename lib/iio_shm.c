@@ -0,0 +1,490 @@
+/*
+ * Industrial I/O utilities - iio_shm.c
+ *
+ * Copyright (c) 2010 Manuel Stahl <manuel.stahl@iis.fraunhofer.de>
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <fcntl.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "iio.h"
+
+/*
+ * Shared memory ring of decoded scans, one writer and any number of
+ * readers. The segment starts with a struct iio_shm_header and the
+ * scan layout, followed by capacity records, see struct iio_shm_record.
+ *
+ * Every record has its own sequence number, a seqlock: the writer of
+ * scan n sets it to 2n + 1, fills in the record and sets it to 2n + 2.
+ * A reader copies the record and only keeps the copy if the number was
+ * 2n + 2 before and after, otherwise the writer has lapped it. Readers
+ * never write to the records, so they can not hold up the writer or
+ * each other; one that falls behind by more than the capacity loses
+ * scans and is told so.
+ *
+ * Readers that have nothing to do sleep on a futex. Like the doorbells
+ * of iio_ring, the writer only makes the wake-up call if the waiters
+ * count says someone is asleep.
+ */
+#define IIO_SHM_MAGIC		"IIOSHM\r\n"
+#define IIO_SHM_VERSION		1
+#define IIO_SHM_BYTE_ORDER	0x01020304
+
+struct iio_shm_slot {
+	char name[SYSFS_NAME_LEN];
+	uint32_t index;
+	uint32_t bits;
+	uint32_t storagebits;
+	uint32_t shift;
+	uint32_t is_signed;
+	uint32_t offset;
+	float scale;
+	float value_offset;
+};
+
+struct iio_shm_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t scan_size;
+	int32_t ts_offset;
+	uint32_t num_slots;
+	uint32_t capacity;	/* records, a power of two */
+	uint32_t record_size;
+	uint32_t data_offset;	/* of the first record */
+	char device[SYSFS_NAME_LEN];
+	/* written while publishing, away from the read-only part */
+	char pad0[IIO_CACHE_LINE];
+	uint64_t head;		/* number of scans published */
+	uint32_t wake;		/* futex, changes on every wake-up call */
+	uint32_t waiters;	/* readers sleeping on wake */
+	uint32_t closed;
+	char pad1[IIO_CACHE_LINE];
+	struct iio_shm_slot slots[];
+};
+
+struct iio_shm_record {
+	uint64_t seq;		/* 2n + 2 once scan n is complete */
+	int64_t timestamp;
+	int32_t samples[];
+};
+
+#define load_acquire(p)		__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define store_release(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+static inline size_t record_size(unsigned num_slots)
+{
+	return (sizeof(struct iio_shm_record) + num_slots * sizeof(int32_t) + 7) &
+		~(size_t)7;
+}
+
+static inline struct iio_shm_record *record(struct iio_shm_header *hdr,
+		uint64_t n)
+{
+	return (struct iio_shm_record *)((char *)hdr + hdr->data_offset +
+			(n & (hdr->capacity - 1)) * hdr->record_size);
+}
+
+static int futex(uint32_t *addr, int op, uint32_t val,
+		const struct timespec *timeout)
+{
+	return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+}
+
+static const char *shm_name(const char *name, char *buf, size_t size)
+{
+	if (name[0] == '/')
+		return name;
+	snprintf(buf, size, "/%s", name);
+	return buf;
+}
+
+/**
+ * iio_shm_create: create a shared memory ring and start publishing
+ * @name: POSIX shared memory name, a leading '/' is added if missing
+ * @device: name of the device the scans come from
+ * @layout: scan layout, as built by iio_scan_layout_new()
+ * @capacity: scans kept for the readers, rounded up to a power of two
+ *
+ * An existing segment of the same name is replaced. Names of
+ * SYSFS_NAME_LEN characters or more fail with ENAMETOOLONG.
+ * Returns the ring on success and NULL on failure
+ */
+struct iio_shm *iio_shm_create(const char *name, const char *device,
+		const struct iio_scan_layout *layout, unsigned capacity)
+{
+	char buf[SYSFS_PATH_MAX];
+	struct iio_shm_header *hdr;
+	struct iio_shm *shm;
+	size_t data_offset, size;
+	unsigned i;
+	int fd;
+
+	if (capacity < 2 || capacity > (1u << 30)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	capacity = next_power_of_two(capacity);
+	data_offset = (sizeof(struct iio_shm_header) +
+			layout->num_slots * sizeof(struct iio_shm_slot) +
+			IIO_CACHE_LINE - 1) & ~(size_t)(IIO_CACHE_LINE - 1);
+	size = data_offset + (size_t)capacity * record_size(layout->num_slots);
+
+	shm = calloc(1, sizeof(struct iio_shm));
+	if (!shm)
+		return NULL;
+	/* readers open the full name, it must not be cut short */
+	if (snprintf(shm->name, sizeof(shm->name), "%s",
+			shm_name(name, buf, sizeof(buf))) >= (int)sizeof(shm->name)) {
+		errno = ENAMETOOLONG;
+		goto err_free;
+	}
+
+	shm_unlink(shm->name);
+	fd = shm_open(shm->name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0)
+		goto err_free;
+	if (ftruncate(fd, size) < 0)
+		goto err_unlink;
+	hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED)
+		goto err_unlink;
+	close(fd);
+
+	/* the fresh segment is zero, records have not been written */
+	memcpy(hdr->magic, IIO_SHM_MAGIC, sizeof(hdr->magic));
+	hdr->version = IIO_SHM_VERSION;
+	hdr->byte_order = IIO_SHM_BYTE_ORDER;
+	hdr->scan_size = layout->scan_size;
+	hdr->ts_offset = layout->ts_offset;
+	hdr->num_slots = layout->num_slots;
+	hdr->capacity = capacity;
+	hdr->record_size = record_size(layout->num_slots);
+	hdr->data_offset = data_offset;
+	snprintf(hdr->device, SYSFS_NAME_LEN, "%s", device);
+	for (i = 0; i < layout->num_slots; i++) {
+		const struct iio_scan_slot *slot = &layout->slots[i];
+		struct iio_shm_slot *s = &hdr->slots[i];
+		snprintf(s->name, SYSFS_NAME_LEN, "%s", slot->elem->name);
+		s->index = slot->elem->index;
+		s->bits = slot->bits;
+		s->storagebits = slot->bytes * 8;
+		s->shift = slot->shift;
+		s->is_signed = slot->is_signed;
+		s->offset = slot->offset;
+		s->scale = slot->scale;
+		s->value_offset = slot->value_offset;
+	}
+
+	shm->hdr = hdr;
+	shm->size = size;
+	return shm;
+
+err_unlink:
+	close(fd);
+	shm_unlink(shm->name);
+err_free:
+	free(shm);
+	return NULL;
+}
+
+/**
+ * iio_shm_publish: make a block of decoded scans visible to the readers
+ * @shm: ring from iio_shm_create()
+ * @samples: samples as stored by iio_scan_decode()
+ * @stride: distance between two slots in @samples
+ * @timestamps: one per scan, only used if the scans have a timestamp
+ * @nscans: number of scans
+ *
+ * Never waits for readers.
+ */
+void iio_shm_publish(struct iio_shm *shm, const int32_t *samples, size_t stride,
+		const int64_t *timestamps, size_t nscans)
+{
+	struct iio_shm_header *hdr = shm->hdr;
+	const uint64_t head = hdr->head;
+	size_t s;
+	unsigned i;
+
+	for (s = 0; s < nscans; s++) {
+		struct iio_shm_record *rec = record(hdr, head + s);
+		const uint64_t seq = 2 * (head + s);
+
+		__atomic_store_n(&rec->seq, seq + 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		rec->timestamp = hdr->ts_offset >= 0 ? timestamps[s] : 0;
+		for (i = 0; i < hdr->num_slots; i++)
+			rec->samples[i] = samples[i * stride + s];
+		store_release(&rec->seq, seq + 2);
+	}
+
+	/* ordered against the waiters check, see iio_shm_wait() */
+	__atomic_store_n(&hdr->head, head + nscans, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&hdr->waiters, __ATOMIC_SEQ_CST)) {
+		__atomic_add_fetch(&hdr->wake, 1, __ATOMIC_SEQ_CST);
+		futex(&hdr->wake, FUTEX_WAKE, INT_MAX, NULL);
+	}
+}
+
+/**
+ * iio_shm_close: stop publishing and remove the ring
+ *
+ * Readers that have it mapped see it closed once they caught up.
+ */
+void iio_shm_close(struct iio_shm *shm)
+{
+	if (!shm)
+		return;
+	__atomic_store_n(&shm->hdr->closed, 1, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&shm->hdr->wake, 1, __ATOMIC_SEQ_CST);
+	futex(&shm->hdr->wake, FUTEX_WAKE, INT_MAX, NULL);
+	munmap(shm->hdr, shm->size);
+	shm_unlink(shm->name);
+	free(shm);
+}
+
+/**
+ * iio_shm_open: map a ring published by another process
+ * @name: name given to iio_shm_create()
+ *
+ * Reading starts with the next scan that will be published. Without
+ * write access to the segment iio_shm_wait() falls back to sleeping.
+ * Returns the reader on success and NULL on failure
+ */
+struct iio_shm_reader *iio_shm_open(const char *name)
+{
+	char buf[SYSFS_PATH_MAX];
+	struct iio_shm_reader *reader;
+	struct iio_shm_header *hdr;
+	struct stat st;
+	int fd, prot = PROT_READ | PROT_WRITE;
+	unsigned i;
+
+	name = shm_name(name, buf, sizeof(buf));
+	fd = shm_open(name, O_RDWR, 0);
+	if (fd < 0 && errno == EACCES) {
+		fd = shm_open(name, O_RDONLY, 0);
+		prot = PROT_READ;
+	}
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*hdr))
+		goto err_inval;
+	hdr = mmap(NULL, st.st_size, prot, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+	fd = -1;
+
+	if (memcmp(hdr->magic, IIO_SHM_MAGIC, sizeof(hdr->magic)) ||
+			hdr->version != IIO_SHM_VERSION ||
+			hdr->byte_order != IIO_SHM_BYTE_ORDER ||
+			hdr->capacity == 0 || (hdr->capacity & (hdr->capacity - 1)) ||
+			hdr->record_size < record_size(hdr->num_slots) ||
+			hdr->data_offset < sizeof(*hdr) +
+				hdr->num_slots * sizeof(struct iio_shm_slot) ||
+			hdr->data_offset + (uint64_t)hdr->capacity * hdr->record_size >
+				(uint64_t)st.st_size)
+		goto err_unmap;
+
+	reader = calloc(1, sizeof(struct iio_shm_reader));
+	if (!reader)
+		goto err_unmap;
+	reader->layout = calloc(1, sizeof(struct iio_scan_layout) +
+			hdr->num_slots * sizeof(struct iio_scan_slot));
+	reader->elements = calloc(hdr->num_slots + 1,
+			sizeof(struct iio_scan_element));
+	if (!reader->layout || !reader->elements)
+		goto err_free;
+	reader->hdr = hdr;
+	reader->size = st.st_size;
+	reader->can_wait = prot & PROT_WRITE;
+	reader->next = load_acquire(&hdr->head);
+	snprintf(reader->device, SYSFS_NAME_LEN, "%.*s", SYSFS_NAME_LEN - 1,
+			hdr->device);
+
+	reader->layout->scan_size = hdr->scan_size;
+	reader->layout->ts_offset = hdr->ts_offset;
+	reader->layout->num_slots = hdr->num_slots;
+	for (i = 0; i < hdr->num_slots; i++) {
+		const struct iio_shm_slot *s = &hdr->slots[i];
+		struct iio_scan_element *elem = &reader->elements[i];
+		struct iio_scan_slot *slot = &reader->layout->slots[i];
+		const char *end;
+
+		if ((s->storagebits != 8 && s->storagebits != 16 &&
+				s->storagebits != 32) || s->bits == 0 ||
+				s->bits + s->shift > s->storagebits ||
+				s->offset + s->storagebits / 8 > hdr->scan_size)
+			goto err_free;
+		end = memchr(s->name, '\0', SYSFS_NAME_LEN);
+		elem->name = iio_intern_len(s->name,
+				end ? end - s->name : SYSFS_NAME_LEN);
+		if (!elem->name)
+			goto err_free;
+		elem->index = s->index;
+		elem->bits = s->bits;
+		elem->storagebits = s->storagebits;
+		elem->shift = s->shift;
+		elem->is_signed = s->is_signed;
+		elem->big_endian = __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__;
+		elem->enabled = 1;
+
+		slot->elem = elem;
+		slot->offset = s->offset;
+		slot->bytes = s->storagebits / 8;
+		slot->shift = s->shift;
+		slot->bits = s->bits;
+		slot->mask = s->bits == 32 ? 0xffffffff : (1u << s->bits) - 1;
+		slot->is_signed = s->is_signed;
+		slot->scale = s->scale;
+		slot->value_offset = s->value_offset;
+	}
+	return reader;
+
+err_free:
+	free(reader->elements);
+	free(reader->layout);
+	free(reader);
+err_unmap:
+	munmap(hdr, st.st_size);
+err_inval:
+	if (fd >= 0)
+		close(fd);
+	errno = EINVAL;
+	return NULL;
+}
+
+void iio_shm_reader_close(struct iio_shm_reader *reader)
+{
+	if (reader) {
+		munmap(reader->hdr, reader->size);
+		free(reader->elements);
+		free(reader->layout);
+		free(reader);
+	}
+}
+
+/**
+ * iio_shm_read: copy the scans published since the last call
+ * @reader: reader from iio_shm_open()
+ * @samples: output, same arrangement as iio_scan_decode() uses
+ * @stride: distance between two slots in @samples, at most this many
+ * scans are copied
+ * @timestamps: output for one timestamp per scan, may be NULL
+ *
+ * Scans the writer overwrote before they could be copied are counted
+ * in reader->lost. A reader that is behind by more than the capacity
+ * skips ahead to half of it.
+ * Returns the number of scans copied, 0 if there are no new ones
+ */
+size_t iio_shm_read(struct iio_shm_reader *reader, int32_t *samples,
+		size_t stride, int64_t *timestamps)
+{
+	struct iio_shm_header *hdr = reader->hdr;
+	const uint64_t head = load_acquire(&hdr->head);
+	const unsigned num_slots = reader->layout->num_slots;
+	size_t k = 0;
+	unsigned i;
+
+	if (head - reader->next > hdr->capacity) {
+		uint64_t next = head - hdr->capacity / 2;
+		reader->lost += next - reader->next;
+		reader->next = next;
+	}
+
+	for (; reader->next < head && k < stride; reader->next++) {
+		struct iio_shm_record *rec = record(hdr, reader->next);
+		const uint64_t seq = 2 * reader->next + 2;
+
+		if (load_acquire(&rec->seq) != seq) {
+			reader->lost++;
+			continue;
+		}
+		if (timestamps)
+			timestamps[k] = rec->timestamp;
+		for (i = 0; i < num_slots; i++)
+			samples[i * stride + k] = rec->samples[i];
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&rec->seq, __ATOMIC_RELAXED) != seq) {
+			reader->lost++;
+			continue;
+		}
+		k++;
+	}
+	return k;
+}
+
+/**
+ * iio_shm_wait: sleep until new scans are published
+ * @reader: reader from iio_shm_open()
+ * @timeout_ms: longest time to sleep
+ * Returns 1 if there are new scans, 0 if not and -1 once the writer
+ * closed the ring and everything was read
+ */
+int iio_shm_wait(struct iio_shm_reader *reader, unsigned timeout_ms)
+{
+	struct iio_shm_header *hdr = reader->hdr;
+	struct timespec ts = {
+		.tv_sec = timeout_ms / 1000,
+		.tv_nsec = (timeout_ms % 1000) * 1000000L,
+	};
+	uint32_t wake;
+
+	if (load_acquire(&hdr->head) != reader->next)
+		return 1;
+	if (__atomic_load_n(&hdr->closed, __ATOMIC_SEQ_CST))
+		return load_acquire(&hdr->head) != reader->next ? 1 : -1;
+
+	if (!reader->can_wait) {
+		/* the futex word can not be written, poll every millisecond */
+		if (timeout_ms > 1) {
+			ts.tv_sec = 0;
+			ts.tv_nsec = 1000000L;
+		}
+		nanosleep(&ts, NULL);
+	} else {
+		wake = __atomic_load_n(&hdr->wake, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&hdr->waiters, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&hdr->head, __ATOMIC_SEQ_CST) == reader->next &&
+				!__atomic_load_n(&hdr->closed, __ATOMIC_SEQ_CST))
+			futex(&hdr->wake, FUTEX_WAIT, wake, &ts);
+		__atomic_sub_fetch(&hdr->waiters, 1, __ATOMIC_SEQ_CST);
+	}
+	return load_acquire(&hdr->head) != reader->next;
+}
@@ -0,0 +1,204 @@
+/*
+ * Industrial I/O utilities - iio_strings.c
+ *
+ * Copyright (c) 2010 Manuel Stahl <manuel.stahl@iis.fraunhofer.de>
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "iio.h"
+
+/*
+ * Pool of interned strings. Names and paths of devices, channels and
+ * scan elements are stored here once and shared by all structures that
+ * refer to them, so equal strings are the same pointer. Strings are
+ * packed into chunks and stay valid until the process exits; a hash
+ * table with open addressing finds existing copies. The pool is shared
+ * by the whole process and only grows, so names that come from outside,
+ * such as the requests of server clients, are looked up with
+ * iio_intern_find() and never added.
+ */
+#define CHUNK_SIZE	4096
+#define MIN_SLOTS	256
+
+struct chunk {
+	struct chunk *next;
+	size_t used;
+	char data[];
+};
+
+static struct {
+	pthread_mutex_t lock;
+	const char **slots;	/* hash table, NULL marks a free slot */
+	unsigned num_slots;	/* a power of two */
+	unsigned count;
+	struct chunk *chunks;	/* the one being filled comes first */
+} pool = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, NULL };
+
+/* FNV-1a */
+static uint32_t hash_string(const char *s, size_t len)
+{
+	uint32_t h = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		h = (h ^ (unsigned char)s[i]) * 16777619u;
+	return h;
+}
+
+static const char **find_slot(const char **slots, unsigned num_slots,
+		const char *s, size_t len)
+{
+	unsigned i = hash_string(s, len) & (num_slots - 1);
+
+	while (slots[i] && (strncmp(slots[i], s, len) || slots[i][len]))
+		i = (i + 1) & (num_slots - 1);
+	return &slots[i];
+}
+
+static int grow_table(void)
+{
+	unsigned i, num_slots = pool.num_slots ? pool.num_slots * 2 : MIN_SLOTS;
+	const char **slots;
+
+	slots = calloc(num_slots, sizeof(*slots));
+	if (!slots)
+		return -1;
+	for (i = 0; i < pool.num_slots; i++)
+		if (pool.slots[i])
+			*find_slot(slots, num_slots, pool.slots[i],
+					strlen(pool.slots[i])) = pool.slots[i];
+	free(pool.slots);
+	pool.slots = slots;
+	pool.num_slots = num_slots;
+	return 0;
+}
+
+static char *store(const char *s, size_t len)
+{
+	struct chunk *c = pool.chunks;
+	char *copy;
+
+	if (!c || c->used + len + 1 > CHUNK_SIZE) {
+		size_t size = len + 1 > CHUNK_SIZE ? len + 1 : CHUNK_SIZE;
+		c = malloc(sizeof(struct chunk) + size);
+		if (!c)
+			return NULL;
+		c->used = 0;
+		/* an oversized string gets a chunk of its own */
+		if (size > CHUNK_SIZE && pool.chunks) {
+			c->next = pool.chunks->next;
+			pool.chunks->next = c;
+		} else {
+			c->next = pool.chunks;
+			pool.chunks = c;
+		}
+	}
+	copy = c->data + c->used;
+	memcpy(copy, s, len);
+	copy[len] = '\0';
+	c->used += len + 1;
+	return copy;
+}
+
+/**
+ * iio_intern_len: get the pooled copy of a string
+ * @s: string, does not need to be terminated
+ * @len: length of @s
+ * Returns the interned string on success and NULL on failure
+ */
+const char *iio_intern_len(const char *s, size_t len)
+{
+	const char **slot;
+	const char *ret = NULL;
+
+	pthread_mutex_lock(&pool.lock);
+	/* keep the table at most half full */
+	if ((pool.count + 1) * 2 > pool.num_slots && grow_table() < 0)
+		goto out;
+	slot = find_slot(pool.slots, pool.num_slots, s, len);
+	if (!*slot) {
+		*slot = store(s, len);
+		if (*slot)
+			pool.count++;
+	}
+	ret = *slot;
+out:
+	pthread_mutex_unlock(&pool.lock);
+	return ret;
+}
+
+/**
+ * iio_intern_find: look up a string without adding it to the pool
+ * @s: string, does not need to be terminated
+ * @len: length of @s
+ * Returns the interned string, NULL if it was never interned
+ */
+const char *iio_intern_find(const char *s, size_t len)
+{
+	const char *ret = NULL;
+
+	pthread_mutex_lock(&pool.lock);
+	if (pool.num_slots)
+		ret = *find_slot(pool.slots, pool.num_slots, s, len);
+	pthread_mutex_unlock(&pool.lock);
+	return ret;
+}
+
+/**
+ * iio_intern: get the pooled copy of a string
+ * Returns the interned string on success and NULL on failure
+ */
+const char *iio_intern(const char *s)
+{
+	return iio_intern_len(s, strlen(s));
+}
+
+/**
+ * iio_intern_printf: format a string and get its pooled copy
+ * Returns the interned string on success and NULL on failure, errno is
+ * ENAMETOOLONG if the result is SYSFS_PATH_MAX or longer
+ */
+const char *iio_intern_printf(const char *fmt, ...)
+{
+	char buf[SYSFS_PATH_MAX];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (len < 0)
+		return NULL;
+	if ((size_t)len >= sizeof(buf)) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+	return iio_intern_len(buf, len);
+}
@@ -0,0 +1,313 @@
+/*
+ * Industrial I/O utilities - iio_uring.c
+ *
+ * Copyright (c) 2010 Manuel Stahl <manuel.stahl@iis.fraunhofer.de>
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include "iio.h"
+
+/*
+ * A small io_uring wrapper on top of the raw system calls, just what
+ * iio_ring needs: reads and writes, registered buffers, submitting a
+ * batch and waiting in one call. Without the kernel headers or the
+ * system calls iio_uring_new() fails with ENOSYS and callers use
+ * read() and write() instead.
+ */
+#if defined(__NR_io_uring_setup) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define IIO_URING
+#endif
+#endif
+
+#ifdef IIO_URING
+#include <linux/io_uring.h>
+
+struct iio_uring {
+	int fd;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *ring;			/* SQ and CQ ring in one mapping */
+	size_t ring_size;
+	size_t sqes_size;
+	unsigned queued;		/* prepared, not submitted yet */
+	int registered;			/* buffers are registered */
+};
+
+/**
+ * iio_uring_new: set up an io_uring
+ * @entries: requests that can be prepared before submitting
+ *
+ * Needs a kernel that keeps both rings in one mapping and can read and
+ * write at the current file position (5.6).
+ * Returns the ring on success and NULL on failure, errno is ENOSYS if
+ * io_uring is not available
+ */
+struct iio_uring *iio_uring_new(unsigned entries)
+{
+	struct io_uring_params p;
+	struct iio_uring *ring;
+	size_t sq_size, cq_size;
+	char *base;
+
+	ring = calloc(1, sizeof(struct iio_uring));
+	if (!ring)
+		return NULL;
+	memset(&p, 0, sizeof(p));
+	ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd < 0) {
+		if (errno == EPERM || errno == EINVAL)
+			errno = ENOSYS;
+		free(ring);
+		return NULL;
+	}
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+			!(p.features & IORING_FEAT_RW_CUR_POS)) {
+		close(ring->fd);
+		free(ring);
+		errno = ENOSYS;
+		return NULL;
+	}
+
+	sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+	ring->ring = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+		if (ring->ring != MAP_FAILED)
+			munmap(ring->ring, ring->ring_size);
+		if (ring->sqes != MAP_FAILED)
+			munmap(ring->sqes, ring->sqes_size);
+		close(ring->fd);
+		free(ring);
+		return NULL;
+	}
+
+	base = ring->ring;
+	ring->sq_head = (unsigned *)(base + p.sq_off.head);
+	ring->sq_tail = (unsigned *)(base + p.sq_off.tail);
+	ring->sq_mask = *(unsigned *)(base + p.sq_off.ring_mask);
+	ring->sq_entries = p.sq_entries;
+	ring->sq_array = (unsigned *)(base + p.sq_off.array);
+	ring->cq_head = (unsigned *)(base + p.cq_off.head);
+	ring->cq_tail = (unsigned *)(base + p.cq_off.tail);
+	ring->cq_mask = *(unsigned *)(base + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(base + p.cq_off.cqes);
+	return ring;
+}
+
+void iio_uring_free(struct iio_uring *ring)
+{
+	if (!ring)
+		return;
+	/* closing the ring cancels what is still in flight */
+	munmap(ring->sqes, ring->sqes_size);
+	munmap(ring->ring, ring->ring_size);
+	close(ring->fd);
+	free(ring);
+}
+
+/**
+ * iio_uring_register_buffers: pin buffers for fixed reads and writes
+ * @iov: the buffers, their index is used by iio_uring_read/write()
+ * @n: number of buffers
+ * Returns 0 on success and -1 on failure
+ */
+int iio_uring_register_buffers(struct iio_uring *ring, const struct iovec *iov,
+		unsigned n)
+{
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS,
+			iov, n) < 0)
+		return -1;
+	ring->registered = 1;
+	return 0;
+}
+
+static int queue_rw(struct iio_uring *ring, int op, int fd, const void *buf,
+		unsigned len, int buf_index, uint64_t tag)
+{
+	const unsigned tail = *ring->sq_tail + ring->queued;
+	struct io_uring_sqe *sqe;
+
+	if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >=
+			ring->sq_entries) {
+		errno = EBUSY;
+		return -1;
+	}
+	sqe = &ring->sqes[tail & ring->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	if (buf_index >= 0 && ring->registered) {
+		sqe->opcode = op == IORING_OP_READ ? IORING_OP_READ_FIXED :
+				IORING_OP_WRITE_FIXED;
+		sqe->buf_index = buf_index;
+	} else {
+		sqe->opcode = op;
+	}
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = (uint64_t)-1;	/* at the current position */
+	sqe->user_data = tag;
+	ring->sq_array[tail & ring->sq_mask] = tail & ring->sq_mask;
+	ring->queued++;
+	return 0;
+}
+
+/**
+ * iio_uring_read: prepare a read, see read()
+ * @buf_index: registered buffer that holds @buf, -1 for none
+ * @tag: returned with the completion
+ * Returns 0 on success and -1 if the submission queue is full
+ */
+int iio_uring_read(struct iio_uring *ring, int fd, void *buf, unsigned len,
+		int buf_index, uint64_t tag)
+{
+	return queue_rw(ring, IORING_OP_READ, fd, buf, len, buf_index, tag);
+}
+
+/**
+ * iio_uring_write: prepare a write, see write() and iio_uring_read()
+ */
+int iio_uring_write(struct iio_uring *ring, int fd, const void *buf,
+		unsigned len, int buf_index, uint64_t tag)
+{
+	return queue_rw(ring, IORING_OP_WRITE, fd, buf, len, buf_index, tag);
+}
+
+/**
+ * iio_uring_submit: submit the prepared requests and wait for completions
+ * @wait: completions to wait for, 0 to only submit
+ *
+ * Everything is done in one system call.
+ * Returns 0 on success and -1 on failure
+ */
+int iio_uring_submit(struct iio_uring *ring, unsigned wait)
+{
+	const unsigned n = ring->queued;
+	long ret;
+
+	__atomic_store_n(ring->sq_tail, *ring->sq_tail + n, __ATOMIC_RELEASE);
+	ring->queued = 0;
+	/* nothing was submitted if the call was interrupted */
+	do
+		ret = syscall(__NR_io_uring_enter, ring->fd, n, wait,
+				wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	while (ret < 0 && errno == EINTR);
+	return ret < 0 ? -1 : 0;
+}
+
+/**
+ * iio_uring_complete: take the next completion
+ * @tag: output, tag of the request
+ * @res: output, what read() or write() would have returned, or -errno
+ * Returns 1 if there was a completion and 0 if not
+ */
+int iio_uring_complete(struct iio_uring *ring, uint64_t *tag, int *res)
+{
+	const unsigned head = *ring->cq_head;
+	const struct io_uring_cqe *cqe;
+
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		return 0;
+	cqe = &ring->cqes[head & ring->cq_mask];
+	*tag = cqe->user_data;
+	*res = cqe->res;
+	__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+#else /* !IIO_URING */
+
+struct iio_uring *iio_uring_new(unsigned entries)
+{
+	(void)entries;
+	errno = ENOSYS;
+	return NULL;
+}
+
+void iio_uring_free(struct iio_uring *ring)
+{
+	(void)ring;
+}
+
+int iio_uring_register_buffers(struct iio_uring *ring, const struct iovec *iov,
+		unsigned n)
+{
+	(void)ring; (void)iov; (void)n;
+	errno = ENOSYS;
+	return -1;
+}
+
+int iio_uring_read(struct iio_uring *ring, int fd, void *buf, unsigned len,
+		int buf_index, uint64_t tag)
+{
+	(void)ring; (void)fd; (void)buf; (void)len; (void)buf_index; (void)tag;
+	errno = ENOSYS;
+	return -1;
+}
+
+int iio_uring_write(struct iio_uring *ring, int fd, const void *buf,
+		unsigned len, int buf_index, uint64_t tag)
+{
+	(void)ring; (void)fd; (void)buf; (void)len; (void)buf_index; (void)tag;
+	errno = ENOSYS;
+	return -1;
+}
+
+int iio_uring_submit(struct iio_uring *ring, unsigned wait)
+{
+	(void)ring; (void)wait;
+	errno = ENOSYS;
+	return -1;
+}
+
+int iio_uring_complete(struct iio_uring *ring, uint64_t *tag, int *res)
+{
+	(void)ring; (void)tag; (void)res;
+	return 0;
+}
+
+#endif /* IIO_URING */
@@ -20,10 +20,14 @@
  *
  */
 
+#define _GNU_SOURCE
+
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
 
+#include <fcntl.h>
+#include <unistd.h>
 #include <string.h>
 #include <strings.h>
 #include <dirent.h>
@@ -37,7 +41,6 @@
 #include <sys/stat.h>
 #include <sys/dir.h>
 
-#define _GNU_SOURCE
 #include <getopt.h>
 
 #include "iio.h"
@@ -54,6 +57,9 @@ const char* sensor_prefix[SENSOR_UNKOWN] = {
 #define fail_return(msg...) { fprintf(stderr, msg); return -1; }
 #define error_return(msg...) { fprintf(stderr, msg); goto err_ret; }
 
+/* where the ring device nodes are, see iio_set_root() */
+static const char *dev_dir = IIO_DEV_DIR;
+
 static inline int check_prefix(const char *str, const char *prefix) {
 	return strncmp(str, prefix, strlen(prefix)) == 0;
 }
@@ -155,13 +161,40 @@ int iio_read_string_with_postfix(char *dest, const char *basedir, const char *na
 
 
 
+/**
+ * iio_set_root: use a tree other than / for sysfs and the device nodes
+ * @root: directory holding sys/ and dev/iio/, as built by iio_sim
+ *
+ * Call before opening any device.
+ * Returns 0 on success and -1 on failure, errno is ENAMETOOLONG if
+ * @root is too long
+ */
+int iio_set_root(const char *root)
+{
+	char path[SYSFS_PATH_MAX];
+
+	/* libsysfs takes its mount point from the environment */
+	if (snprintf(path, SYSFS_PATH_MAX, "%s/sys", root) >= SYSFS_PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	if (setenv("SYSFS_PATH", path, 1) < 0)
+		return -1;
+	dev_dir = iio_intern_printf("%s/dev/iio/", root);
+	return dev_dir ? 0 : -1;
+}
+
 void iio_close_device(struct iio_device *iio_dev)
 {
+	struct iio_channel *chan;
+
 	if (iio_dev) {
 		if (iio_dev->buffer)
 			free(iio_dev->buffer);
-		if (iio_dev->channellist)
-			dlist_destroy(iio_dev->channellist);
+		free(iio_dev->attrs);
+		iio_device_for_each_channel(iio_dev, chan)
+			iio_channel_close_raw(chan);
+		free(iio_dev->channels);
 		free(iio_dev);
 	}
 }
@@ -170,6 +203,7 @@ struct iio_device *iio_open_device_from_sysfs(struct sysfs_device *sysfs_dev)
 {
 	struct iio_device *iio_dev;
 	struct sysfs_attribute *attr;
+	char name[SYSFS_NAME_LEN];
 	iio_dev = calloc(1, sizeof(struct iio_device));
 	sscanf(sysfs_dev->name, "device%d", &(iio_dev->number));
 	attr = sysfs_get_device_attr(sysfs_dev, "name");
@@ -179,8 +213,14 @@ struct iio_device *iio_open_device_from_sysfs(struct sysfs_device *sysfs_dev)
 		return NULL;
 	}
 
-	sscanf(attr->value, "%s", iio_dev->name);
-	strncpy(iio_dev->path, sysfs_dev->path, SYSFS_PATH_MAX);
+	name[0] = '\0';
+	sscanf(attr->value, "%63s", name);
+	iio_dev->name = iio_intern(name);
+	iio_dev->path = iio_intern(sysfs_dev->path);
+	if (!iio_dev->name || !iio_dev->path) {
+		free(iio_dev);
+		return NULL;
+	}
 	return iio_dev;
 }
 
@@ -195,6 +235,10 @@ struct iio_device *iio_open_device_by_name(const char *name)
 		errno = EINVAL;
 		return NULL;
 	}
+	/* device names are interned, compare the pointers */
+	name = iio_intern(name);
+	if (!name)
+		return NULL;
 
 	iio_bus = sysfs_open_bus("iio");
 	if (iio_bus == NULL) {
@@ -211,7 +255,10 @@ struct iio_device *iio_open_device_by_name(const char *name)
 	dlist_for_each_data(sysfs_dev_list, sysfs_dev, struct sysfs_device) {
 		if (strchr(sysfs_dev->name, ':') == NULL) {
 			iio_dev = iio_open_device_from_sysfs(sysfs_dev);
-			break;
+			if (iio_dev && iio_dev->name == name)
+				break;
+			iio_close_device(iio_dev);
+			iio_dev = NULL;
 		}
 	}
 
@@ -236,11 +283,79 @@ struct iio_device *iio_open_device_path(const char *path)
 }
 
 
+static int compare_attributes(const void *a, const void *b)
+{
+	return strcmp(((const struct iio_attribute *)a)->name,
+			((const struct iio_attribute *)b)->name);
+}
+
+/* Remember the names of all attributes of a device, so modifiers are
+ * looked up without trying to open files that do not exist.
+ */
+static int iio_index_attributes(struct iio_device *dev, struct dlist *attr_list)
+{
+	struct sysfs_attribute *attr;
+	unsigned count = 0;
+
+	dlist_for_each_data(attr_list, attr, struct sysfs_attribute)
+		count++;
+	dev->attrs = calloc(count + 1, sizeof(struct iio_attribute));
+	if (!dev->attrs)
+		return -1;
+	dlist_for_each_data(attr_list, attr, struct sysfs_attribute) {
+		dev->attrs[dev->num_attrs].name = iio_intern(attr->name);
+		if (!dev->attrs[dev->num_attrs].name)
+			return -1;
+		dev->num_attrs++;
+	}
+	qsort(dev->attrs, dev->num_attrs, sizeof(struct iio_attribute),
+			compare_attributes);
+	return 0;
+}
+
+/* Same search as iio_get_channel_modifier(), against the index. Shared
+ * modifiers like accel_scale are read once for all channels, raw values
+ * are read on every call.
+ */
+static float iio_indexed_modifier(struct iio_device *dev, const char *chan_name,
+		const char *mod_name, float def_value)
+{
+	struct iio_attribute key, *attr;
+	char name[SYSFS_NAME_LEN];
+	const char *end;
+	int len = strlen(chan_name);
+
+	key.name = name;
+	while (1) {
+		snprintf(name, SYSFS_NAME_LEN, "%.*s_%s", len, chan_name, mod_name);
+		attr = bsearch(&key, dev->attrs, dev->num_attrs,
+				sizeof(struct iio_attribute), compare_attributes);
+		if (attr) {
+			if (!attr->cached || strcmp(mod_name, IIO_MOD_RAW) == 0) {
+				char path[SYSFS_PATH_MAX];
+				snprintf(path, SYSFS_PATH_MAX, "%s/%s", dev->path, name);
+				attr->value = iio_float_from_path(path);
+				attr->cached = 1;
+			}
+			if (!isnan(attr->value))
+				return attr->value;
+		}
+		/* search for global modifier */
+		end = memchr(chan_name, '_', len);
+		if (!end)
+			return def_value;
+		len = end - chan_name;
+	}
+}
+
 float iio_get_channel_modifier(struct iio_device *dev, const char *chan_name, const char *mod_name, float def_value)
 {
 	char *end;
 	float mod_value = def_value;
 
+	if (dev->attrs)
+		return iio_indexed_modifier(dev, chan_name, mod_name, def_value);
+
 	mod_value = iio_read_float_with_postfix(dev->path, chan_name, mod_name);
 	if (isnan(mod_value)) {
 		/* search for global modifier */
@@ -256,56 +371,211 @@ float iio_get_channel_modifier(struct iio_device *dev, const char *chan_name, co
 	return mod_value;
 }
 
+static int compare_channels(const void *a, const void *b)
+{
+	return strcmp(((const struct iio_channel *)a)->name,
+			((const struct iio_channel *)b)->name);
+}
+
 /**
- * iio_get_device_channels: gets list of channels that are part of a device
- * @dev: iio_device whose channel list is needed
- * Returns dlist of struct iio_channel on success and NULL on failure
+ * iio_get_device_channels: gets the channels that are part of a device
+ * @dev: iio_device whose channels are needed
+ *
+ * The channels are read once into a single allocation: the array
+ * dev->channels sorted by name, followed by the arrays dev->raw,
+ * dev->scale and dev->offset indexed by iio_channel.index. Further
+ * calls return the same array.
+ * Returns the first of dev->num_channels channels on success and NULL
+ * on failure or if the device has no channels
  */
-struct dlist *iio_get_device_channels(struct iio_device *dev)
+struct iio_channel *iio_get_device_channels(struct iio_device *dev)
 {
 	struct sysfs_device *sysfs_dev;
 	struct dlist *attr_list = NULL;
 	struct sysfs_attribute *attr;
 	struct iio_channel *channel;
+	unsigned i, count = 0;
 
 	if (!dev) {
 		errno = EINVAL;
 		return NULL;
 	}
+	if (dev->channels)
+		return dev->channels;
 
 	sysfs_dev = sysfs_open_device_path(dev->path);
 	attr_list = sysfs_get_device_attributes(sysfs_dev);
 	if (!attr_list)
 		error_return("Could not open device");
+	if (!dev->attrs && iio_index_attributes(dev, attr_list) < 0)
+		error_return("Could not allocate attribute index\n");
+
+	dlist_for_each_data(attr_list, attr, struct sysfs_attribute)
+		if (check_postfix(attr->name, IIO_MOD_RAW))
+			count++;
+	if (!count)
+		goto err_ret;
+
+	/* the float arrays follow the channels, which keep them aligned */
+	dev->channels = calloc(1, count * (sizeof(struct iio_channel) +
+				3 * sizeof(float)));
+	if (!dev->channels)
+		error_return("Could not allocate channels\n");
+	dev->raw = (float *)(dev->channels + count);
+	dev->scale = dev->raw + count;
+	dev->offset = dev->scale + count;
 
 	dlist_for_each_data(attr_list, attr, struct sysfs_attribute) {
-		if (check_postfix(attr->name, IIO_MOD_RAW)) {
-			if (!dev->channellist) {
-				dev->channellist = dlist_new(sizeof(struct iio_channel));
-				if (!dev->channellist)
-					error_return("Error creating channel list\n");
-			}
-			channel = (struct iio_channel *)calloc(1, sizeof(struct iio_channel));
-			if (!channel) {
-				fprintf(stderr, "Could not allocate channel\n");
-				continue;
-			}
-
-			channel->dev = dev;
-			iio_name_from_attribute(channel->name, attr->name);
-			channel->type = 0;
-			while (!check_prefix(channel->name, sensor_prefix[channel->type]))
-					channel->type++;
-			channel->raw = iio_get_channel_modifier(dev, channel->name, IIO_MOD_RAW, 1.0f);
-			channel->scale = iio_get_channel_modifier(dev, channel->name, IIO_MOD_SCALE, 1.0f);
-			channel->offset = iio_get_channel_modifier(dev, channel->name, IIO_MOD_OFFSET, 0.0f);
-			dlist_unshift_sorted(dev->channellist, channel, sort_list);
-		}
+		if (!check_postfix(attr->name, IIO_MOD_RAW) ||
+				dev->num_channels == count)
+			continue;
+		channel = &dev->channels[dev->num_channels];
+		channel->name = iio_name_from_attribute(attr->name);
+		if (!channel->name)
+			continue;
+		dev->num_channels++;
+		channel->dev = dev;
+		channel->raw_fd = -1;
+		channel->type = 0;
+		while (!check_prefix(channel->name, sensor_prefix[channel->type]))
+				channel->type++;
+	}
+	qsort(dev->channels, dev->num_channels, sizeof(struct iio_channel),
+			compare_channels);
+
+	for (i = 0; i < dev->num_channels; i++) {
+		channel = &dev->channels[i];
+		channel->index = i;
+		dev->raw[i] = iio_get_channel_modifier(dev, channel->name, IIO_MOD_RAW, 1.0f);
+		dev->scale[i] = iio_get_channel_modifier(dev, channel->name, IIO_MOD_SCALE, 1.0f);
+		dev->offset[i] = iio_get_channel_modifier(dev, channel->name, IIO_MOD_OFFSET, 0.0f);
 	}
 
 err_ret:
 	sysfs_close_device(sysfs_dev);
-	return dev->channellist;
+	return dev->channels;
+}
+
+/**
+ * iio_find_channel: look up a channel of a device by name
+ * @dev: device, its channels are loaded if needed
+ * Returns the channel on success and NULL if there is none
+ */
+struct iio_channel *iio_find_channel(struct iio_device *dev, const char *name)
+{
+	struct iio_channel key;
+
+	if (!iio_get_device_channels(dev))
+		return NULL;
+	key.name = name;
+	return bsearch(&key, dev->channels, dev->num_channels,
+			sizeof(struct iio_channel), compare_channels);
+}
+
+/**
+ * iio_device_convert: compute the values of all channels of a device
+ * @dev: device with channels loaded by iio_get_device_channels()
+ * @values: receives dev->num_channels values in channel order
+ */
+void iio_device_convert(const struct iio_device *dev, float *values)
+{
+	const float *raw = dev->raw, *scale = dev->scale, *offset = dev->offset;
+	unsigned i, n = dev->num_channels;
+
+	for (i = 0; i < n; i++)
+		values[i] = (raw[i] + offset[i]) * scale[i];
+}
+
+/*
+ * Polling of raw values. The _raw attribute of a channel is opened once,
+ * every update is then a single pread() of the whole attribute.
+ */
+
+/* Parse a decimal integer as found in sysfs, falls back to strtof()
+ * for anything else.
+ */
+static float parse_raw(const char *buf)
+{
+	const char *p = buf;
+	int64_t v = 0;
+	int neg = 0;
+
+	if (*p == '-') {
+		neg = 1;
+		p++;
+	}
+	if (*p < '0' || *p > '9')
+		return strtof(buf, NULL);
+	while (*p >= '0' && *p <= '9' && p - buf < 18)
+		v = v * 10 + (*p++ - '0');
+	if (*p != '\n' && *p != '\0')
+		return strtof(buf, NULL);
+	return neg ? -v : v;
+}
+
+/**
+ * iio_channel_open_raw: keep the _raw attribute of a channel open
+ * @chan: channel as returned by iio_get_device_channels()
+ * Returns 0 on success and -1 on failure
+ */
+int iio_channel_open_raw(struct iio_channel *chan)
+{
+	char path[SYSFS_PATH_MAX];
+
+	if (chan->raw_fd >= 0)
+		return 0;
+	snprintf(path, SYSFS_PATH_MAX, "%s/%s_%s", chan->dev->path, chan->name,
+			IIO_MOD_RAW);
+	chan->raw_fd = open(path, O_RDONLY | O_CLOEXEC);
+	return chan->raw_fd < 0 ? -1 : 0;
+}
+
+void iio_channel_close_raw(struct iio_channel *chan)
+{
+	if (chan->raw_fd >= 0)
+		close(chan->raw_fd);
+	chan->raw_fd = -1;
+}
+
+/**
+ * iio_channel_read_raw: update the raw value of a channel
+ * @chan: channel as returned by iio_get_device_channels()
+ *
+ * The attribute is opened on first use and stays open until
+ * iio_channel_close_raw() or iio_close_device().
+ * Returns 0 on success and -1 on failure
+ */
+int iio_channel_read_raw(struct iio_channel *chan)
+{
+	char buf[32];
+	ssize_t len;
+
+	if (iio_channel_open_raw(chan) < 0)
+		return -1;
+	len = pread(chan->raw_fd, buf, sizeof(buf) - 1, 0);
+	if (len <= 0)
+		return -1;
+	buf[len] = '\0';
+	chan->dev->raw[chan->index] = parse_raw(buf);
+	return 0;
+}
+
+/**
+ * iio_device_read_raw: update the raw value of all channels of a device
+ * @dev: device, its channel list is loaded if needed
+ * Returns the number of channels that could not be read, -1 on failure
+ */
+int iio_device_read_raw(struct iio_device *dev)
+{
+	struct iio_channel *chan;
+	int failed = 0;
+
+	if (!iio_get_device_channels(dev))
+		return -1;
+	iio_device_for_each_channel(dev, chan)
+		if (iio_channel_read_raw(chan) < 0)
+			failed++;
+	return failed;
 }
 
 
@@ -316,6 +586,8 @@ struct iio_ring_buffer *iio_get_ring_buffer(struct iio_device * iio_dev)
 
 	if (!iio_dev)
 		return NULL;
+	if (iio_dev->buffer)
+		return iio_dev->buffer;
 
 	dir_list = sysfs_open_directory_list(iio_dev->path);
 	if (dir_list == NULL) return NULL;
@@ -329,11 +601,17 @@ struct iio_ring_buffer *iio_get_ring_buffer(struct iio_device * iio_dev)
 
 			buf->device = iio_dev;
 			sscanf(dir, "device%*d:buffer%d", &(buf->number));
-			snprintf(buf->path, SYSFS_PATH_MAX, "%s/%s", iio_dev->path, dir);
-			snprintf(buf->event, SYSFS_PATH_MAX,
-					IIO_DEV_DIR"ring_event_line%d", buf->number);
-			snprintf(buf->access, SYSFS_PATH_MAX,
-					IIO_DEV_DIR"ring_access%d", buf->number);
+			buf->path = iio_intern_printf("%s/%s", iio_dev->path, dir);
+			buf->event = iio_intern_printf("%sring_event_line%d",
+					dev_dir, buf->number);
+			buf->access = iio_intern_printf("%sring_access%d",
+					dev_dir, buf->number);
+			if (!buf->path || !buf->event || !buf->access) {
+				fprintf(stderr, "%s/%s: %s\n", iio_dev->path, dir,
+						strerror(errno));
+				free(buf);
+				break;
+			}
 
 			iio_dev->buffer = buf;
 			break;
@@ -358,11 +636,69 @@ int iio_is_ring_buffer_enabled(struct iio_ring_buffer *buf)
 	return iio_read_posint(buf->path, "ring_enable");
 }
 
+/* Returns NAN if the device has no sampling_frequency attribute */
+float iio_get_sampling_frequency(struct iio_device *iio_dev)
+{
+	return iio_read_float(iio_dev->path, "/sampling_frequency");
+}
+
+/* Fill in storage size, shift and sign of a scan element. Newer kernels
+ * describe them in <name>_type as "le:s12/16>>4", older ones only give
+ * the number of bits, stored signed in the next power of two bytes.
+ */
+static void iio_parse_scan_type(struct iio_scan_element *elem, const char *path)
+{
+	char type[SYSFS_NAME_LEN];
+	char endian[3], sign;
+
+	if (iio_read_string_with_postfix(type, path, elem->name, "type") == 0 &&
+			sscanf(type, "%2s:%c%u/%u>>%u", endian, &sign, &elem->bits,
+			&elem->storagebits, &elem->shift) == 5) {
+		elem->is_signed = (sign == 's' || sign == 'S');
+		elem->big_endian = strcmp(endian, "be") == 0;
+		return;
+	}
+
+	if (check_postfix(elem->name, "timestamp") && (int)elem->bits <= 0)
+		elem->bits = 64;
+	elem->storagebits = elem->bits < 8 ? 8 : next_power_of_two(elem->bits);
+	elem->shift = 0;
+	elem->is_signed = 1;
+	elem->big_endian = __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__;
+}
+
+/* Scan elements may carry an index prefix, e.g. "00_accel_x" belongs to
+ * the channel "accel_x".
+ */
+static struct iio_channel *iio_find_scan_channel(struct iio_device *dev,
+		const char *elem_name)
+{
+	struct iio_channel *channel;
+	const char *name = elem_name;
+
+	while (name) {
+		channel = iio_find_channel(dev, name);
+		if (channel)
+			return channel;
+		name = strchr(name, '_');
+		if (name)
+			name++;
+	}
+	return NULL;
+}
+
+static int sort_scan_elements(void *a, void *b)
+{
+	return strcmp(((struct iio_scan_element *)a)->name,
+			((struct iio_scan_element *)b)->name) < 0;
+}
+
 struct dlist *iio_get_ring_buffer_scan_elements(struct iio_ring_buffer *buffer)
 {
 	struct dlist *scan_elements = NULL;
 	struct dlist *dir_list = NULL;
 	char path[SYSFS_PATH_MAX];
+	char name[SYSFS_NAME_LEN];
 	char *dir;
 
 	if (!buffer || !buffer->device)
@@ -374,6 +710,7 @@ struct dlist *iio_get_ring_buffer_scan_elements(struct iio_ring_buffer *buffer)
 		return NULL;
 
 	scan_elements = dlist_new(sizeof(struct iio_scan_element));
+	iio_get_device_channels(buffer->device);
 
 	dlist_for_each_data(dir_list, dir, char) {
 		if (check_postfix(dir, "en")) {
@@ -381,15 +718,21 @@ struct dlist *iio_get_ring_buffer_scan_elements(struct iio_ring_buffer *buffer)
 			if (!elem)
 				continue;
 
-			strncpy(elem->name, dir, SYSFS_NAME_LEN);
-			strip_postfix(elem->name);
+			snprintf(name, SYSFS_NAME_LEN, "%s", dir);
+			strip_postfix(name);
+			elem->name = iio_intern(name);
+			if (!elem->name) {
+				free(elem);
+				continue;
+			}
 			sscanf(dir, "%dscan_", &(elem->index));
 			elem->bits = iio_read_int_with_postfix(path, elem->name, "bits");
 			elem->enabled = iio_read_int_with_postfix(path, elem->name, "en");
+			iio_parse_scan_type(elem, path);
 
-			// TODO add channel
+			elem->channel = iio_find_scan_channel(buffer->device, elem->name);
 
-			dlist_unshift_sorted(scan_elements, elem, sort_list);
+			dlist_unshift_sorted(scan_elements, elem, sort_scan_elements);
 		}
 	}
 	sysfs_close_list(dir_list);
@@ -400,7 +743,7 @@ struct dlist *iio_get_ring_buffer_scan_elements(struct iio_ring_buffer *buffer)
 
 int iio_get_trigger(struct iio_device *iio_dev, char *trigger_name)
 {
-	return iio_read_string(trigger_name, "/trigger/current_trigger", iio_dev->path);
+	return iio_read_string(trigger_name, iio_dev->path, "/trigger/current_trigger");
 }
 
 int iio_set_trigger(struct iio_device *iio_dev, const char *trigger_name)
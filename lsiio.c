@@ -8,6 +8,8 @@
  * the Free Software Foundation.
  */
 
+#define _GNU_SOURCE
+
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -21,8 +23,11 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/dir.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
 
-#define _GNU_SOURCE
 #include <getopt.h>
 
 #include "iio.h"
@@ -51,9 +56,30 @@ static inline int check_prefix(const char *str, const char *prefix) {
 	return strncmp(str, prefix, strlen(prefix)) == 0;
 }
 
+#define MAX_PROBE_THREADS 8
+#define MIN_WATCH_HZ 0.001
+#define MAX_WATCH_HZ 1e6		/* keeps the timer period above 0 */
+
+/* Devices found on the bus. Reading their channels may block on the
+ * bus for a while, so they are probed in parallel and then handled
+ * one after the other in the order they were found.
+ */
+static struct {
+	struct iio_device **devs;
+	unsigned num_devs;
+	unsigned next;		/* next device to probe, shared by the workers */
+} probe;
+
+/* Devices kept open for --watch */
+static struct {
+	struct iio_device **devs;
+	unsigned num_devs;
+	int redraw;		/* terminal output, else one line per update */
+	unsigned long missed;	/* timer ticks we were too late for */
+} watch;
+
 static int dump_one_device(struct iio_device * iio_dev)
 {
-	struct dlist * channel_list;
 	struct iio_channel * chan;
 	struct iio_ring_buffer * ring;
 //	struct sysfs_device * sysfs_dev;
@@ -66,19 +92,20 @@ static int dump_one_device(struct iio_device * iio_dev)
 	printf("Device %03d: %s\n", iio_dev->number, iio_dev->name);
 
 	if (verblevel >= VERBLEVEL_SENSORS) {
-		channel_list = iio_get_device_channels(iio_dev);
-		dlist_for_each_data(channel_list, chan, struct iio_channel) {
+		iio_get_device_channels(iio_dev);
+		iio_device_for_each_channel(iio_dev, chan) {
 			if (cur_type != chan->type && chan->type < SENSOR_UNKOWN) {
 				printf("%s%s:\n", indent, attribute_header[chan->type]);
 				cur_type = chan->type;
 			}
 			printf("%s%-10s", indent, chan->name);
 			if (verblevel >= VERBLEVEL_VALUES) {
-				printf(": %f %s", (chan->raw + chan->offset) * chan->scale,
+				printf(": %f %s", iio_channel_value(chan),
 						sensor_unit[chan->type]);
 				if (verblevel >= VERBLEVEL_DEBUG)
-					printf(" = (%f + %f) * %f", chan->raw, chan->offset,
-							chan->scale);
+					printf(" = (%f + %f) * %f", iio_channel_raw(chan),
+							iio_channel_offset(chan),
+							iio_channel_scale(chan));
 			}
 			printf("\n");
 		}
@@ -99,6 +126,172 @@ static int dump_one_device(struct iio_device * iio_dev)
 	return 0;
 }
 
+/* Keep the device and its open channels for watch_devices().
+ * Returns 1, the device must not be closed by the caller.
+ */
+static int watch_add_device(struct iio_device *iio_dev)
+{
+	struct iio_device **devs;
+	struct iio_channel *chan;
+
+	if (!iio_get_device_channels(iio_dev))
+		return 0;
+	devs = realloc(watch.devs, (watch.num_devs + 1) * sizeof(*devs));
+	if (!devs) {
+		fprintf(stderr, "Could not allocate device list\n");
+		return 0;
+	}
+	iio_device_for_each_channel(iio_dev, chan)
+		if (iio_channel_open_raw(chan) < 0)
+			fprintf(stderr, "%s: cannot open %s_%s\n", iio_dev->name,
+					chan->name, IIO_MOD_RAW);
+	watch.devs = devs;
+	watch.devs[watch.num_devs++] = iio_dev;
+	return 1;
+}
+
+static int (*handle_device)(struct iio_device *iio_dev) = dump_one_device;
+
+static void print_watch(void)
+{
+	struct iio_channel *chan;
+	struct timespec now;
+	unsigned i;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	if (watch.redraw) {
+		/* cursor home, clear screen */
+		printf("\033[H\033[J%ld.%06ld, %lu updates missed\n",
+				(long)now.tv_sec, now.tv_nsec / 1000, watch.missed);
+		for (i = 0; i < watch.num_devs; i++) {
+			printf("Device %03d: %s\n", watch.devs[i]->number,
+					watch.devs[i]->name);
+			iio_device_for_each_channel(watch.devs[i], chan)
+				printf("  %-10s: %f %s\n", chan->name,
+						iio_channel_value(chan),
+						chan->type < SENSOR_UNKOWN ?
+						sensor_unit[chan->type] : "");
+		}
+	} else {
+		printf("%ld.%06ld", (long)now.tv_sec, now.tv_nsec / 1000);
+		for (i = 0; i < watch.num_devs; i++)
+			iio_device_for_each_channel(watch.devs[i], chan)
+				printf(",%f", iio_channel_value(chan));
+		printf("\n");
+	}
+	fflush(stdout);
+}
+
+/* Refresh the raw values of all kept devices hz times a second until
+ * killed. The timer runs on absolute deadlines, so late updates do not
+ * shift the following ones; updates that are due together are done
+ * once and counted as missed.
+ */
+static int watch_devices(double hz)
+{
+	struct itimerspec its;
+	struct iio_channel *chan;
+	uint64_t expired;
+	long long period = 1e9 / hz;
+	unsigned i;
+	int tfd;
+
+	if (!watch.num_devs) {
+		fprintf(stderr, "No industrial I/O devices to watch\n");
+		return -1;
+	}
+
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (tfd < 0) {
+		perror("timerfd_create");
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &its.it_value);
+	its.it_interval.tv_sec = period / 1000000000;
+	its.it_interval.tv_nsec = period % 1000000000;
+	if (timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+		perror("timerfd_settime");
+		close(tfd);
+		return -1;
+	}
+
+	watch.redraw = isatty(STDOUT_FILENO);
+	if (!watch.redraw) {
+		printf("time");
+		for (i = 0; i < watch.num_devs; i++)
+			iio_device_for_each_channel(watch.devs[i], chan)
+				printf(",%s:%s", watch.devs[i]->name, chan->name);
+		printf("\n");
+	}
+
+	while (read(tfd, &expired, sizeof(expired)) == sizeof(expired)) {
+		watch.missed += expired - 1;
+		for (i = 0; i < watch.num_devs; i++)
+			iio_device_read_raw(watch.devs[i]);
+		print_watch();
+	}
+	perror("timerfd");
+	close(tfd);
+	return -1;
+}
+
+static void add_device(struct iio_device *iio_dev)
+{
+	struct iio_device **devs;
+
+	devs = realloc(probe.devs, (probe.num_devs + 1) * sizeof(*devs));
+	if (!devs) {
+		fprintf(stderr, "Could not allocate device list\n");
+		iio_close_device(iio_dev);
+		return;
+	}
+	probe.devs = devs;
+	probe.devs[probe.num_devs++] = iio_dev;
+}
+
+/* Read everything dump_one_device() and watch_add_device() need */
+static void probe_device(struct iio_device *iio_dev)
+{
+	iio_get_device_channels(iio_dev);
+	iio_get_ring_buffer(iio_dev);
+}
+
+static void *probe_worker(void *arg)
+{
+	unsigned i;
+
+	(void)arg;
+	while ((i = __atomic_fetch_add(&probe.next, 1, __ATOMIC_RELAXED)) <
+			probe.num_devs)
+		probe_device(probe.devs[i]);
+	return NULL;
+}
+
+/* Probe all added devices, then hand them to handle_device() in order */
+static void handle_devices(int need_probe)
+{
+	pthread_t threads[MAX_PROBE_THREADS];
+	unsigned i, num_threads = 0;
+
+	if (need_probe) {
+		/* the calling thread is one of the workers */
+		while (num_threads < MAX_PROBE_THREADS - 1 &&
+				num_threads + 1 < probe.num_devs &&
+				pthread_create(&threads[num_threads], NULL,
+					probe_worker, NULL) == 0)
+			num_threads++;
+		probe_worker(NULL);
+		for (i = 0; i < num_threads; i++)
+			pthread_join(threads[i], NULL);
+	}
+
+	for (i = 0; i < probe.num_devs; i++)
+		if (handle_device(probe.devs[i]) <= 0)
+			iio_close_device(probe.devs[i]);
+	free(probe.devs);
+	memset(&probe, 0, sizeof(probe));
+}
+
 static int dump_one_device_path(const char *path)
 {
 	int ret;
@@ -109,12 +302,13 @@ static int dump_one_device_path(const char *path)
 		printf("%s is no industrial I/O device\n", path);
 		return -1;
 	}
-	ret = dump_one_device(iio_dev);
-	iio_close_device(iio_dev);
+	ret = handle_device(iio_dev);
+	if (ret <= 0)
+		iio_close_device(iio_dev);
 	return ret;
 }
 
-static void dump_devices_with_name(const char *name)
+static void dump_devices_with_name(const char *name, int need_probe)
 {
 	struct iio_device * iio_dev;
 	struct sysfs_device * sysfs_dev;
@@ -137,14 +331,16 @@ static void dump_devices_with_name(const char *name)
 		if (strchr(sysfs_dev->name, ':') == NULL) {
 			iio_dev = iio_open_device_from_sysfs(sysfs_dev);
 			if (iio_dev && strcmp(iio_dev->name, name) == 0)
-				dump_one_device(iio_dev);
-			iio_close_device(iio_dev);
+				add_device(iio_dev);
+			else
+				iio_close_device(iio_dev);
 		}
 	}
 	sysfs_close_bus(iio_bus);
+	handle_devices(need_probe);
 }
 
-static void dump_devices(void)
+static void dump_devices(int need_probe)
 {
 	struct iio_device * iio_dev;
 	struct sysfs_device * sysfs_dev;
@@ -166,10 +362,11 @@ static void dump_devices(void)
 	dlist_for_each_data(sysfs_dev_list, sysfs_dev, struct sysfs_device) {
 		if (strchr(sysfs_dev->name, ':') == NULL) {
 			iio_dev = iio_open_device_from_sysfs(sysfs_dev);
-			dump_one_device(iio_dev);
-			iio_close_device(iio_dev);
+			if (iio_dev)
+				add_device(iio_dev);
 		}
 	}
+	handle_devices(need_probe);
 }
 
 int main(int argc, char **argv)
@@ -177,6 +374,8 @@ int main(int argc, char **argv)
 	static const struct option long_options[] = {
 		{ "version", 0, 0, 'V' },
 		{ "verbose", 0, 0, 'v' },
+		{ "watch", 1, 0, 'w' },
+		{ "root", 1, 0, 'R' },
 		{ 0, 0, 0, 0 }
 	};
 
@@ -184,8 +383,9 @@ int main(int argc, char **argv)
 
 	const char *devdump = NULL;
 	const char *devname = NULL;
+	double watch_hz = 0;
 
-	while ((c = getopt_long(argc, argv, "d:D:vV",
+	while ((c = getopt_long(argc, argv, "d:D:R:vVw:",
 			long_options, NULL)) != EOF) {
 		switch(c) {
 		case 'V':
@@ -204,6 +404,22 @@ int main(int argc, char **argv)
 			devdump = optarg;
 			break;
 
+		case 'R':
+			if (iio_set_root(optarg) < 0) {
+				fprintf(stderr, "Cannot use root %s\n", optarg);
+				err++;
+			}
+			break;
+
+		case 'w':
+			watch_hz = atof(optarg);
+			if (!(watch_hz >= MIN_WATCH_HZ && watch_hz <= MAX_WATCH_HZ)) {
+				fprintf(stderr, "Rate must be %g to %g Hz\n",
+						MIN_WATCH_HZ, MAX_WATCH_HZ);
+				err++;
+			}
+			break;
+
 		case '?':
 		default:
 			err++;
@@ -219,18 +435,28 @@ int main(int argc, char **argv)
 			"      Show only devices with specified name\n"
 			"  -D <device_path>\n"
 			"      Selects which device lsiio will examine\n"
+			"  -R, --root <dir>\n"
+			"      Find sysfs in <dir>/sys, e.g. the tree of iio_sim\n"
+			"  -w, --watch <hz>\n"
+			"      Update the values of all channels <hz> times a second\n"
 			"  -V, --version\n"
 			"      Show version of program\n"
 			);
 		exit(1);
 	}
 
+	if (watch_hz)
+		handle_device = watch_add_device;
+
 	if (devdump)
 		dump_one_device_path(devdump);
 	else if (devname)
-		dump_devices_with_name(devname);
+		dump_devices_with_name(devname,
+				watch_hz || verblevel >= VERBLEVEL_SENSORS);
 	else
-		dump_devices();
+		dump_devices(watch_hz || verblevel >= VERBLEVEL_SENSORS);
 
+	if (watch_hz)
+		return watch_devices(watch_hz) ? 1 : 0;
 	return 0;
 }
@@ -0,0 +1,66 @@
+#!/bin/sh
+#
+# Industrial I/O utilities - ring_bench.sh
+#
+# Find the highest scan rate iio_ring sustains without losing scans, for
+# each output mode, against a device simulated by iio_sim. The rate is
+# doubled until scans are dropped, then narrowed down by bisection.
+#
+# usage: ring_bench.sh [seconds per run] [ring length]
+# Writes one "mode,scans per second" line per output mode.
+
+RUN_SECONDS=${1:-1}
+LENGTH=${2:-4096}
+BIN=${BIN:-.}
+
+ROOT=$(mktemp -d "${TMPDIR:-/tmp}/iio_bench.XXXXXX") || exit 1
+trap 'rm -rf "$ROOT"' EXIT
+trap 'exit 1' INT TERM
+
+# run <rate> <iio_ring options>, succeeds if no scan was dropped
+run() {
+	rate=$1
+	shift
+	rm -rf "$ROOT/tree"
+	"$BIN/iio_sim" -r "$rate" -n $((rate * RUN_SECONDS)) -l "$LENGTH" \
+		"$ROOT/tree" 2>"$ROOT/sim.log" &
+	sim=$!
+	while [ ! -p "$ROOT/tree/dev/iio/ring_event_line0" ]; do
+		kill -0 $sim 2>/dev/null || return 1
+		sleep 0.01
+	done
+	"$BIN/iio_ring" --root "$ROOT/tree" -D sim0 -l "$LENGTH" \
+		-o /dev/null "$@" >/dev/null 2>&1
+	ring=$?
+	wait $sim
+	[ $? -eq 0 ] && [ $ring -eq 0 ]
+}
+
+echo "mode,scans_per_second"
+for mode in binary:-b csv:-c xml:-x table:; do
+	name=${mode%%:*}
+	flag=${mode#*:}
+	good=0
+	bad=0
+	rate=1000
+	while [ $rate -le 67108864 ]; do
+		if run $rate $flag; then
+			good=$rate
+			rate=$((rate * 2))
+		else
+			bad=$rate
+			break
+		fi
+	done
+	if [ $bad -gt 0 ] && [ $good -gt 0 ]; then
+		for step in 1 2 3; do
+			rate=$(((good + bad) / 2))
+			if run $rate $flag; then
+				good=$rate
+			else
+				bad=$rate
+			fi
+		done
+	fi
+	echo "$name,$good"
+done